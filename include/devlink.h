@@ -0,0 +1,133 @@
+/*
+ *   devlink.h - Devlink client library
+ *   Copyright (C) 2016 Jiri Pirko <jiri@mellanox.com>
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _DEVLINK_H_
+#define _DEVLINK_H_
+
+#include <stdint.h>
+#include <libmnl/libmnl.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Devices and ports are kept in contiguous arrays sorted by their
+ * indexes. Strings are interned in a per-table pool and referred to by
+ * offset; use devlink_str() to get at them. Offset 0 is the empty
+ * string, used for attributes the kernel did not send.
+ *
+ * Pointers returned by lookups and iterators are valid until the table
+ * is modified again.
+ */
+
+typedef uint32_t devlink_str_t;
+
+struct devlink_dev {
+	uint32_t index;
+	devlink_str_t name;
+	devlink_str_t bus_name;
+	devlink_str_t dev_name;
+	uint32_t port_first;	/* position of the first port of the device */
+	uint32_t port_count;
+};
+
+#define DEVLINK_PORT_F_TYPE		(1 << 0)
+#define DEVLINK_PORT_F_DESIRED_TYPE	(1 << 1)
+#define DEVLINK_PORT_F_NETDEV_IFINDEX	(1 << 2)
+
+struct devlink_port {
+	uint32_t index;		/* index of the device the port belongs to */
+	uint32_t port_index;
+	uint16_t type;
+	uint16_t desired_type;
+	uint32_t flags;
+	uint32_t netdev_ifindex;
+	devlink_str_t netdev_name;
+	devlink_str_t ibdev_name;
+};
+
+struct devlink;
+struct devlink_table;
+struct mnlg_socket;
+
+struct devlink *devlink_open(void);
+struct devlink *devlink_attach(struct mnlg_socket *nlg);
+void devlink_close(struct devlink *dl);
+const char *devlink_error_msg(struct devlink *dl);
+struct devlink_table *devlink_table_alloc(void);
+void devlink_table_free(struct devlink_table *tbl);
+void devlink_table_clear(struct devlink_table *tbl);
+
+int devlink_dump(struct devlink *dl, struct devlink_table *tbl);
+int devlink_port_dump(struct devlink *dl, struct devlink_table *tbl);
+int devlink_dev_query(struct devlink *dl, struct devlink_table *tbl,
+		      uint32_t index);
+int devlink_port_query(struct devlink *dl, struct devlink_table *tbl,
+		       uint32_t index, uint32_t port_index);
+int devlink_table_update(struct devlink_table *tbl,
+			 const struct nlmsghdr *nlh);
+
+const char *devlink_str(const struct devlink_table *tbl, devlink_str_t str);
+unsigned int devlink_dev_count(struct devlink_table *tbl);
+unsigned int devlink_port_count(struct devlink_table *tbl);
+const struct devlink_dev *devlink_dev_lookup(struct devlink_table *tbl,
+					     uint32_t index);
+const struct devlink_dev *devlink_dev_lookup_name(struct devlink_table *tbl,
+						  const char *name);
+const struct devlink_port *devlink_port_lookup(struct devlink_table *tbl,
+					       uint32_t index,
+					       uint32_t port_index);
+const struct devlink_port *
+devlink_port_lookup_netdev(struct devlink_table *tbl, const char *name);
+const struct devlink_port *
+devlink_port_lookup_ifindex(struct devlink_table *tbl, uint32_t ifindex);
+const struct devlink_port *
+devlink_port_lookup_ibdev(struct devlink_table *tbl, const char *name);
+const struct devlink_dev *devlink_dev_next(struct devlink_table *tbl,
+					   const struct devlink_dev *dev);
+const struct devlink_port *devlink_port_next(struct devlink_table *tbl,
+					     const struct devlink_port *port);
+const struct devlink_port *
+devlink_dev_port_next(struct devlink_table *tbl, const struct devlink_dev *dev,
+		      const struct devlink_port *port);
+
+#define devlink_dev_for_each(dev, tbl)				\
+	for (dev = devlink_dev_next(tbl, NULL); dev;		\
+	     dev = devlink_dev_next(tbl, dev))
+
+#define devlink_port_for_each(port, tbl)			\
+	for (port = devlink_port_next(tbl, NULL); port;		\
+	     port = devlink_port_next(tbl, port))
+
+#define devlink_dev_port_for_each(port, tbl, dev)		\
+	for (port = devlink_dev_port_next(tbl, dev, NULL); port;	\
+	     port = devlink_dev_port_next(tbl, dev, port))
+
+/* For callers doing their own message handling; data points to an
+ * array of DEVLINK_ATTR_MAX + 1 attribute pointers.
+ */
+int devlink_attr_cb(const struct nlattr *attr, void *data);
+const char *devlink_port_type_name(uint16_t type);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* _DEVLINK_H_ */
@@ -0,0 +1,250 @@
+/*
+ *   dlcache.h - Shared-memory devlink state cache
+ *   Copyright (C) 2016 Jiri Pirko <jiri@mellanox.com>
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _DLCACHE_H_
+#define _DLCACHE_H_
+
+/*
+ * The cache is written by "dl daemon" only. Readers map the region
+ * read-only and copy records out under the sequence counter: an odd
+ * value means an update is in progress, a changed value means the copy
+ * raced with an update and has to be retried.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DLCACHE_DEFAULT_NAME "/devlink-cache"
+#define DLCACHE_MAGIC 0x444c4331 /* "DLC1" */
+#define DLCACHE_VERSION 1
+
+#define DLCACHE_DEV_MAX 256
+#define DLCACHE_PORT_MAX 8192
+#define DLCACHE_NAME_LEN 32
+#define DLCACHE_IFNAME_LEN 16
+
+#define DLCACHE_PORT_F_TYPE		(1 << 0)
+#define DLCACHE_PORT_F_DESIRED_TYPE	(1 << 1)
+#define DLCACHE_PORT_F_NETDEV_IFINDEX	(1 << 2)
+
+struct dlcache_dev {
+	uint32_t index;
+	char name[DLCACHE_NAME_LEN];
+	char bus_name[DLCACHE_NAME_LEN];
+	char dev_name[DLCACHE_NAME_LEN * 2];
+	uint32_t pad[7];
+}; /* 160 bytes */
+
+struct dlcache_port {
+	uint32_t index;
+	uint32_t port_index;
+	uint16_t type;
+	uint16_t desired_type;
+	uint32_t flags;
+	uint32_t netdev_ifindex;
+	char netdev_name[DLCACHE_IFNAME_LEN];
+	char ibdev_name[DLCACHE_NAME_LEN * 2];
+	uint32_t pad[7];
+}; /* 128 bytes */
+
+struct dlcache_shm {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t pid;
+	uint32_t dev_max;
+	uint32_t port_max;
+	uint8_t pad1[44];
+	/* Own cache line, written on every update. */
+	uint32_t seq;
+	uint32_t dev_count;
+	uint32_t port_count;
+	uint32_t pad2;
+	uint64_t generation;
+	uint8_t pad3[40];
+	struct dlcache_dev devs[DLCACHE_DEV_MAX];
+	struct dlcache_port ports[DLCACHE_PORT_MAX];
+};
+
+static inline const struct dlcache_shm *dlcache_map(const char *name)
+{
+	const struct dlcache_shm *shm;
+	struct stat st;
+	int fd;
+
+	fd = shm_open(name ? name : DLCACHE_DEFAULT_NAME, O_RDONLY, 0);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0)
+		goto err_close;
+	if (st.st_size < (off_t) sizeof(*shm)) {
+		errno = EPROTO;
+		goto err_close;
+	}
+	shm = mmap(NULL, sizeof(*shm), PROT_READ, MAP_SHARED, fd, 0);
+	if (shm == MAP_FAILED)
+		goto err_close;
+	close(fd);
+
+	if (shm->magic != DLCACHE_MAGIC || shm->version != DLCACHE_VERSION) {
+		munmap((void *) shm, sizeof(*shm));
+		errno = EPROTO;
+		return NULL;
+	}
+	return shm;
+
+err_close:
+	close(fd);
+	return NULL;
+}
+
+static inline void dlcache_unmap(const struct dlcache_shm *shm)
+{
+	munmap((void *) shm, sizeof(*shm));
+}
+
+/* Returns false in case the daemon which maintains the cache is gone. */
+static inline bool dlcache_alive(const struct dlcache_shm *shm)
+{
+	return kill(shm->pid, 0) == 0 || errno == EPERM;
+}
+
+/* An update keeps the sequence odd for microseconds. One that stays odd
+ * this long was left behind by a daemon which died halfway through.
+ */
+#define DLCACHE_READ_SPINS	(1U << 24)
+
+/* Returns an odd sequence if the writer never finished. */
+static inline uint32_t dlcache_read_begin(const struct dlcache_shm *shm)
+{
+	unsigned int spins = DLCACHE_READ_SPINS;
+	uint32_t seq;
+
+	while (((seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE)) & 1) &&
+	       --spins)
+		;
+	return seq;
+}
+
+static inline bool dlcache_read_retry(const struct dlcache_shm *shm,
+				      uint32_t seq)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&shm->seq, __ATOMIC_RELAXED) != seq;
+}
+
+/* Copies up to max devices, returns the number copied or -1 with errno
+ * set to EBUSY if the cache is stuck in an update.
+ */
+static inline int dlcache_devs_get(const struct dlcache_shm *shm,
+				   struct dlcache_dev *devs, unsigned int max)
+{
+	unsigned int count;
+	uint32_t seq;
+
+	do {
+		seq = dlcache_read_begin(shm);
+		if (seq & 1) {
+			errno = EBUSY;
+			return -1;
+		}
+		count = shm->dev_count;
+		if (count > DLCACHE_DEV_MAX)
+			count = DLCACHE_DEV_MAX;
+		if (count > max)
+			count = max;
+		memcpy(devs, shm->devs, count * sizeof(*devs));
+	} while (dlcache_read_retry(shm, seq));
+	return count;
+}
+
+/* Same as dlcache_devs_get(), for ports. */
+static inline int dlcache_ports_get(const struct dlcache_shm *shm,
+				    struct dlcache_port *ports,
+				    unsigned int max)
+{
+	unsigned int count;
+	uint32_t seq;
+
+	do {
+		seq = dlcache_read_begin(shm);
+		if (seq & 1) {
+			errno = EBUSY;
+			return -1;
+		}
+		count = shm->port_count;
+		if (count > DLCACHE_PORT_MAX)
+			count = DLCACHE_PORT_MAX;
+		if (count > max)
+			count = max;
+		memcpy(ports, shm->ports, count * sizeof(*ports));
+	} while (dlcache_read_retry(shm, seq));
+	return count;
+}
+
+static inline int dlcache_port_get(const struct dlcache_shm *shm,
+				   uint32_t index, uint32_t port_index,
+				   struct dlcache_port *port)
+{
+	unsigned int count;
+	unsigned int i;
+	bool found;
+	uint32_t seq;
+
+	do {
+		seq = dlcache_read_begin(shm);
+		if (seq & 1) {
+			errno = EBUSY;
+			return -1;
+		}
+		count = shm->port_count;
+		if (count > DLCACHE_PORT_MAX)
+			count = DLCACHE_PORT_MAX;
+		found = false;
+		for (i = 0; i < count; i++) {
+			if (shm->ports[i].index == index &&
+			    shm->ports[i].port_index == port_index) {
+				memcpy(port, &shm->ports[i], sizeof(*port));
+				found = true;
+				break;
+			}
+		}
+	} while (dlcache_read_retry(shm, seq));
+	if (!found) {
+		errno = ENOENT;
+		return -1;
+	}
+	return 0;
+}
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* _DLCACHE_H_ */
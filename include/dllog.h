@@ -0,0 +1,126 @@
+/*
+ *   dllog.h - Binary devlink event log format
+ *   Copyright (C) 2016 Jiri Pirko <jiri@mellanox.com>
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _DLLOG_H_
+#define _DLLOG_H_
+
+/*
+ * Written by "dl monitor -o FILE". The file starts with a header of
+ * DLLOG_HEADER_SIZE bytes, followed by blocks of block_size bytes. Each
+ * block starts with a struct dllog_block and is filled with records:
+ * a struct dllog_rec followed by the raw netlink message, padded to
+ * DLLOG_ALIGN. A record never crosses a block boundary.
+ *
+ * On a clean close a copy of all block headers, in block order, is
+ * appended after the last block and index_offset is set. Without it,
+ * readers have to walk the block headers in place.
+ *
+ * Version 2 logs ("dl monitor -o FILE --compress") hold the same blocks,
+ * each encoded on its own so that it can be read without the others.
+ * Payloads of mlx_emad messages have everything past the operation TLV
+ * XORed with the previous payload of the same device, direction and
+ * register in the block, then the records are LZ compressed. A block
+ * takes sizeof(struct dllog_block) + csize bytes, padded to DLLOG_ALIGN,
+ * and the next one follows right after it. The index is followed by
+ * block_count 64-bit file offsets of the blocks.
+ *
+ * All fields are in host byte order.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DLLOG_MAGIC 0x444c4c31 /* "DLL1" */
+#define DLLOG_BLOCK_MAGIC 0x444c4c42 /* "DLLB" */
+#define DLLOG_VERSION 1
+#define DLLOG_VERSION_COMPRESSED 2
+
+#define DLLOG_HEADER_SIZE 4096
+#define DLLOG_BLOCK_SIZE 65536
+#define DLLOG_ALIGN 8
+#define DLLOG_DEV_MAX 120
+#define DLLOG_DEV_NAME_LEN 28
+#define DLLOG_DEV_BITMAP_BITS 256
+
+/* Devices known when the log was started. */
+struct dllog_dev {
+	uint32_t index;
+	char name[DLLOG_DEV_NAME_LEN];
+}; /* 32 bytes */
+
+struct dllog_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t block_size;
+	uint32_t dev_count;
+	uint64_t block_count;	/* set on close, 0 if the writer died */
+	uint64_t index_offset;	/* set on close, 0 if the writer died */
+	uint8_t pad[32];
+	struct dllog_dev devs[DLLOG_DEV_MAX];
+};
+
+struct dllog_block {
+	uint32_t magic;
+	uint32_t count;		/* records in the block */
+	uint32_t used;		/* bytes of records following the header */
+	uint32_t csize;		/* version 2: bytes stored, == used if raw */
+	uint64_t first_ts;	/* CLOCK_REALTIME nanoseconds */
+	uint64_t last_ts;
+	/* Bit (index % DLLOG_DEV_BITMAP_BITS) is set for every device
+	 * having a record in the block.
+	 */
+	uint64_t dev_bitmap[DLLOG_DEV_BITMAP_BITS / 64];
+}; /* 64 bytes */
+
+#define DLLOG_DEV_NONE UINT32_MAX
+
+struct dllog_rec {
+	uint64_t ts;		/* CLOCK_REALTIME nanoseconds */
+	uint32_t len;		/* of the netlink message that follows */
+	uint32_t dev;		/* devlink index, DLLOG_DEV_NONE if none */
+};
+
+/* Computed in size_t, a corrupt len must not wrap around to a small size. */
+static inline size_t dllog_rec_size(uint32_t len)
+{
+	return (sizeof(struct dllog_rec) + (size_t) len + DLLOG_ALIGN - 1) &
+	       ~((size_t) DLLOG_ALIGN - 1);
+}
+
+static inline void dllog_bitmap_set(uint64_t *bitmap, uint32_t index)
+{
+	index %= DLLOG_DEV_BITMAP_BITS;
+	bitmap[index / 64] |= 1ULL << (index % 64);
+}
+
+static inline int dllog_bitmap_test(const uint64_t *bitmap, uint32_t index)
+{
+	index %= DLLOG_DEV_BITMAP_BITS;
+	return !!(bitmap[index / 64] & (1ULL << (index % 64)));
+}
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* _DLLOG_H_ */
@@ -0,0 +1,99 @@
+/*
+ *   dlsnap.h - Binary devlink state snapshot format
+ *   Copyright (C) 2016 Jiri Pirko <jiri@mellanox.com>
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _DLSNAP_H_
+#define _DLSNAP_H_
+
+/*
+ * Written by "dl snapshot save FILE". The file is a struct dlsnap_header
+ * followed by rec_count records of rec_size bytes, one per device and
+ * per port, sorted by dlsnap_rec_cmp(). Instead of the attributes, each
+ * record holds a hash of them, taken over everything behind the genl
+ * header of the message the kernel dumped.
+ *
+ * All fields are in host byte order.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DLSNAP_MAGIC 0x444c5331 /* "DLS1" */
+#define DLSNAP_VERSION 1
+
+#define DLSNAP_NAME_LEN 40
+
+struct dlsnap_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t rec_size;
+	uint32_t pad1;
+	uint64_t rec_count;
+	uint64_t time;		/* CLOCK_REALTIME nanoseconds */
+	uint8_t pad2[32];
+}; /* 64 bytes */
+
+enum dlsnap_rec_kind {
+	DLSNAP_REC_DEV,
+	DLSNAP_REC_PORT,
+};
+
+struct dlsnap_rec {
+	uint32_t index;
+	uint32_t kind;		/* enum dlsnap_rec_kind */
+	uint32_t port_index;	/* 0 for devices */
+	uint32_t pad;
+	uint64_t hash;
+	char name[DLSNAP_NAME_LEN];	/* of the device */
+}; /* 64 bytes */
+
+/* 64-bit FNV-1a */
+static inline uint64_t dlsnap_hash(const void *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char *) data;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	while (len--) {
+		hash ^= *p++;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/* Devices by index, each followed by its ports by port index. */
+static inline int dlsnap_rec_cmp(const struct dlsnap_rec *a,
+				 const struct dlsnap_rec *b)
+{
+	if (a->index != b->index)
+		return a->index < b->index ? -1 : 1;
+	if (a->kind != b->kind)
+		return a->kind < b->kind ? -1 : 1;
+	if (a->port_index != b->port_index)
+		return a->port_index < b->port_index ? -1 : 1;
+	return 0;
+}
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* _DLSNAP_H_ */
@@ -20,6 +20,7 @@
 #ifndef _MNLG_H_
 #define _MNLG_H_
 
+#include <time.h>
 #include <libmnl/libmnl.h>
 
 #ifdef __cplusplus
@@ -28,13 +29,71 @@ extern "C" {
 
 struct mnlg_socket;
 
+/* Counters accumulated since the socket was opened, including the
+ * family resolution done by mnlg_socket_open().
+ */
+struct mnlg_stats {
+	uint64_t send_calls;
+	uint64_t send_bytes;
+	uint64_t recv_calls;	/* recvmsg() or io_uring_enter() */
+	uint64_t recv_bytes;
+	uint64_t recv_msgs;
+	uint64_t recv_wait_ns;	/* blocked waiting for datagrams */
+	uint64_t cb_ns;		/* spent running message callbacks */
+	uint64_t other_calls;	/* socket(), bind(), setsockopt() */
+};
+
+/* ts is the kernel receive time of the datagram carrying the message,
+ * NULL unless mnlg_socket_timestamp_enable() was called.
+ */
+typedef int (*mnlg_ts_cb_t)(const struct nlmsghdr *nlh,
+			    const struct timespec *ts, void *data);
+
 struct nlmsghdr *mnlg_msg_prepare(struct mnlg_socket *nlg, uint8_t cmd,
 				  uint16_t flags);
 int mnlg_socket_send(struct mnlg_socket *nlg, const struct nlmsghdr *nlh);
 int mnlg_socket_recv_run(struct mnlg_socket *nlg, mnl_cb_t data_cb, void *data);
+int mnlg_socket_recv_run_ts(struct mnlg_socket *nlg, mnlg_ts_cb_t data_cb,
+			    void *data);
+int mnlg_socket_timestamp_enable(struct mnlg_socket *nlg);
+/* Moves the socket over to io_uring. Returns -1 with errno set if that
+ * is not possible, the socket then keeps working as before. Once
+ * enabled, requests go out with the next mnlg_socket_recv_run(), which
+ * also reports send errors, messages come without timestamps and the
+ * fd must not be polled or read directly.
+ */
+int mnlg_socket_uring_enable(struct mnlg_socket *nlg);
 int mnlg_socket_group_add(struct mnlg_socket *nlg, const char *group_name);
 struct mnlg_socket *mnlg_socket_open(const char *family_name, uint8_t version);
 void mnlg_socket_close(struct mnlg_socket *nlg);
+int mnlg_socket_get_fd(struct mnlg_socket *nlg);
+void mnlg_socket_stats_get(struct mnlg_socket *nlg, struct mnlg_stats *stats);
+/* Extended ack of the last mnlg_socket_recv_run(). The message is NULL
+ * and the offset of the offending attribute in the request 0 if the
+ * kernel did not provide them.
+ */
+const char *mnlg_socket_ext_ack_msg(struct mnlg_socket *nlg);
+uint32_t mnlg_socket_ext_ack_offset(struct mnlg_socket *nlg);
+
+/* A set of requests built once and sent again and again, all in one
+ * datagram. Each mnlg_batch_msg_prepare() appends a request, which is
+ * always acked; its attributes have to be put before the next one is
+ * prepared. A send only patches in fresh sequence numbers, request i
+ * carries mnlg_batch_seq() + i. mnlg_batch_recv_run() returns once every
+ * request got its ack, the errno each one failed with, 0 on success, is
+ * left for mnlg_batch_msg_error(). Not available with io_uring.
+ */
+struct mnlg_batch;
+
+struct mnlg_batch *mnlg_batch_create(struct mnlg_socket *nlg);
+void mnlg_batch_destroy(struct mnlg_batch *batch);
+struct nlmsghdr *mnlg_batch_msg_prepare(struct mnlg_batch *batch, uint8_t cmd,
+					uint16_t flags);
+int mnlg_batch_send(struct mnlg_batch *batch);
+int mnlg_batch_recv_run(struct mnlg_batch *batch, mnl_cb_t data_cb,
+			void *data);
+unsigned int mnlg_batch_seq(struct mnlg_batch *batch);
+int mnlg_batch_msg_error(struct mnlg_batch *batch, unsigned int i);
 
 #ifdef __cplusplus
 } /* extern "C" */
@@ -0,0 +1,91 @@
+/*
+ *   usdt.h - Userspace statically defined tracepoints
+ *   Copyright (C) 2016 Jiri Pirko <jiri@mellanox.com>
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _T_USDT_H_
+#define _T_USDT_H_
+
+/*
+ * Emits the same .note.stapsdt records as <sys/sdt.h>, so perf, bpftrace,
+ * bcc and systemtap find the probes, without needing systemtap headers at
+ * build time. A probe site is a single nop; there are no semaphores, the
+ * arguments are always evaluated. Arguments must be integers of at most
+ * 8 bytes.
+ *
+ * Define USDT_DISABLE to compile the probes out.
+ */
+
+#if !defined(USDT_DISABLE) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__) || defined(__aarch64__))
+
+#if __SIZEOF_POINTER__ == 8
+#define _USDT_ADDR ".8byte"
+#else
+#define _USDT_ADDR ".4byte"
+#endif
+
+/* Argument spec is "[-]SIZE@OPERAND", negative size for signed types. */
+#define _USDT_SIZE(x) \
+	((((__typeof__(x)) -1 < (__typeof__(x)) 1) ? 1 : -1) * (int) sizeof(x))
+
+#define _USDT_ARG(n, x) \
+	[_usdt_s##n] "n" (_USDT_SIZE(x)), [_usdt_a##n] "nor" (x)
+
+#define _USDT_NOTE(provider, name, args)				\
+	"990:	nop\n"							\
+	".pushsection .note.stapsdt,\"?\",\"note\"\n"			\
+	".balign 4\n"							\
+	".4byte 992f-991f, 994f-993f, 3\n"				\
+	"991:	.asciz \"stapsdt\"\n"					\
+	"992:	.balign 4\n"						\
+	"993:	" _USDT_ADDR " 990b\n"					\
+	_USDT_ADDR " _.stapsdt.base\n"					\
+	_USDT_ADDR " 0\n"						\
+	".asciz \"" #provider "\"\n"					\
+	".asciz \"" #name "\"\n"					\
+	".asciz \"" args "\"\n"						\
+	"994:	.balign 4\n"						\
+	".popsection\n"							\
+	".ifndef _.stapsdt.base\n"					\
+	".pushsection .stapsdt.base,\"aG\",\"progbits\","		\
+	".stapsdt.base,comdat\n"					\
+	".weak _.stapsdt.base\n"					\
+	".hidden _.stapsdt.base\n"					\
+	"_.stapsdt.base: .space 1\n"					\
+	".size _.stapsdt.base, 1\n"					\
+	".popsection\n"							\
+	".endif\n"
+
+#define USDT_PROBE4(provider, name, a1, a2, a3, a4)			\
+	__asm__ __volatile__(						\
+		_USDT_NOTE(provider, name,				\
+			   "%n[_usdt_s1]@%[_usdt_a1] "			\
+			   "%n[_usdt_s2]@%[_usdt_a2] "			\
+			   "%n[_usdt_s3]@%[_usdt_a3] "			\
+			   "%n[_usdt_s4]@%[_usdt_a4]")			\
+		:: _USDT_ARG(1, a1), _USDT_ARG(2, a2),			\
+		   _USDT_ARG(3, a3), _USDT_ARG(4, a4))
+
+#else
+
+#define USDT_PROBE4(provider, name, a1, a2, a3, a4)			\
+	do {} while (0)
+
+#endif
+
+#endif /* _T_USDT_H_ */
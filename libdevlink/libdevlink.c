@@ -0,0 +1,944 @@
+/*
+ *   libdevlink.c - Devlink client library
+ *   Copyright (C) 2016 Jiri Pirko <jiri@mellanox.com>
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <libmnl/libmnl.h>
+#include <linux/genetlink.h>
+#include <linux/devlink.h>
+#include <mnlg.h>
+#include <devlink.h>
+
+#define DEVLINK_EXPORT __attribute__ ((visibility("default")))
+
+struct devlink {
+	struct mnlg_socket *nlg;
+	bool own_nlg;
+};
+
+/* Maps a port key to its position in the port array plus one. */
+struct port_hash {
+	uint32_t *slots;
+	uint32_t size;
+};
+
+struct devlink_table {
+	struct devlink_dev *devs;
+	unsigned int dev_count;
+	unsigned int dev_alloc;
+	struct devlink_port *ports;
+	unsigned int port_count;
+	unsigned int port_alloc;
+	bool unsorted;		/* arrays were appended to out of order */
+	bool ranges_stale;	/* port_first/port_count of devs are stale */
+	char *strs;
+	uint32_t strs_len;
+	uint32_t strs_alloc;
+	uint32_t *str_hash;	/* open addressing, 0 marks a free slot */
+	uint32_t str_hash_size;
+	uint32_t str_hash_count;
+	struct port_hash netdev_hash;
+	struct port_hash ifindex_hash;
+	struct port_hash ibdev_hash;
+	bool port_hash_stale;	/* reverse indexes need rebuild */
+};
+
+DEVLINK_EXPORT
+int devlink_attr_cb(const struct nlattr *attr, void *data)
+{
+	const struct nlattr **tb = data;
+	int type;
+
+	type = mnl_attr_get_type(attr);
+
+	if (mnl_attr_type_valid(attr, DEVLINK_ATTR_MAX) < 0)
+		return MNL_CB_ERROR;
+
+	if (type == DEVLINK_ATTR_INDEX &&
+	    mnl_attr_validate(attr, MNL_TYPE_U32) < 0)
+		return MNL_CB_ERROR;
+	if (type == DEVLINK_ATTR_NAME &&
+	    mnl_attr_validate(attr, MNL_TYPE_NUL_STRING) < 0)
+		return MNL_CB_ERROR;
+	if (type == DEVLINK_ATTR_BUS_NAME &&
+	    mnl_attr_validate(attr, MNL_TYPE_NUL_STRING) < 0)
+		return MNL_CB_ERROR;
+	if (type == DEVLINK_ATTR_DEV_NAME &&
+	    mnl_attr_validate(attr, MNL_TYPE_NUL_STRING) < 0)
+		return MNL_CB_ERROR;
+	if (type == DEVLINK_ATTR_PORT_INDEX &&
+	    mnl_attr_validate(attr, MNL_TYPE_U32) < 0)
+		return MNL_CB_ERROR;
+	if (type == DEVLINK_ATTR_PORT_TYPE &&
+	    mnl_attr_validate(attr, MNL_TYPE_U16) < 0)
+		return MNL_CB_ERROR;
+	if (type == DEVLINK_ATTR_PORT_DESIRED_TYPE &&
+	    mnl_attr_validate(attr, MNL_TYPE_U16) < 0)
+		return MNL_CB_ERROR;
+	if (type == DEVLINK_ATTR_PORT_NETDEV_IFINDEX &&
+	    mnl_attr_validate(attr, MNL_TYPE_U32) < 0)
+		return MNL_CB_ERROR;
+	if (type == DEVLINK_ATTR_PORT_NETDEV_NAME &&
+	    mnl_attr_validate(attr, MNL_TYPE_NUL_STRING) < 0)
+		return MNL_CB_ERROR;
+	if (type == DEVLINK_ATTR_PORT_IBDEV_NAME &&
+	    mnl_attr_validate(attr, MNL_TYPE_NUL_STRING) < 0)
+		return MNL_CB_ERROR;
+	tb[type] = attr;
+	return MNL_CB_OK;
+}
+
+DEVLINK_EXPORT
+const char *devlink_port_type_name(uint16_t type)
+{
+	switch (type) {
+	case DEVLINK_PORT_TYPE_NOTSET: return "notset";
+	case DEVLINK_PORT_TYPE_AUTO: return "auto";
+	case DEVLINK_PORT_TYPE_ETH: return "eth";
+	case DEVLINK_PORT_TYPE_IB: return "ib";
+	default: return "<unknown type>";
+	}
+}
+
+static uint32_t str_hash_fn(const char *str)
+{
+	uint32_t hash = 2166136261u;
+
+	while (*str) {
+		hash ^= (unsigned char) *str++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static void str_hash_insert(uint32_t *hash, uint32_t size,
+			    const char *str, uint32_t offset)
+{
+	uint32_t i;
+
+	for (i = str_hash_fn(str) & (size - 1); hash[i]; i = (i + 1) & (size - 1))
+		;
+	hash[i] = offset;
+}
+
+static int str_hash_grow(struct devlink_table *tbl)
+{
+	uint32_t size = tbl->str_hash_size ? tbl->str_hash_size * 2 : 256;
+	uint32_t *hash;
+	uint32_t i;
+
+	hash = calloc(size, sizeof(*hash));
+	if (!hash)
+		return -1;
+	for (i = 0; i < tbl->str_hash_size; i++)
+		if (tbl->str_hash[i])
+			str_hash_insert(hash, size,
+					tbl->strs + tbl->str_hash[i],
+					tbl->str_hash[i]);
+	free(tbl->str_hash);
+	tbl->str_hash = hash;
+	tbl->str_hash_size = size;
+	return 0;
+}
+
+static int str_intern(struct devlink_table *tbl, const char *str,
+		      devlink_str_t *p_str)
+{
+	uint32_t mask;
+	size_t len;
+	uint32_t i;
+
+	if (!*str) {
+		*p_str = 0;
+		return 0;
+	}
+	if ((tbl->str_hash_count + 1) * 2 > tbl->str_hash_size &&
+	    str_hash_grow(tbl))
+		return -1;
+
+	mask = tbl->str_hash_size - 1;
+	for (i = str_hash_fn(str) & mask; tbl->str_hash[i]; i = (i + 1) & mask) {
+		if (strcmp(tbl->strs + tbl->str_hash[i], str) == 0) {
+			*p_str = tbl->str_hash[i];
+			return 0;
+		}
+	}
+
+	len = strlen(str) + 1;
+	if (tbl->strs_len + len > tbl->strs_alloc) {
+		uint32_t alloc = tbl->strs_alloc * 2;
+		char *strs;
+
+		while (tbl->strs_len + len > alloc)
+			alloc *= 2;
+		strs = realloc(tbl->strs, alloc);
+		if (!strs)
+			return -1;
+		tbl->strs = strs;
+		tbl->strs_alloc = alloc;
+	}
+	memcpy(tbl->strs + tbl->strs_len, str, len);
+	tbl->str_hash[i] = tbl->strs_len;
+	tbl->str_hash_count++;
+	*p_str = tbl->strs_len;
+	tbl->strs_len += len;
+	return 0;
+}
+
+/* Returns 0 in case the string was never interned. */
+static devlink_str_t str_lookup(const struct devlink_table *tbl,
+				const char *str)
+{
+	uint32_t mask = tbl->str_hash_size - 1;
+	uint32_t i;
+
+	if (!*str || !tbl->str_hash_size)
+		return 0;
+	for (i = str_hash_fn(str) & mask; tbl->str_hash[i]; i = (i + 1) & mask)
+		if (strcmp(tbl->strs + tbl->str_hash[i], str) == 0)
+			return tbl->str_hash[i];
+	return 0;
+}
+
+static int str_intern_attr(struct devlink_table *tbl,
+			   const struct nlattr *attr, devlink_str_t *p_str)
+{
+	if (!attr) {
+		*p_str = 0;
+		return 0;
+	}
+	return str_intern(tbl, mnl_attr_get_str(attr), p_str);
+}
+
+DEVLINK_EXPORT
+const char *devlink_str(const struct devlink_table *tbl, devlink_str_t str)
+{
+	return tbl->strs + str;
+}
+
+static int array_grow(void **p_array, unsigned int *p_alloc,
+		      unsigned int count, size_t elem_size)
+{
+	unsigned int alloc;
+	void *array;
+
+	if (count < *p_alloc)
+		return 0;
+	alloc = *p_alloc ? *p_alloc * 2 : 16;
+	array = realloc(*p_array, alloc * elem_size);
+	if (!array)
+		return -1;
+	*p_array = array;
+	*p_alloc = alloc;
+	return 0;
+}
+
+DEVLINK_EXPORT
+struct devlink_table *devlink_table_alloc(void)
+{
+	struct devlink_table *tbl;
+
+	tbl = calloc(1, sizeof(*tbl));
+	if (!tbl)
+		return NULL;
+	tbl->strs_alloc = 4096;
+	tbl->strs = malloc(tbl->strs_alloc);
+	if (!tbl->strs) {
+		free(tbl);
+		return NULL;
+	}
+	tbl->strs[0] = '\0';
+	tbl->strs_len = 1;
+	tbl->port_hash_stale = true;
+	return tbl;
+}
+
+DEVLINK_EXPORT
+void devlink_table_free(struct devlink_table *tbl)
+{
+	free(tbl->ibdev_hash.slots);
+	free(tbl->ifindex_hash.slots);
+	free(tbl->netdev_hash.slots);
+	free(tbl->str_hash);
+	free(tbl->strs);
+	free(tbl->ports);
+	free(tbl->devs);
+	free(tbl);
+}
+
+DEVLINK_EXPORT
+void devlink_table_clear(struct devlink_table *tbl)
+{
+	tbl->dev_count = 0;
+	tbl->port_count = 0;
+	tbl->unsorted = false;
+	tbl->ranges_stale = false;
+	tbl->port_hash_stale = true;
+	tbl->strs_len = 1;
+	tbl->str_hash_count = 0;
+	if (tbl->str_hash)
+		memset(tbl->str_hash, 0,
+		       tbl->str_hash_size * sizeof(*tbl->str_hash));
+}
+
+static int dev_cmp(const void *a, const void *b)
+{
+	const struct devlink_dev *dev_a = a;
+	const struct devlink_dev *dev_b = b;
+
+	if (dev_a->index != dev_b->index)
+		return dev_a->index < dev_b->index ? -1 : 1;
+	return 0;
+}
+
+static int port_key_cmp(const struct devlink_port *port,
+			uint32_t index, uint32_t port_index)
+{
+	if (port->index != index)
+		return port->index < index ? -1 : 1;
+	if (port->port_index != port_index)
+		return port->port_index < port_index ? -1 : 1;
+	return 0;
+}
+
+static int port_cmp(const void *a, const void *b)
+{
+	const struct devlink_port *port_b = b;
+
+	return port_key_cmp(a, port_b->index, port_b->port_index);
+}
+
+static void table_finalize(struct devlink_table *tbl)
+{
+	struct devlink_dev *dev;
+	unsigned int i = 0;
+	unsigned int j;
+
+	if (tbl->unsorted) {
+		qsort(tbl->devs, tbl->dev_count, sizeof(*tbl->devs), dev_cmp);
+		qsort(tbl->ports, tbl->port_count, sizeof(*tbl->ports),
+		      port_cmp);
+		tbl->unsorted = false;
+		tbl->ranges_stale = true;
+		tbl->port_hash_stale = true;
+	}
+	if (!tbl->ranges_stale)
+		return;
+
+	/* Both arrays are sorted by device index, walk them side by side. */
+	for (j = 0; j < tbl->dev_count; j++) {
+		dev = &tbl->devs[j];
+		while (i < tbl->port_count && tbl->ports[i].index < dev->index)
+			i++;
+		dev->port_first = i;
+		while (i < tbl->port_count && tbl->ports[i].index == dev->index)
+			i++;
+		dev->port_count = i - dev->port_first;
+	}
+	tbl->ranges_stale = false;
+}
+
+/* Returns the position of the device or where it would be inserted. */
+static unsigned int dev_pos(struct devlink_table *tbl, uint32_t index,
+			    bool *found)
+{
+	unsigned int lo = 0;
+	unsigned int hi = tbl->dev_count;
+	unsigned int mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (tbl->devs[mid].index < index)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*found = lo < tbl->dev_count && tbl->devs[lo].index == index;
+	return lo;
+}
+
+static unsigned int port_pos(struct devlink_table *tbl, uint32_t index,
+			     uint32_t port_index, bool *found)
+{
+	unsigned int lo = 0;
+	unsigned int hi = tbl->port_count;
+	unsigned int mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (port_key_cmp(&tbl->ports[mid], index, port_index) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*found = lo < tbl->port_count &&
+		 !port_key_cmp(&tbl->ports[lo], index, port_index);
+	return lo;
+}
+
+static int dev_fill(struct devlink_table *tbl, struct devlink_dev *dev,
+		    struct nlattr **tb)
+{
+	dev->index = mnl_attr_get_u32(tb[DEVLINK_ATTR_INDEX]);
+	if (str_intern_attr(tbl, tb[DEVLINK_ATTR_NAME], &dev->name) ||
+	    str_intern_attr(tbl, tb[DEVLINK_ATTR_BUS_NAME], &dev->bus_name) ||
+	    str_intern_attr(tbl, tb[DEVLINK_ATTR_DEV_NAME], &dev->dev_name))
+		return -1;
+	return 0;
+}
+
+static int port_fill(struct devlink_table *tbl, struct devlink_port *port,
+		     struct nlattr **tb)
+{
+	memset(port, 0, sizeof(*port));
+	port->index = mnl_attr_get_u32(tb[DEVLINK_ATTR_INDEX]);
+	port->port_index = mnl_attr_get_u32(tb[DEVLINK_ATTR_PORT_INDEX]);
+	if (tb[DEVLINK_ATTR_PORT_TYPE]) {
+		port->type = mnl_attr_get_u16(tb[DEVLINK_ATTR_PORT_TYPE]);
+		port->flags |= DEVLINK_PORT_F_TYPE;
+	}
+	if (tb[DEVLINK_ATTR_PORT_DESIRED_TYPE]) {
+		port->desired_type =
+			mnl_attr_get_u16(tb[DEVLINK_ATTR_PORT_DESIRED_TYPE]);
+		port->flags |= DEVLINK_PORT_F_DESIRED_TYPE;
+	}
+	if (tb[DEVLINK_ATTR_PORT_NETDEV_IFINDEX]) {
+		port->netdev_ifindex =
+			mnl_attr_get_u32(tb[DEVLINK_ATTR_PORT_NETDEV_IFINDEX]);
+		port->flags |= DEVLINK_PORT_F_NETDEV_IFINDEX;
+	}
+	if (str_intern_attr(tbl, tb[DEVLINK_ATTR_PORT_NETDEV_NAME],
+			    &port->netdev_name) ||
+	    str_intern_attr(tbl, tb[DEVLINK_ATTR_PORT_IBDEV_NAME],
+			    &port->ibdev_name))
+		return -1;
+	return 0;
+}
+
+/* Dump replies arrive for a cleared table, no need to look anything up. */
+static int dev_append(struct devlink_table *tbl, struct nlattr **tb)
+{
+	struct devlink_dev *dev;
+
+	if (array_grow((void **) &tbl->devs, &tbl->dev_alloc,
+		       tbl->dev_count, sizeof(*tbl->devs)))
+		return -1;
+	dev = &tbl->devs[tbl->dev_count];
+	memset(dev, 0, sizeof(*dev));
+	if (dev_fill(tbl, dev, tb))
+		return -1;
+	tbl->dev_count++;
+	tbl->unsorted = true;
+	return 0;
+}
+
+static int port_append(struct devlink_table *tbl, struct nlattr **tb)
+{
+	if (array_grow((void **) &tbl->ports, &tbl->port_alloc,
+		       tbl->port_count, sizeof(*tbl->ports)))
+		return -1;
+	if (port_fill(tbl, &tbl->ports[tbl->port_count], tb))
+		return -1;
+	tbl->port_count++;
+	tbl->unsorted = true;
+	return 0;
+}
+
+static int dev_upsert(struct devlink_table *tbl, struct nlattr **tb)
+{
+	uint32_t index = mnl_attr_get_u32(tb[DEVLINK_ATTR_INDEX]);
+	struct devlink_dev *dev;
+	unsigned int pos;
+	bool found;
+
+	table_finalize(tbl);
+	pos = dev_pos(tbl, index, &found);
+	if (!found) {
+		if (array_grow((void **) &tbl->devs, &tbl->dev_alloc,
+			       tbl->dev_count, sizeof(*tbl->devs)))
+			return -1;
+		memmove(&tbl->devs[pos + 1], &tbl->devs[pos],
+			(tbl->dev_count - pos) * sizeof(*tbl->devs));
+		memset(&tbl->devs[pos], 0, sizeof(*dev));
+		tbl->dev_count++;
+		tbl->ranges_stale = true;
+	}
+	dev = &tbl->devs[pos];
+	return dev_fill(tbl, dev, tb);
+}
+
+static int port_upsert(struct devlink_table *tbl, struct nlattr **tb)
+{
+	uint32_t index = mnl_attr_get_u32(tb[DEVLINK_ATTR_INDEX]);
+	uint32_t port_index = mnl_attr_get_u32(tb[DEVLINK_ATTR_PORT_INDEX]);
+	unsigned int pos;
+	bool found;
+
+	table_finalize(tbl);
+	pos = port_pos(tbl, index, port_index, &found);
+	if (!found) {
+		if (array_grow((void **) &tbl->ports, &tbl->port_alloc,
+			       tbl->port_count, sizeof(*tbl->ports)))
+			return -1;
+		memmove(&tbl->ports[pos + 1], &tbl->ports[pos],
+			(tbl->port_count - pos) * sizeof(*tbl->ports));
+		tbl->port_count++;
+		tbl->ranges_stale = true;
+	}
+	return port_fill(tbl, &tbl->ports[pos], tb);
+}
+
+static void port_remove(struct devlink_table *tbl, uint32_t index,
+			uint32_t port_index)
+{
+	unsigned int pos;
+	bool found;
+
+	table_finalize(tbl);
+	pos = port_pos(tbl, index, port_index, &found);
+	if (!found)
+		return;
+	memmove(&tbl->ports[pos], &tbl->ports[pos + 1],
+		(tbl->port_count - pos - 1) * sizeof(*tbl->ports));
+	tbl->port_count--;
+	tbl->ranges_stale = true;
+}
+
+static void dev_remove(struct devlink_table *tbl, uint32_t index)
+{
+	struct devlink_dev *dev;
+	unsigned int pos;
+	bool found;
+
+	table_finalize(tbl);
+	pos = dev_pos(tbl, index, &found);
+	if (!found)
+		return;
+	dev = &tbl->devs[pos];
+	memmove(&tbl->ports[dev->port_first],
+		&tbl->ports[dev->port_first + dev->port_count],
+		(tbl->port_count - dev->port_first - dev->port_count) *
+		sizeof(*tbl->ports));
+	tbl->port_count -= dev->port_count;
+	memmove(dev, dev + 1, (tbl->dev_count - pos - 1) * sizeof(*dev));
+	tbl->dev_count--;
+	tbl->ranges_stale = true;
+}
+
+static int table_msg(struct devlink_table *tbl, const struct nlmsghdr *nlh,
+		     bool append)
+{
+	struct nlattr *tb[DEVLINK_ATTR_MAX + 1] = {};
+	struct genlmsghdr *genl = mnl_nlmsg_get_payload(nlh);
+
+	tbl->port_hash_stale = true;
+
+	switch (genl->cmd) {
+	case DEVLINK_CMD_GET: /* fall through */
+	case DEVLINK_CMD_SET: /* fall through */
+	case DEVLINK_CMD_NEW: /* fall through */
+	case DEVLINK_CMD_DEL:
+		mnl_attr_parse(nlh, sizeof(*genl), devlink_attr_cb, tb);
+		if (!tb[DEVLINK_ATTR_INDEX] || !tb[DEVLINK_ATTR_NAME]) {
+			errno = EPROTO;
+			return -1;
+		}
+		if (genl->cmd == DEVLINK_CMD_DEL) {
+			dev_remove(tbl, mnl_attr_get_u32(tb[DEVLINK_ATTR_INDEX]));
+			return 0;
+		}
+		return append ? dev_append(tbl, tb) : dev_upsert(tbl, tb);
+	case DEVLINK_CMD_PORT_GET: /* fall through */
+	case DEVLINK_CMD_PORT_SET: /* fall through */
+	case DEVLINK_CMD_PORT_NEW: /* fall through */
+	case DEVLINK_CMD_PORT_DEL:
+		mnl_attr_parse(nlh, sizeof(*genl), devlink_attr_cb, tb);
+		if (!tb[DEVLINK_ATTR_INDEX] || !tb[DEVLINK_ATTR_PORT_INDEX]) {
+			errno = EPROTO;
+			return -1;
+		}
+		if (genl->cmd == DEVLINK_CMD_PORT_DEL) {
+			port_remove(tbl,
+				    mnl_attr_get_u32(tb[DEVLINK_ATTR_INDEX]),
+				    mnl_attr_get_u32(tb[DEVLINK_ATTR_PORT_INDEX]));
+			return 0;
+		}
+		return append ? port_append(tbl, tb) : port_upsert(tbl, tb);
+	}
+	return 0;
+}
+
+DEVLINK_EXPORT
+int devlink_table_update(struct devlink_table *tbl, const struct nlmsghdr *nlh)
+{
+	return table_msg(tbl, nlh, false);
+}
+
+static int table_append_cb(const struct nlmsghdr *nlh, void *data)
+{
+	return table_msg(data, nlh, true) ? MNL_CB_ERROR : MNL_CB_OK;
+}
+
+static int table_update_cb(const struct nlmsghdr *nlh, void *data)
+{
+	return table_msg(data, nlh, false) ? MNL_CB_ERROR : MNL_CB_OK;
+}
+
+static int devlink_request(struct devlink *dl, struct nlmsghdr *nlh,
+			   mnl_cb_t cb, struct devlink_table *tbl)
+{
+	int err;
+
+	err = mnlg_socket_send(dl->nlg, nlh);
+	if (err < 0)
+		return err;
+	err = mnlg_socket_recv_run(dl->nlg, cb, tbl);
+	if (err < 0)
+		return err;
+	return 0;
+}
+
+DEVLINK_EXPORT
+int devlink_dump(struct devlink *dl, struct devlink_table *tbl)
+{
+	struct nlmsghdr *nlh;
+	int err;
+
+	devlink_table_clear(tbl);
+
+	nlh = mnlg_msg_prepare(dl->nlg, DEVLINK_CMD_GET,
+			       NLM_F_REQUEST | NLM_F_DUMP);
+	err = devlink_request(dl, nlh, table_append_cb, tbl);
+	if (err)
+		return err;
+
+	nlh = mnlg_msg_prepare(dl->nlg, DEVLINK_CMD_PORT_GET,
+			       NLM_F_REQUEST | NLM_F_DUMP);
+	err = devlink_request(dl, nlh, table_append_cb, tbl);
+	if (err)
+		return err;
+
+	table_finalize(tbl);
+	return 0;
+}
+
+DEVLINK_EXPORT
+int devlink_port_dump(struct devlink *dl, struct devlink_table *tbl)
+{
+	struct nlmsghdr *nlh;
+	int err;
+
+	tbl->port_count = 0;
+	tbl->ranges_stale = true;
+	tbl->port_hash_stale = true;
+
+	nlh = mnlg_msg_prepare(dl->nlg, DEVLINK_CMD_PORT_GET,
+			       NLM_F_REQUEST | NLM_F_DUMP);
+	err = devlink_request(dl, nlh, table_append_cb, tbl);
+	if (err)
+		return err;
+
+	table_finalize(tbl);
+	return 0;
+}
+
+DEVLINK_EXPORT
+int devlink_dev_query(struct devlink *dl, struct devlink_table *tbl,
+		      uint32_t index)
+{
+	struct nlmsghdr *nlh;
+
+	nlh = mnlg_msg_prepare(dl->nlg, DEVLINK_CMD_GET,
+			       NLM_F_REQUEST | NLM_F_ACK);
+	mnl_attr_put_u32(nlh, DEVLINK_ATTR_INDEX, index);
+	return devlink_request(dl, nlh, table_update_cb, tbl);
+}
+
+DEVLINK_EXPORT
+int devlink_port_query(struct devlink *dl, struct devlink_table *tbl,
+		       uint32_t index, uint32_t port_index)
+{
+	struct nlmsghdr *nlh;
+
+	nlh = mnlg_msg_prepare(dl->nlg, DEVLINK_CMD_PORT_GET,
+			       NLM_F_REQUEST | NLM_F_ACK);
+	mnl_attr_put_u32(nlh, DEVLINK_ATTR_INDEX, index);
+	mnl_attr_put_u32(nlh, DEVLINK_ATTR_PORT_INDEX, port_index);
+	return devlink_request(dl, nlh, table_update_cb, tbl);
+}
+
+DEVLINK_EXPORT
+unsigned int devlink_dev_count(struct devlink_table *tbl)
+{
+	return tbl->dev_count;
+}
+
+DEVLINK_EXPORT
+unsigned int devlink_port_count(struct devlink_table *tbl)
+{
+	return tbl->port_count;
+}
+
+DEVLINK_EXPORT
+const struct devlink_dev *devlink_dev_lookup(struct devlink_table *tbl,
+					     uint32_t index)
+{
+	unsigned int pos;
+	bool found;
+
+	table_finalize(tbl);
+	pos = dev_pos(tbl, index, &found);
+	return found ? &tbl->devs[pos] : NULL;
+}
+
+DEVLINK_EXPORT
+const struct devlink_dev *devlink_dev_lookup_name(struct devlink_table *tbl,
+						  const char *name)
+{
+	unsigned int i;
+
+	table_finalize(tbl);
+	for (i = 0; i < tbl->dev_count; i++)
+		if (strcmp(devlink_str(tbl, tbl->devs[i].name), name) == 0)
+			return &tbl->devs[i];
+	return NULL;
+}
+
+DEVLINK_EXPORT
+const struct devlink_port *devlink_port_lookup(struct devlink_table *tbl,
+					       uint32_t index,
+					       uint32_t port_index)
+{
+	unsigned int pos;
+	bool found;
+
+	table_finalize(tbl);
+	pos = port_pos(tbl, index, port_index, &found);
+	return found ? &tbl->ports[pos] : NULL;
+}
+
+static uint32_t u32_hash_fn(uint32_t val)
+{
+	return val * 2654435761u;
+}
+
+static void port_hash_insert(struct port_hash *hash, uint32_t key,
+			     uint32_t pos)
+{
+	uint32_t mask = hash->size - 1;
+	uint32_t i;
+
+	for (i = u32_hash_fn(key) & mask; hash->slots[i]; i = (i + 1) & mask)
+		;
+	hash->slots[i] = pos + 1;
+}
+
+static int port_hash_reset(struct port_hash *hash, unsigned int count)
+{
+	uint32_t size = 16;
+
+	while (size < count * 2)
+		size *= 2;
+	if (size != hash->size) {
+		uint32_t *slots = calloc(size, sizeof(*slots));
+
+		if (!slots)
+			return -1;
+		free(hash->slots);
+		hash->slots = slots;
+		hash->size = size;
+	} else {
+		memset(hash->slots, 0, size * sizeof(*hash->slots));
+	}
+	return 0;
+}
+
+/* All three indexes are rebuilt in one pass over the port array. */
+static int port_hash_build(struct devlink_table *tbl)
+{
+	struct devlink_port *port;
+	unsigned int i;
+
+	table_finalize(tbl);
+	if (!tbl->port_hash_stale)
+		return 0;
+	if (port_hash_reset(&tbl->netdev_hash, tbl->port_count) ||
+	    port_hash_reset(&tbl->ifindex_hash, tbl->port_count) ||
+	    port_hash_reset(&tbl->ibdev_hash, tbl->port_count))
+		return -1;
+	for (i = 0; i < tbl->port_count; i++) {
+		port = &tbl->ports[i];
+		if (port->netdev_name)
+			port_hash_insert(&tbl->netdev_hash,
+					 port->netdev_name, i);
+		if (port->flags & DEVLINK_PORT_F_NETDEV_IFINDEX)
+			port_hash_insert(&tbl->ifindex_hash,
+					 port->netdev_ifindex, i);
+		if (port->ibdev_name)
+			port_hash_insert(&tbl->ibdev_hash,
+					 port->ibdev_name, i);
+	}
+	tbl->port_hash_stale = false;
+	return 0;
+}
+
+static const struct devlink_port *
+port_hash_lookup(struct devlink_table *tbl, struct port_hash *hash,
+		 uint32_t key, size_t field_offset)
+{
+	struct devlink_port *port;
+	uint32_t mask;
+	uint32_t i;
+
+	if (port_hash_build(tbl))
+		return NULL;
+	mask = hash->size - 1;
+	for (i = u32_hash_fn(key) & mask; hash->slots[i]; i = (i + 1) & mask) {
+		port = &tbl->ports[hash->slots[i] - 1];
+		if (*(uint32_t *) ((char *) port + field_offset) == key)
+			return port;
+	}
+	return NULL;
+}
+
+DEVLINK_EXPORT
+const struct devlink_port *
+devlink_port_lookup_netdev(struct devlink_table *tbl, const char *name)
+{
+	devlink_str_t str = str_lookup(tbl, name);
+
+	if (!str)
+		return NULL;
+	return port_hash_lookup(tbl, &tbl->netdev_hash, str,
+				offsetof(struct devlink_port, netdev_name));
+}
+
+DEVLINK_EXPORT
+const struct devlink_port *
+devlink_port_lookup_ifindex(struct devlink_table *tbl, uint32_t ifindex)
+{
+	const struct devlink_port *port;
+
+	port = port_hash_lookup(tbl, &tbl->ifindex_hash, ifindex,
+				offsetof(struct devlink_port, netdev_ifindex));
+	if (port && !(port->flags & DEVLINK_PORT_F_NETDEV_IFINDEX))
+		return NULL;
+	return port;
+}
+
+DEVLINK_EXPORT
+const struct devlink_port *
+devlink_port_lookup_ibdev(struct devlink_table *tbl, const char *name)
+{
+	devlink_str_t str = str_lookup(tbl, name);
+
+	if (!str)
+		return NULL;
+	return port_hash_lookup(tbl, &tbl->ibdev_hash, str,
+				offsetof(struct devlink_port, ibdev_name));
+}
+
+DEVLINK_EXPORT
+const struct devlink_dev *devlink_dev_next(struct devlink_table *tbl,
+					   const struct devlink_dev *dev)
+{
+	if (!dev) {
+		table_finalize(tbl);
+		dev = tbl->devs;
+	} else {
+		dev++;
+	}
+	return dev < tbl->devs + tbl->dev_count ? dev : NULL;
+}
+
+DEVLINK_EXPORT
+const struct devlink_port *devlink_port_next(struct devlink_table *tbl,
+					     const struct devlink_port *port)
+{
+	if (!port) {
+		table_finalize(tbl);
+		port = tbl->ports;
+	} else {
+		port++;
+	}
+	return port < tbl->ports + tbl->port_count ? port : NULL;
+}
+
+DEVLINK_EXPORT
+const struct devlink_port *
+devlink_dev_port_next(struct devlink_table *tbl, const struct devlink_dev *dev,
+		      const struct devlink_port *port)
+{
+	if (!port) {
+		table_finalize(tbl);
+		port = tbl->ports + dev->port_first;
+	} else {
+		port++;
+	}
+	return port < tbl->ports + dev->port_first + dev->port_count ?
+	       port : NULL;
+}
+
+DEVLINK_EXPORT
+struct devlink *devlink_open(void)
+{
+	struct devlink *dl;
+
+	dl = calloc(1, sizeof(*dl));
+	if (!dl)
+		return NULL;
+	dl->nlg = mnlg_socket_open(DEVLINK_GENL_NAME, DEVLINK_GENL_VERSION);
+	if (!dl->nlg) {
+		free(dl);
+		return NULL;
+	}
+	dl->own_nlg = true;
+	return dl;
+}
+
+/* Uses a socket the caller already has open, it is left open on close. */
+DEVLINK_EXPORT
+struct devlink *devlink_attach(struct mnlg_socket *nlg)
+{
+	struct devlink *dl;
+
+	dl = calloc(1, sizeof(*dl));
+	if (!dl)
+		return NULL;
+	dl->nlg = nlg;
+	return dl;
+}
+
+/* Kernel supplied reason of the last failed request, if any. */
+DEVLINK_EXPORT
+const char *devlink_error_msg(struct devlink *dl)
+{
+	return mnlg_socket_ext_ack_msg(dl->nlg);
+}
+
+DEVLINK_EXPORT
+void devlink_close(struct devlink *dl)
+{
+	if (dl->own_nlg)
+		mnlg_socket_close(dl->nlg);
+	free(dl);
+}
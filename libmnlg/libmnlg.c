@@ -23,11 +23,39 @@
 #include <errno.h>
 #include <unistd.h>
 #include <time.h>
+#include <sys/socket.h>
+#ifdef HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
 #include <libmnl/libmnl.h>
 #include <linux/genetlink.h>
 
+#include <mnlg.h>
+#include <private/usdt.h>
+
 #define MNLG_EXPORT __attribute__ ((visibility("default")))
 
+#ifndef NETLINK_CAP_ACK
+#define NETLINK_CAP_ACK 10
+#endif
+#ifndef NETLINK_EXT_ACK
+#define NETLINK_EXT_ACK 11
+#endif
+#ifndef NLM_F_CAPPED
+#define NLM_F_CAPPED 0x100
+#endif
+#ifndef NLM_F_ACK_TLVS
+#define NLM_F_ACK_TLVS 0x200
+#define NLMSGERR_ATTR_MSG 1
+#define NLMSGERR_ATTR_OFFS 2
+#endif
+
+#define MNLG_EXT_ACK_MSG_LEN 256
+
+struct mnlg_uring;
+
 struct mnlg_socket {
 	struct mnl_socket *nl;
 	char *buf;
@@ -35,8 +63,21 @@ struct mnlg_socket {
 	uint8_t version;
 	unsigned int seq;
 	unsigned int portid;
+	uint8_t cmd;		/* of the last prepared request */
+	struct mnlg_stats stats;
+	char ext_ack_msg[MNLG_EXT_ACK_MSG_LEN];
+	uint32_t ext_ack_offs;
+	struct mnlg_uring *uring;	/* NULL for plain syscalls */
 };
 
+static uint64_t mnlg_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 struct nlmsghdr *__mnlg_msg_prepare(struct mnlg_socket *nlg, uint8_t cmd,
 				    uint16_t flags, uint32_t id,
 				    uint8_t version)
@@ -53,7 +94,9 @@ struct nlmsghdr *__mnlg_msg_prepare(struct mnlg_socket *nlg, uint8_t cmd,
 	genl = mnl_nlmsg_put_extra_header(nlh, sizeof(struct genlmsghdr));
 	genl->cmd = cmd;
 	genl->version = version;
+	nlg->cmd = cmd;
 
+	USDT_PROBE4(libmnlg, msg_prepare, nlg->seq, cmd, nlh->nlmsg_len, 0);
 	return nlh;
 }
 MNLG_EXPORT
@@ -63,29 +106,882 @@ struct nlmsghdr *mnlg_msg_prepare(struct mnlg_socket *nlg, uint8_t cmd,
 	return __mnlg_msg_prepare(nlg, cmd, flags, nlg->id, nlg->version);
 }
 
+#ifdef HAVE_IO_URING
+static int mnlg_uring_send(struct mnlg_socket *nlg,
+			   const struct nlmsghdr *nlh);
+#endif
+
 MNLG_EXPORT
 int mnlg_socket_send(struct mnlg_socket *nlg, const struct nlmsghdr *nlh)
 {
-	return mnl_socket_sendto(nlg->nl, nlh, nlh->nlmsg_len);
+	int err;
+
+	nlg->stats.send_calls++;
+	nlg->stats.send_bytes += nlh->nlmsg_len;
+#ifdef HAVE_IO_URING
+	if (nlg->uring)
+		err = mnlg_uring_send(nlg, nlh);
+	else
+#endif
+	err = mnl_socket_sendto(nlg->nl, nlh, nlh->nlmsg_len);
+	USDT_PROBE4(libmnlg, send, nlh->nlmsg_seq, nlg->cmd, nlh->nlmsg_len,
+		    err);
+	return err;
 }
 
-MNLG_EXPORT
-int mnlg_socket_recv_run(struct mnlg_socket *nlg, mnl_cb_t data_cb, void *data)
+/* Same checks as mnl_socket_recvfrom(), plus the SO_TIMESTAMPNS cmsg. */
+static ssize_t mnlg_socket_recvmsg(struct mnlg_socket *nlg,
+				   struct timespec *ts, bool *has_ts)
+{
+	char control[CMSG_SPACE(sizeof(*ts))];
+	struct sockaddr_nl addr;
+	struct iovec iov = {
+		.iov_base = nlg->buf,
+		.iov_len = MNL_SOCKET_BUFFER_SIZE,
+	};
+	struct msghdr msg = {
+		.msg_name = &addr,
+		.msg_namelen = sizeof(addr),
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control),
+	};
+	struct cmsghdr *cmsg;
+	ssize_t len;
+
+	*has_ts = false;
+	len = recvmsg(mnl_socket_get_fd(nlg->nl), &msg, 0);
+	if (len < 0)
+		return len;
+	if (msg.msg_flags & MSG_TRUNC) {
+		errno = ENOSPC;
+		return -1;
+	}
+	if (msg.msg_namelen != sizeof(addr)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+			memcpy(ts, CMSG_DATA(cmsg), sizeof(*ts));
+			*has_ts = true;
+		}
+	}
+	return len;
+}
+
+static void mnlg_stats_recv(struct mnlg_socket *nlg, const char *buf, int len)
+{
+	const struct nlmsghdr *nlh = (const struct nlmsghdr *) buf;
+	int rem = len;
+
+	nlg->stats.recv_bytes += len;
+	while (mnl_nlmsg_ok(nlh, rem)) {
+		nlg->stats.recv_msgs++;
+		nlh = mnl_nlmsg_next(nlh, &rem);
+	}
+}
+
+struct recv_ctx {
+	struct mnlg_socket *nlg;
+	mnl_cb_t data_cb;
+	mnlg_ts_cb_t ts_cb;
+	void *data;
+	const struct timespec *ts;
+};
+
+static int recv_cb(const struct nlmsghdr *nlh, void *data)
+{
+	const struct genlmsghdr *genl = mnl_nlmsg_get_payload(nlh);
+	struct recv_ctx *ctx = data;
+	int ret;
+
+	USDT_PROBE4(libmnlg, cb_entry, nlh->nlmsg_seq, genl->cmd,
+		    nlh->nlmsg_len, 0);
+	if (ctx->ts_cb)
+		ret = ctx->ts_cb(nlh, ctx->ts, ctx->data);
+	else
+		ret = ctx->data_cb(nlh, ctx->data);
+	USDT_PROBE4(libmnlg, cb_return, nlh->nlmsg_seq, genl->cmd,
+		    nlh->nlmsg_len, ret);
+	return ret;
+}
+
+static void ext_ack_parse(struct mnlg_socket *nlg, const struct nlmsghdr *nlh,
+			  unsigned int offset)
+{
+	const struct nlattr *attr;
+
+	if (!(nlh->nlmsg_flags & NLM_F_ACK_TLVS))
+		return;
+	mnl_attr_for_each(attr, nlh, offset) {
+		switch (mnl_attr_get_type(attr)) {
+		case NLMSGERR_ATTR_MSG:
+			if (mnl_attr_validate(attr, MNL_TYPE_NUL_STRING) < 0)
+				break;
+			strncpy(nlg->ext_ack_msg, mnl_attr_get_str(attr),
+				sizeof(nlg->ext_ack_msg) - 1);
+			break;
+		case NLMSGERR_ATTR_OFFS:
+			if (mnl_attr_validate(attr, MNL_TYPE_U32) < 0)
+				break;
+			nlg->ext_ack_offs = mnl_attr_get_u32(attr);
+			break;
+		}
+	}
+}
+
+/* Same as the libmnl default, plus the extended ack TLVs which follow
+ * either the whole echoed request or, with NLM_F_CAPPED, its header.
+ */
+static int recv_error_cb(const struct nlmsghdr *nlh, void *data)
+{
+	const struct nlmsgerr *err = mnl_nlmsg_get_payload(nlh);
+	struct recv_ctx *ctx = data;
+	unsigned int offset;
+
+	if (nlh->nlmsg_len < mnl_nlmsg_size(sizeof(*err))) {
+		errno = EBADMSG;
+		return MNL_CB_ERROR;
+	}
+	offset = sizeof(*err);
+	if (!(nlh->nlmsg_flags & NLM_F_CAPPED))
+		offset += err->msg.nlmsg_len - sizeof(err->msg);
+	ext_ack_parse(ctx->nlg, nlh, offset);
+
+	errno = err->error < 0 ? -err->error : err->error;
+	return err->error == 0 ? MNL_CB_STOP : MNL_CB_ERROR;
+}
+
+/* A dump which fails halfway reports the error in NLMSG_DONE. */
+static int recv_done_cb(const struct nlmsghdr *nlh, void *data)
+{
+	struct recv_ctx *ctx = data;
+	int err;
+
+	if (mnl_nlmsg_get_payload_len(nlh) < sizeof(err))
+		return MNL_CB_STOP;
+	memcpy(&err, mnl_nlmsg_get_payload(nlh), sizeof(err));
+	ext_ack_parse(ctx->nlg, nlh, sizeof(err));
+	if (err >= 0)
+		return MNL_CB_STOP;
+	errno = -err;
+	return MNL_CB_ERROR;
+}
+
+static const mnl_cb_t recv_ctl_cb[NLMSG_MIN_TYPE] = {
+	[NLMSG_ERROR] = recv_error_cb,
+	[NLMSG_DONE] = recv_done_cb,
+};
+
+#ifdef HAVE_IO_URING
+/*
+ * Optional io_uring backend, driven through the raw system calls. A
+ * multishot receive stays posted with buffers taken from a provided
+ * buffer ring, so one io_uring_enter() hands over all datagrams which
+ * arrived meanwhile. Requests are copied aside and queued as linked
+ * sends, which go out together with the next wait for completions.
+ */
+
+/* No feature flag tells about multishot receive (6.0), this one came
+ * a bit later.
+ */
+#ifndef IORING_FEAT_REG_REG_RING
+#define IORING_FEAT_REG_REG_RING (1U << 13)
+#endif
+
+#define MNLG_URING_ENTRIES 64
+#define MNLG_URING_BUFS 32		/* power of two */
+#define MNLG_URING_BUF_SIZE 32768	/* largest netlink dump skb */
+#define MNLG_URING_SEND_BUF_SIZE 65536
+#define MNLG_URING_BGID 0
+
+enum {
+	MNLG_URING_RECV,
+	MNLG_URING_SEND,
+};
+
+struct mnlg_uring {
+	int fd;
+	void *ring;
+	size_t ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_array;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+	struct io_uring_buf_ring *br;
+	size_t br_size;
+	uint16_t br_tail;
+	char *bufs;
+	bool recv_armed;
+	char *send_buf;
+	size_t send_used;
+	unsigned int sends_pending;	/* queued or in flight */
+	struct io_uring_sqe *last_send;	/* queued, not submitted yet */
+	int send_err;
+	/* Receive completions reaped while waiting for sends. */
+	struct io_uring_cqe *stash;
+	unsigned int stash_size;
+	unsigned int stash_head;
+	unsigned int stash_count;
+};
+
+static int mnlg_uring_enter(struct mnlg_uring *u, unsigned int min_complete)
+{
+	unsigned int to_submit;
+
+	to_submit = *u->sq_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+	if (!to_submit && !min_complete)
+		return 0;
+	u->last_send = NULL;
+	return syscall(__NR_io_uring_enter, u->fd, to_submit, min_complete,
+		       min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+static struct io_uring_sqe *mnlg_uring_sqe_get(struct mnlg_uring *u)
+{
+	unsigned int tail = *u->sq_tail;
+	struct io_uring_sqe *sqe;
+
+	if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) ==
+	    u->sq_entries)
+		return NULL;
+	sqe = &u->sqes[tail & u->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	u->sq_array[tail & u->sq_mask] = tail & u->sq_mask;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	return sqe;
+}
+
+static bool mnlg_uring_cq_pop(struct mnlg_uring *u, struct io_uring_cqe *cqe)
+{
+	unsigned int head = *u->cq_head;
+
+	if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+		return false;
+	*cqe = u->cqes[head & u->cq_mask];
+	__atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static void mnlg_uring_buf_put(struct mnlg_uring *u, unsigned int bid)
+{
+	struct io_uring_buf *buf;
+
+	buf = &u->br->bufs[u->br_tail & (MNLG_URING_BUFS - 1)];
+	buf->addr = (uintptr_t) (u->bufs + bid * MNLG_URING_BUF_SIZE);
+	buf->len = MNLG_URING_BUF_SIZE;
+	buf->bid = bid;
+	__atomic_store_n(&u->br->tail, ++u->br_tail, __ATOMIC_RELEASE);
+}
+
+static void mnlg_uring_send_done(struct mnlg_uring *u,
+				 const struct io_uring_cqe *cqe)
+{
+	if (cqe->res < 0 && !u->send_err)
+		u->send_err = -cqe->res;
+	if (!--u->sends_pending)
+		u->send_used = 0;
+}
+
+/* Gets all queued sends out and completed. */
+static int mnlg_uring_send_flush(struct mnlg_socket *nlg)
+{
+	struct mnlg_uring *u = nlg->uring;
+	struct io_uring_cqe cqe;
+	int err;
+
+	while (u->sends_pending) {
+		if (!mnlg_uring_cq_pop(u, &cqe)) {
+			nlg->stats.recv_calls++;
+			if (mnlg_uring_enter(u, 1) < 0 && errno != EINTR)
+				return -1;
+			continue;
+		}
+		if (cqe.user_data == MNLG_URING_SEND) {
+			mnlg_uring_send_done(u, &cqe);
+			continue;
+		}
+		if (u->stash_count == u->stash_size) {
+			errno = EOVERFLOW;
+			return -1;
+		}
+		u->stash[(u->stash_head + u->stash_count++) %
+			 u->stash_size] = cqe;
+	}
+	if (u->send_err) {
+		err = u->send_err;
+		u->send_err = 0;
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+static int mnlg_uring_send(struct mnlg_socket *nlg,
+			   const struct nlmsghdr *nlh)
+{
+	struct mnlg_uring *u = nlg->uring;
+	struct io_uring_sqe *sqe;
+	char *buf;
+
+	if (nlh->nlmsg_len > MNLG_URING_SEND_BUF_SIZE) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	if (u->send_used + nlh->nlmsg_len > MNLG_URING_SEND_BUF_SIZE &&
+	    mnlg_uring_send_flush(nlg))
+		return -1;
+	sqe = mnlg_uring_sqe_get(u);
+	if (!sqe) {
+		nlg->stats.recv_calls++;
+		if (mnlg_uring_enter(u, 0) < 0)
+			return -1;
+		sqe = mnlg_uring_sqe_get(u);
+		if (!sqe) {
+			errno = EBUSY;
+			return -1;
+		}
+	}
+
+	buf = u->send_buf + u->send_used;
+	memcpy(buf, nlh, nlh->nlmsg_len);
+	u->send_used += NLMSG_ALIGN(nlh->nlmsg_len);
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = mnl_socket_get_fd(nlg->nl);
+	sqe->addr = (uintptr_t) buf;
+	sqe->len = nlh->nlmsg_len;
+	sqe->user_data = MNLG_URING_SEND;
+	/* Not submitted yet, so the previous one can still be linked. */
+	if (u->last_send)
+		u->last_send->flags |= IOSQE_IO_LINK;
+	u->last_send = sqe;
+	u->sends_pending++;
+	return nlh->nlmsg_len;
+}
+
+static void mnlg_uring_recv_arm(struct mnlg_socket *nlg)
+{
+	struct mnlg_uring *u = nlg->uring;
+	struct io_uring_sqe *sqe;
+
+	sqe = mnlg_uring_sqe_get(u);
+	if (!sqe)
+		return;
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = mnl_socket_get_fd(nlg->nl);
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = MNLG_URING_BGID;
+	/* Have the real length of anything too big reported. */
+	sqe->msg_flags = MSG_TRUNC;
+	sqe->user_data = MNLG_URING_RECV;
+	u->last_send = NULL;
+	u->recv_armed = true;
+}
+
+/* Next completion, waits for it as needed. */
+static int mnlg_uring_cqe_get(struct mnlg_socket *nlg,
+			      struct io_uring_cqe *cqe)
+{
+	struct mnlg_uring *u = nlg->uring;
+	int ret;
+
+	if (u->stash_count) {
+		*cqe = u->stash[u->stash_head];
+		u->stash_head = (u->stash_head + 1) % u->stash_size;
+		u->stash_count--;
+		return 0;
+	}
+	while (!mnlg_uring_cq_pop(u, cqe)) {
+		nlg->stats.recv_calls++;
+		ret = mnlg_uring_enter(u, 1);
+		if (ret < 0)
+			return -1;
+		/* A wait cut short by a signal still reports what it
+		 * submitted, make it look like the interrupted recvmsg().
+		 */
+		if (ret > 0 && !mnlg_uring_cq_pop(u, cqe)) {
+			errno = EINTR;
+			return -1;
+		}
+		if (ret > 0)
+			break;
+	}
+	return 0;
+}
+
+static int mnlg_uring_recv_run(struct mnlg_socket *nlg, struct recv_ctx *ctx)
+{
+	struct mnlg_uring *u = nlg->uring;
+	struct io_uring_cqe cqe;
+	unsigned int bid;
+	uint64_t start;
+	uint64_t end;
+	char *buf;
+	int err;
+
+	do {
+		if (!u->recv_armed)
+			mnlg_uring_recv_arm(nlg);
+		start = mnlg_now_ns();
+		err = mnlg_uring_cqe_get(nlg, &cqe);
+		end = mnlg_now_ns();
+		nlg->stats.recv_wait_ns += end - start;
+		if (err)
+			break;
+
+		if (cqe.user_data == MNLG_URING_SEND) {
+			mnlg_uring_send_done(u, &cqe);
+			err = 1;
+			if (u->send_err) {
+				errno = u->send_err;
+				u->send_err = 0;
+				err = -1;
+			}
+			continue;
+		}
+		if (!(cqe.flags & IORING_CQE_F_MORE))
+			u->recv_armed = false;
+		if (cqe.res == -ENOBUFS) {
+			/* All buffers were in use, they are back now. */
+			err = 1;
+			continue;
+		}
+		if (cqe.res < 0) {
+			errno = -cqe.res;
+			err = -1;
+			break;
+		}
+		if (!(cqe.flags & IORING_CQE_F_BUFFER)) {
+			/* Nothing more to come, as recvmsg() returning 0. */
+			err = 0;
+			break;
+		}
+
+		bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+		buf = u->bufs + bid * MNLG_URING_BUF_SIZE;
+		USDT_PROBE4(libmnlg, recv, nlg->seq, nlg->cmd, cqe.res, cqe.res);
+		if (cqe.res > MNLG_URING_BUF_SIZE) {
+			mnlg_uring_buf_put(u, bid);
+			errno = ENOSPC;
+			err = -1;
+			break;
+		}
+		mnlg_stats_recv(nlg, buf, cqe.res);
+		ctx->ts = NULL;
+		err = mnl_cb_run2(buf, cqe.res, nlg->seq, nlg->portid,
+				  recv_cb, ctx, recv_ctl_cb,
+				  MNL_ARRAY_SIZE(recv_ctl_cb));
+		mnlg_uring_buf_put(u, bid);
+		nlg->stats.cb_ns += mnlg_now_ns() - end;
+	} while (err > 0);
+	return err;
+}
+
+static void mnlg_uring_fini(struct mnlg_uring *u)
+{
+	close(u->fd);
+	munmap(u->ring, u->ring_size);
+	munmap(u->sqes, u->sqes_size);
+	munmap(u->br, u->br_size);
+	free(u->stash);
+	free(u->send_buf);
+	free(u->bufs);
+	free(u);
+}
+
+static struct mnlg_uring *mnlg_uring_init(void)
+{
+	struct io_uring_params p = {};
+	struct io_uring_buf_reg reg = {};
+	struct mnlg_uring *u;
+	unsigned int i;
+	char *ring;
+	int err;
+
+	u = calloc(1, sizeof(*u));
+	if (!u)
+		return NULL;
+	u->ring = MAP_FAILED;
+	u->sqes = MAP_FAILED;
+	u->br = MAP_FAILED;
+	u->fd = syscall(__NR_io_uring_setup, MNLG_URING_ENTRIES, &p);
+	if (u->fd < 0)
+		goto err_setup;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+	    !(p.features & IORING_FEAT_NODROP) ||
+	    !(p.features & IORING_FEAT_REG_REG_RING)) {
+		errno = EOPNOTSUPP;
+		goto err_mmap;
+	}
+
+	u->ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	if (u->ring_size < p.cq_off.cqes +
+			   p.cq_entries * sizeof(struct io_uring_cqe))
+		u->ring_size = p.cq_off.cqes +
+			       p.cq_entries * sizeof(struct io_uring_cqe);
+	u->ring = mmap(NULL, u->ring_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	u->br_size = MNLG_URING_BUFS * sizeof(struct io_uring_buf);
+	u->br = mmap(NULL, u->br_size, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (u->ring == MAP_FAILED || u->sqes == MAP_FAILED ||
+	    u->br == MAP_FAILED)
+		goto err_mmap;
+
+	ring = u->ring;
+	u->sq_head = (unsigned int *) (ring + p.sq_off.head);
+	u->sq_tail = (unsigned int *) (ring + p.sq_off.tail);
+	u->sq_mask = *(unsigned int *) (ring + p.sq_off.ring_mask);
+	u->sq_entries = p.sq_entries;
+	u->sq_array = (unsigned int *) (ring + p.sq_off.array);
+	u->cq_head = (unsigned int *) (ring + p.cq_off.head);
+	u->cq_tail = (unsigned int *) (ring + p.cq_off.tail);
+	u->cq_mask = *(unsigned int *) (ring + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *) (ring + p.cq_off.cqes);
+
+	/* Every buffer, and so every receive completion, may be stashed. */
+	u->stash_size = MNLG_URING_BUFS + 1;
+	u->stash = calloc(u->stash_size, sizeof(*u->stash));
+	u->send_buf = malloc(MNLG_URING_SEND_BUF_SIZE);
+	u->bufs = malloc(MNLG_URING_BUFS * MNLG_URING_BUF_SIZE);
+	if (!u->stash || !u->send_buf || !u->bufs)
+		goto err_mmap;
+
+	reg.ring_addr = (uintptr_t) u->br;
+	reg.ring_entries = MNLG_URING_BUFS;
+	reg.bgid = MNLG_URING_BGID;
+	if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING,
+		    &reg, 1) < 0)
+		goto err_mmap;
+	for (i = 0; i < MNLG_URING_BUFS; i++)
+		mnlg_uring_buf_put(u, i);
+	return u;
+
+err_mmap:
+	err = errno;
+	close(u->fd);
+	errno = err;
+err_setup:
+	if (u->ring != MAP_FAILED)
+		munmap(u->ring, u->ring_size);
+	if (u->sqes != MAP_FAILED)
+		munmap(u->sqes, u->sqes_size);
+	if (u->br != MAP_FAILED)
+		munmap(u->br, u->br_size);
+	free(u->stash);
+	free(u->send_buf);
+	free(u->bufs);
+	free(u);
+	return NULL;
+}
+#endif /* HAVE_IO_URING */
+
+static int __mnlg_socket_recv_run(struct mnlg_socket *nlg,
+				  struct recv_ctx *ctx)
 {
+	struct timespec ts;
+	uint64_t start;
+	uint64_t end;
+	bool has_ts;
 	int err;
 
+	nlg->ext_ack_msg[0] = '\0';
+	nlg->ext_ack_offs = 0;
+	ctx->nlg = nlg;
+#ifdef HAVE_IO_URING
+	if (nlg->uring) {
+		err = mnlg_uring_recv_run(nlg, ctx);
+		goto out;
+	}
+#endif
 	do {
-		err = mnl_socket_recvfrom(nlg->nl, nlg->buf,
-					  MNL_SOCKET_BUFFER_SIZE);
+		start = mnlg_now_ns();
+		err = mnlg_socket_recvmsg(nlg, &ts, &has_ts);
+		end = mnlg_now_ns();
+		nlg->stats.recv_calls++;
+		nlg->stats.recv_wait_ns += end - start;
+		USDT_PROBE4(libmnlg, recv, nlg->seq, nlg->cmd,
+			    err > 0 ? err : 0, err);
 		if (err <= 0)
 			break;
-		err = mnl_cb_run(nlg->buf, err, nlg->seq, nlg->portid,
-				 data_cb, data);
+		mnlg_stats_recv(nlg, nlg->buf, err);
+		ctx->ts = has_ts ? &ts : NULL;
+		err = mnl_cb_run2(nlg->buf, err, nlg->seq, nlg->portid,
+				  recv_cb, ctx, recv_ctl_cb,
+				  MNL_ARRAY_SIZE(recv_ctl_cb));
+		nlg->stats.cb_ns += mnlg_now_ns() - end;
 	} while (err > 0);
 
+#ifdef HAVE_IO_URING
+out:
+#endif
+	USDT_PROBE4(libmnlg, recv_done, nlg->seq, nlg->cmd, 0, err);
 	return err;
 }
 
+MNLG_EXPORT
+int mnlg_socket_recv_run(struct mnlg_socket *nlg, mnl_cb_t data_cb, void *data)
+{
+	struct recv_ctx ctx = {
+		.data_cb = data_cb,
+		.data = data,
+	};
+
+	return __mnlg_socket_recv_run(nlg, &ctx);
+}
+
+MNLG_EXPORT
+int mnlg_socket_recv_run_ts(struct mnlg_socket *nlg, mnlg_ts_cb_t data_cb,
+			    void *data)
+{
+	struct recv_ctx ctx = {
+		.ts_cb = data_cb,
+		.data = data,
+	};
+
+	return __mnlg_socket_recv_run(nlg, &ctx);
+}
+
+MNLG_EXPORT
+int mnlg_socket_timestamp_enable(struct mnlg_socket *nlg)
+{
+	int one = 1;
+
+	nlg->stats.other_calls++;
+	return setsockopt(mnl_socket_get_fd(nlg->nl), SOL_SOCKET,
+			  SO_TIMESTAMPNS, &one, sizeof(one));
+}
+
+/*
+ * Prebuilt requests, sent back to back in one datagram. Every request is
+ * acked, message i of a send goes out with sequence number seq + i so that
+ * replies and acks can be told apart, and a failing request does not stop
+ * the others.
+ */
+
+#define MNLG_BATCH_MSG_MAX 4096	/* room for attributes of one request */
+
+struct mnlg_batch {
+	struct mnlg_socket *nlg;
+	char *buf;
+	size_t size;
+	size_t last;		/* offset of the last message */
+	unsigned int count;
+	int *errs;
+	unsigned int acked;
+	unsigned int seq;	/* of the first message of the last send */
+	unsigned int next_seq;
+	struct recv_ctx ctx;
+};
+
+MNLG_EXPORT
+struct mnlg_batch *mnlg_batch_create(struct mnlg_socket *nlg)
+{
+	struct mnlg_batch *batch;
+
+	batch = calloc(1, sizeof(*batch));
+	if (!batch)
+		return NULL;
+	batch->nlg = nlg;
+	batch->next_seq = time(NULL);
+	return batch;
+}
+
+MNLG_EXPORT
+void mnlg_batch_destroy(struct mnlg_batch *batch)
+{
+	free(batch->errs);
+	free(batch->buf);
+	free(batch);
+}
+
+static size_t mnlg_batch_len(const struct mnlg_batch *batch)
+{
+	const struct nlmsghdr *nlh;
+
+	if (!batch->count)
+		return 0;
+	nlh = (const struct nlmsghdr *) (batch->buf + batch->last);
+	return batch->last + NLMSG_ALIGN(nlh->nlmsg_len);
+}
+
+MNLG_EXPORT
+struct nlmsghdr *mnlg_batch_msg_prepare(struct mnlg_batch *batch, uint8_t cmd,
+					uint16_t flags)
+{
+	struct mnlg_socket *nlg = batch->nlg;
+	size_t len = mnlg_batch_len(batch);
+	struct genlmsghdr *genl;
+	struct nlmsghdr *nlh;
+	char *buf;
+	int *errs;
+
+	if (len + MNLG_BATCH_MSG_MAX > batch->size) {
+		buf = realloc(batch->buf, batch->size + MNLG_BATCH_MSG_MAX);
+		if (!buf)
+			return NULL;
+		batch->buf = buf;
+		batch->size += MNLG_BATCH_MSG_MAX;
+	}
+	errs = realloc(batch->errs, (batch->count + 1) * sizeof(*errs));
+	if (!errs)
+		return NULL;
+	batch->errs = errs;
+	batch->errs[batch->count++] = 0;
+	batch->last = len;
+
+	nlh = mnl_nlmsg_put_header(batch->buf + len);
+	nlh->nlmsg_type	= nlg->id;
+	nlh->nlmsg_flags = flags | NLM_F_ACK;
+	genl = mnl_nlmsg_put_extra_header(nlh, sizeof(struct genlmsghdr));
+	genl->cmd = cmd;
+	genl->version = nlg->version;
+	return nlh;
+}
+
+MNLG_EXPORT
+int mnlg_batch_send(struct mnlg_batch *batch)
+{
+	struct mnlg_socket *nlg = batch->nlg;
+	size_t len = mnlg_batch_len(batch);
+	struct nlmsghdr *nlh;
+	unsigned int seq;
+	int rem = len;
+	int err;
+
+	if (nlg->uring) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	seq = batch->next_seq;
+	batch->seq = seq;
+	batch->next_seq = seq + batch->count;
+	batch->acked = 0;
+	memset(batch->errs, 0, batch->count * sizeof(*batch->errs));
+	for (nlh = (struct nlmsghdr *) batch->buf; mnl_nlmsg_ok(nlh, rem);
+	     nlh = mnl_nlmsg_next(nlh, &rem))
+		nlh->nlmsg_seq = seq++;
+
+	nlg->stats.send_calls++;
+	nlg->stats.send_bytes += len;
+	err = mnl_socket_sendto(nlg->nl, batch->buf, len);
+	USDT_PROBE4(libmnlg, send, batch->seq, 0, len, err);
+	return err < 0 ? -1 : 0;
+}
+
+/* Index of the request a message answers, count if it answers none. */
+static unsigned int mnlg_batch_msg_index(const struct mnlg_batch *batch,
+					 const struct nlmsghdr *nlh)
+{
+	unsigned int i = nlh->nlmsg_seq - batch->seq;
+
+	return i < batch->count ? i : batch->count;
+}
+
+static int batch_data_cb(const struct nlmsghdr *nlh, void *data)
+{
+	struct mnlg_batch *batch = data;
+
+	if (mnlg_batch_msg_index(batch, nlh) == batch->count)
+		return MNL_CB_OK;
+	return recv_cb(nlh, &batch->ctx);
+}
+
+static int batch_error_cb(const struct nlmsghdr *nlh, void *data)
+{
+	const struct nlmsgerr *err = mnl_nlmsg_get_payload(nlh);
+	struct mnlg_batch *batch = data;
+	unsigned int offset;
+	unsigned int i;
+
+	if (nlh->nlmsg_len < mnl_nlmsg_size(sizeof(*err))) {
+		errno = EBADMSG;
+		return MNL_CB_ERROR;
+	}
+	i = mnlg_batch_msg_index(batch, nlh);
+	if (i == batch->count)
+		return MNL_CB_OK;
+	offset = sizeof(*err);
+	if (!(nlh->nlmsg_flags & NLM_F_CAPPED))
+		offset += err->msg.nlmsg_len - sizeof(err->msg);
+	ext_ack_parse(batch->nlg, nlh, offset);
+
+	batch->errs[i] = err->error < 0 ? -err->error : err->error;
+	batch->acked++;
+	return MNL_CB_OK;
+}
+
+static const mnl_cb_t batch_ctl_cb[NLMSG_MIN_TYPE] = {
+	[NLMSG_ERROR] = batch_error_cb,
+};
+
+MNLG_EXPORT
+int mnlg_batch_recv_run(struct mnlg_batch *batch, mnl_cb_t data_cb,
+			void *data)
+{
+	struct mnlg_socket *nlg = batch->nlg;
+	struct timespec ts;
+	uint64_t start;
+	uint64_t end;
+	bool has_ts;
+	int err = 0;
+
+	nlg->ext_ack_msg[0] = '\0';
+	nlg->ext_ack_offs = 0;
+	batch->ctx.nlg = nlg;
+	batch->ctx.data_cb = data_cb;
+	batch->ctx.data = data;
+	while (batch->acked < batch->count) {
+		start = mnlg_now_ns();
+		err = mnlg_socket_recvmsg(nlg, &ts, &has_ts);
+		end = mnlg_now_ns();
+		nlg->stats.recv_calls++;
+		nlg->stats.recv_wait_ns += end - start;
+		USDT_PROBE4(libmnlg, recv, batch->seq, 0, err > 0 ? err : 0,
+			    err);
+		if (err <= 0)
+			break;
+		mnlg_stats_recv(nlg, nlg->buf, err);
+		batch->ctx.ts = has_ts ? &ts : NULL;
+		err = mnl_cb_run2(nlg->buf, err, 0, nlg->portid,
+				  batch_data_cb, batch, batch_ctl_cb,
+				  MNL_ARRAY_SIZE(batch_ctl_cb));
+		nlg->stats.cb_ns += mnlg_now_ns() - end;
+		if (err < 0)
+			break;
+	}
+	USDT_PROBE4(libmnlg, recv_done, batch->seq, 0, 0, err);
+	return err < 0 ? -1 : 0;
+}
+
+MNLG_EXPORT
+unsigned int mnlg_batch_seq(struct mnlg_batch *batch)
+{
+	return batch->seq;
+}
+
+MNLG_EXPORT
+int mnlg_batch_msg_error(struct mnlg_batch *batch, unsigned int i)
+{
+	return batch->errs[i];
+}
+
 struct group_info {
 	bool found;
 	uint32_t id;
@@ -191,6 +1087,7 @@ int mnlg_socket_group_add(struct mnlg_socket *nlg, const char *group_name)
 		return -1;
 	}
 
+	nlg->stats.other_calls++;
 	err = mnl_socket_setsockopt(nlg->nl, NETLINK_ADD_MEMBERSHIP,
 				    &group_info.id, sizeof(group_info.id));
 	if (err < 0)
@@ -232,9 +1129,10 @@ struct mnlg_socket *mnlg_socket_open(const char *family_name, uint8_t version)
 {
 	struct mnlg_socket *nlg;
 	struct nlmsghdr *nlh;
+	int one;
 	int err;
 
-	nlg = malloc(sizeof(*nlg));
+	nlg = calloc(1, sizeof(*nlg));
 	if (!nlg)
 		return NULL;
 
@@ -246,12 +1144,22 @@ struct mnlg_socket *mnlg_socket_open(const char *family_name, uint8_t version)
 	if (!nlg->nl)
 		goto err_mnl_socket_open;
 
+	/* socket() and bind() */
+	nlg->stats.other_calls += 2;
 	err = mnl_socket_bind(nlg->nl, 0, MNL_SOCKET_AUTOPID);
 	if (err < 0)
 		goto err_mnl_socket_bind;
 
 	nlg->portid = mnl_socket_get_portid(nlg->nl);
 
+	/* Both are optional, older kernels simply echo the whole request
+	 * back and give no details.
+	 */
+	one = 1;
+	mnl_socket_setsockopt(nlg->nl, NETLINK_CAP_ACK, &one, sizeof(one));
+	mnl_socket_setsockopt(nlg->nl, NETLINK_EXT_ACK, &one, sizeof(one));
+	nlg->stats.other_calls += 2;
+
 	nlh = __mnlg_msg_prepare(nlg, CTRL_CMD_GETFAMILY,
 				 NLM_F_REQUEST | NLM_F_ACK, GENL_ID_CTRL, 1);
 	mnl_attr_put_strz(nlh, CTRL_ATTR_FAMILY_NAME, family_name);
@@ -278,10 +1186,54 @@ err_buf_alloc:
 	return NULL;
 }
 
+MNLG_EXPORT
+int mnlg_socket_uring_enable(struct mnlg_socket *nlg)
+{
+#ifdef HAVE_IO_URING
+	if (!nlg->uring)
+		nlg->uring = mnlg_uring_init();
+	return nlg->uring ? 0 : -1;
+#else
+	errno = EOPNOTSUPP;
+	return -1;
+#endif
+}
+
 MNLG_EXPORT
 void mnlg_socket_close(struct mnlg_socket *nlg)
 {
+#ifdef HAVE_IO_URING
+	if (nlg->uring) {
+		/* Whatever is still queued was meant to go out. */
+		mnlg_uring_send_flush(nlg);
+		mnlg_uring_fini(nlg->uring);
+	}
+#endif
 	mnl_socket_close(nlg->nl);
 	free(nlg->buf);
 	free(nlg);
 }
+
+MNLG_EXPORT
+int mnlg_socket_get_fd(struct mnlg_socket *nlg)
+{
+	return mnl_socket_get_fd(nlg->nl);
+}
+
+MNLG_EXPORT
+void mnlg_socket_stats_get(struct mnlg_socket *nlg, struct mnlg_stats *stats)
+{
+	*stats = nlg->stats;
+}
+
+MNLG_EXPORT
+const char *mnlg_socket_ext_ack_msg(struct mnlg_socket *nlg)
+{
+	return nlg->ext_ack_msg[0] ? nlg->ext_ack_msg : NULL;
+}
+
+MNLG_EXPORT
+uint32_t mnlg_socket_ext_ack_offset(struct mnlg_socket *nlg)
+{
+	return nlg->ext_ack_offs;
+}
@@ -0,0 +1,118 @@
+/*
+ *   mnlg-bench.c - Compares libmnlg syscall and io_uring backends
+ *   Copyright (C) 2016 Jiri Pirko <jiri@mellanox.com>
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Usage: mnlg-bench [ COUNT ]
+ *
+ * Dumps all generic netlink families COUNT times over each backend.
+ * The controller is always there, so no devlink hardware is needed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <time.h>
+#include <linux/genetlink.h>
+#include <libmnl/libmnl.h>
+#include <mnlg.h>
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int family_cb(const struct nlmsghdr *nlh, void *data)
+{
+	unsigned int *p_count = data;
+
+	(*p_count)++;
+	return MNL_CB_OK;
+}
+
+static int bench(const char *name, bool uring, unsigned int count)
+{
+	struct mnlg_stats before;
+	struct mnlg_stats after;
+	struct mnlg_socket *nlg;
+	struct nlmsghdr *nlh;
+	unsigned int msgs = 0;
+	unsigned int i;
+	uint64_t start;
+	uint64_t ns;
+	int err;
+
+	nlg = mnlg_socket_open("nlctrl", 2);
+	if (!nlg) {
+		fprintf(stderr, "Failed to open nlctrl socket (%s)\n",
+			strerror(errno));
+		return -1;
+	}
+	if (uring && mnlg_socket_uring_enable(nlg)) {
+		printf("%-8s not available (%s)\n", name, strerror(errno));
+		mnlg_socket_close(nlg);
+		return 0;
+	}
+
+	mnlg_socket_stats_get(nlg, &before);
+	start = now_ns();
+	for (i = 0; i < count; i++) {
+		nlh = mnlg_msg_prepare(nlg, CTRL_CMD_GETFAMILY,
+				       NLM_F_REQUEST | NLM_F_DUMP);
+		err = mnlg_socket_send(nlg, nlh);
+		if (err < 0)
+			goto err_out;
+		err = mnlg_socket_recv_run(nlg, family_cb, &msgs);
+		if (err < 0)
+			goto err_out;
+	}
+	ns = now_ns() - start;
+	mnlg_socket_stats_get(nlg, &after);
+	mnlg_socket_close(nlg);
+
+	printf("%-8s %8.2f us/dump %6.2f syscalls/dump %6u families\n",
+	       name, ns / 1000.0 / count,
+	       (double) (after.recv_calls - before.recv_calls +
+			 (uring ? 0 : after.send_calls - before.send_calls)) /
+	       count, msgs / count);
+	return 0;
+
+err_out:
+	fprintf(stderr, "%s: dump failed (%s)\n", name, strerror(errno));
+	mnlg_socket_close(nlg);
+	return -1;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int count = 10000;
+
+	if (argc > 1)
+		count = strtoul(argv[1], NULL, 0);
+	if (!count)
+		count = 1;
+	if (bench("syscall", false, count) || bench("io_uring", true, count))
+		return EXIT_FAILURE;
+	return EXIT_SUCCESS;
+}
@@ -19,16 +19,37 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <limits.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <time.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <linux/genetlink.h>
+#include <linux/sock_diag.h>
 #include <linux/devlink.h>
 #include <libmnl/libmnl.h>
 #include <mnlg.h>
+#include <devlink.h>
+#include <dlcache.h>
+#include <dllog.h>
+#include <dlsnap.h>
 
 #include <private/misc.h>
 #include <private/list.h>
@@ -43,11 +64,269 @@ enum verbosity_level {
 #define DEFAULT_VERB VERB1
 static int g_verbosity = DEFAULT_VERB;
 
+/*
+ * Output is appended to a set of static chunks and written out with one
+ * writev() per flush. On a terminal every finished record is flushed so
+ * the output looks line-buffered, otherwise a flush happens only once the
+ * chunks are full and when the command is done.
+ */
+#define OUT_CHUNK_SIZE 65536
+#define OUT_CHUNK_COUNT 16
+
+/* Per thread, so that workers can collect output of their own. */
+static __thread struct {
+	char chunks[OUT_CHUNK_COUNT][OUT_CHUNK_SIZE];
+	size_t lens[OUT_CHUNK_COUNT];
+	unsigned int cur;
+	bool line_buffered;
+	uint64_t write_calls;
+	uint64_t write_bytes;
+	uint64_t write_ns;
+	bool capturing;		/* flushes go to capture, not stdout */
+	char *capture;
+	size_t capture_len;
+	size_t capture_alloc;
+} g_out;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void out_init(void)
+{
+	g_out.line_buffered = isatty(STDOUT_FILENO);
+}
+
+static void out_capture_append(const char *buf, size_t len)
+{
+	size_t alloc = g_out.capture_alloc ? g_out.capture_alloc : 65536;
+	char *capture;
+
+	while (g_out.capture_len + len > alloc)
+		alloc *= 2;
+	if (alloc != g_out.capture_alloc) {
+		capture = realloc(g_out.capture, alloc);
+		if (!capture)
+			return;
+		g_out.capture = capture;
+		g_out.capture_alloc = alloc;
+	}
+	memcpy(g_out.capture + g_out.capture_len, buf, len);
+	g_out.capture_len += len;
+}
+
+static void out_flush(void)
+{
+	struct iovec iov[OUT_CHUNK_COUNT];
+	struct iovec *pos = iov;
+	unsigned int count = 0;
+	unsigned int i;
+	uint64_t start;
+	ssize_t len;
+
+	for (i = 0; i <= g_out.cur; i++) {
+		if (!g_out.lens[i])
+			continue;
+		iov[count].iov_base = g_out.chunks[i];
+		iov[count++].iov_len = g_out.lens[i];
+		g_out.lens[i] = 0;
+	}
+	g_out.cur = 0;
+	if (!count)
+		return;
+	if (g_out.capturing) {
+		for (i = 0; i < count; i++)
+			out_capture_append(iov[i].iov_base, iov[i].iov_len);
+		return;
+	}
+
+	start = now_ns();
+	while (count) {
+		len = writev(STDOUT_FILENO, pos, count);
+		g_out.write_calls++;
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		g_out.write_bytes += len;
+		while (count && len >= pos->iov_len) {
+			len -= pos->iov_len;
+			pos++;
+			count--;
+		}
+		if (count) {
+			pos->iov_base = (char *) pos->iov_base + len;
+			pos->iov_len -= len;
+		}
+	}
+	g_out.write_ns += now_ns() - start;
+}
+
+static void out_capture_start(void)
+{
+	g_out.capturing = true;
+}
+
+/* Returns what was output since out_capture_start(), to be freed. */
+static char *out_capture_end(size_t *p_len)
+{
+	char *capture;
+
+	out_flush();
+	capture = g_out.capture;
+	*p_len = g_out.capture_len;
+	g_out.capturing = false;
+	g_out.capture = NULL;
+	g_out.capture_len = g_out.capture_alloc = 0;
+	return capture;
+}
+
+/* Returns room for len bytes, len must not exceed OUT_CHUNK_SIZE. */
+static char *out_reserve(size_t len)
+{
+	if (g_out.lens[g_out.cur] + len > OUT_CHUNK_SIZE) {
+		if (g_out.cur + 1 == OUT_CHUNK_COUNT)
+			out_flush();
+		else
+			g_out.cur++;
+	}
+	return g_out.chunks[g_out.cur] + g_out.lens[g_out.cur];
+}
+
+static void out_commit(size_t len)
+{
+	g_out.lens[g_out.cur] += len;
+}
+
+static void out_mem(const char *str, size_t len)
+{
+	ssize_t ret;
+
+	if (len <= OUT_CHUNK_SIZE) {
+		memcpy(out_reserve(len), str, len);
+		out_commit(len);
+		return;
+	}
+
+	/* Too big to be buffered, write it out directly. */
+	out_flush();
+	if (g_out.capturing) {
+		out_capture_append(str, len);
+		return;
+	}
+	while (len) {
+		ret = write(STDOUT_FILENO, str, len);
+		g_out.write_calls++;
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		g_out.write_bytes += ret;
+		str += ret;
+		len -= ret;
+	}
+}
+
+static void out_str(const char *str)
+{
+	out_mem(str, strlen(str));
+}
+
+static void out_char(char c)
+{
+	*out_reserve(1) = c;
+	out_commit(1);
+}
+
+static const char out_digit_pairs[] =
+	"00010203040506070809101112131415161718192021222324252627282930313233"
+	"34353637383940414243444546474849505152535455565758596061626364656667"
+	"6869707172737475767778798081828384858687888990919293949596979899";
+
+static void out_u32(uint32_t val)
+{
+	char tmp[10];
+	char *p = tmp + sizeof(tmp);
+	size_t len;
+
+	while (val >= 100) {
+		p -= 2;
+		memcpy(p, &out_digit_pairs[(val % 100) * 2], 2);
+		val /= 100;
+	}
+	if (val >= 10) {
+		p -= 2;
+		memcpy(p, &out_digit_pairs[val * 2], 2);
+	} else {
+		*--p = '0' + val;
+	}
+	len = tmp + sizeof(tmp) - p;
+	memcpy(out_reserve(len), p, len);
+	out_commit(len);
+}
+
+/* Lowercase hex, zero padded to width digits. */
+static void out_hex(uint32_t val, unsigned int width)
+{
+	static const char digits[] = "0123456789abcdef";
+	char *p = out_reserve(width);
+	unsigned int i;
+
+	for (i = width; i; i--) {
+		p[i - 1] = digits[val & 0xf];
+		val >>= 4;
+	}
+	out_commit(width);
+}
+
+static void out_printf(const char *fmt, ...)
+{
+	size_t avail;
+	va_list ap;
+	char *str;
+	int len;
+
+	avail = OUT_CHUNK_SIZE - g_out.lens[g_out.cur];
+	va_start(ap, fmt);
+	len = vsnprintf(g_out.chunks[g_out.cur] + g_out.lens[g_out.cur],
+			avail, fmt, ap);
+	va_end(ap);
+	if (len < 0)
+		return;
+	if (len < avail) {
+		out_commit(len);
+		return;
+	}
+
+	/* Did not fit the current chunk, format again into a fresh one. */
+	va_start(ap, fmt);
+	if (len < OUT_CHUNK_SIZE) {
+		str = out_reserve(len + 1);
+		out_commit(vsnprintf(str, len + 1, fmt, ap));
+	} else if (vasprintf(&str, fmt, ap) >= 0) {
+		out_mem(str, len);
+		free(str);
+	}
+	va_end(ap);
+}
+
+static void out_record_end(void)
+{
+	if (g_out.line_buffered)
+		out_flush();
+}
+
 #define pr_err(args...) fprintf(stderr, ##args)
 #define pr_outx(verb_level, args...) \
 	do { \
 		if (verb_level <= g_verbosity) { \
-			fprintf(stdout, ##args); \
+			out_printf(args); \
 		} \
 	} while (0);
 #define pr_out(args...) pr_outx(DEFAULT_VERB, ##args)
@@ -68,16 +347,27 @@ static int _mnlg_socket_send(struct mnlg_socket *nlg,
 	return 0;
 }
 
+static int _mnlg_socket_recv_err(struct mnlg_socket *nlg)
+{
+	int err = -errno;
+	const char *msg;
+
+	msg = mnlg_socket_ext_ack_msg(nlg);
+	if (msg)
+		pr_err("Error: %s\n", msg);
+	else
+		pr_err("Failed to call mnlg_socket_recv_run\n");
+	return err;
+}
+
 static int _mnlg_socket_recv_run(struct mnlg_socket *nlg,
 				 mnl_cb_t data_cb, void *data)
 {
 	int err;
 
 	err = mnlg_socket_recv_run(nlg, data_cb, data);
-	if (err < 0) {
-		pr_err("Failed to call mnlg_socket_recv_run\n");
-		return -errno;
-	}
+	if (err < 0)
+		return _mnlg_socket_recv_err(nlg);
 	return 0;
 }
 
@@ -122,11 +412,44 @@ static void index_map_free(struct index_map *index_map)
 	free(index_map);
 }
 
+enum dl_phase {
+	DL_PHASE_OPEN,		/* socket and family resolution, or cache map */
+	DL_PHASE_INDEX_MAP,
+	DL_PHASE_COMMAND,
+	DL_PHASE_OUTPUT,	/* final flush of buffered output */
+	DL_PHASE_MAX,
+};
+
+struct dl_phase_stats {
+	uint64_t wall_ns;
+	struct mnlg_stats nl;
+};
+
+struct dl_stats {
+	uint64_t mark_ns;
+	struct mnlg_stats nl_mark;
+	struct dl_phase_stats phases[DL_PHASE_MAX];
+};
+
 struct dl {
 	struct mnlg_socket *nlg;
 	struct list_item index_map_list;
 	int argc;
 	char **argv;
+	const struct dlcache_shm *cache;
+	const char *socket_path;
+	bool server;
+	struct devlink *devlink;
+	struct devlink_table *port_tbl;
+	bool timestamp;
+	const struct timespec *ts;	/* of the event being printed */
+	uint32_t snaplen;		/* hwmsg payload bytes shown, 0 all */
+	uint64_t snap_msgs;		/* hwmsgs cut short by snaplen */
+	uint64_t snap_bytes;		/* and the payload bytes not shown */
+	bool show_stats;
+	struct dl_stats stats;
+	bool uring;
+	bool all_netns;		/* one of the runs of --all-netns */
 };
 
 static int dl_argc(struct dl *dl)
@@ -163,9 +486,11 @@ static char *dl_argv_next(struct dl *dl)
 
 static int strcmpx(const char *str1, const char *str2)
 {
-	if (strlen(str1) > strlen(str2))
+	size_t len = strlen(str1);
+
+	if (len > strlen(str2))
                 return -1;
-	return strncmp(str1, str2, strlen(str1));
+	return strncmp(str1, str2, len);
 }
 
 static bool dl_argv_match(struct dl *dl, const char *pattern)
@@ -180,48 +505,22 @@ static bool dl_no_arg(struct dl *dl)
 	return dl_argc(dl) == 0;
 }
 
-static int attr_cb(const struct nlattr *attr, void *data)
+/* Long-running commands would block every other client of "dl server". */
+static bool dl_server_refuse(struct dl *dl)
 {
-	const struct nlattr **tb = data;
-	int type;
-
-	type = mnl_attr_get_type(attr);
-
-	if (mnl_attr_type_valid(attr, DEVLINK_ATTR_MAX) < 0)
-		return MNL_CB_ERROR;
+	if (!dl->server)
+		return false;
+	pr_err("Command cannot be run through server\n");
+	return true;
+}
 
-	if (type == DEVLINK_ATTR_INDEX &&
-	    mnl_attr_validate(attr, MNL_TYPE_U32) < 0)
-		return MNL_CB_ERROR;
-	if (type == DEVLINK_ATTR_NAME &&
-	    mnl_attr_validate(attr, MNL_TYPE_NUL_STRING) < 0)
-		return MNL_CB_ERROR;
-	if (type == DEVLINK_ATTR_BUS_NAME &&
-	    mnl_attr_validate(attr, MNL_TYPE_NUL_STRING) < 0)
-		return MNL_CB_ERROR;
-	if (type == DEVLINK_ATTR_DEV_NAME &&
-	    mnl_attr_validate(attr, MNL_TYPE_NUL_STRING) < 0)
-		return MNL_CB_ERROR;
-	if (type == DEVLINK_ATTR_PORT_INDEX &&
-	    mnl_attr_validate(attr, MNL_TYPE_U32) < 0)
-		return MNL_CB_ERROR;
-	if (type == DEVLINK_ATTR_PORT_TYPE &&
-	    mnl_attr_validate(attr, MNL_TYPE_U16) < 0)
-		return MNL_CB_ERROR;
-	if (type == DEVLINK_ATTR_PORT_DESIRED_TYPE &&
-	    mnl_attr_validate(attr, MNL_TYPE_U16) < 0)
-		return MNL_CB_ERROR;
-	if (type == DEVLINK_ATTR_PORT_NETDEV_IFINDEX &&
-	    mnl_attr_validate(attr, MNL_TYPE_U32) < 0)
-		return MNL_CB_ERROR;
-	if (type == DEVLINK_ATTR_PORT_NETDEV_NAME &&
-	    mnl_attr_validate(attr, MNL_TYPE_NUL_STRING) < 0)
-		return MNL_CB_ERROR;
-	if (type == DEVLINK_ATTR_PORT_IBDEV_NAME &&
-	    mnl_attr_validate(attr, MNL_TYPE_NUL_STRING) < 0)
-		return MNL_CB_ERROR;
-	tb[type] = attr;
-	return MNL_CB_OK;
+/* Neither would commands which never finish, when run in all namespaces. */
+static bool dl_all_netns_cmd_refuse(struct dl *dl)
+{
+	if (!dl->all_netns)
+		return false;
+	pr_err("Command can not be run in all namespaces\n");
+	return true;
 }
 
 static int index_map_cb(const struct nlmsghdr *nlh, void *data)
@@ -231,7 +530,7 @@ static int index_map_cb(const struct nlmsghdr *nlh, void *data)
 	struct dl *dl = data;
 	struct index_map *index_map;
 
-	mnl_attr_parse(nlh, sizeof(*genl), attr_cb, tb);
+	mnl_attr_parse(nlh, sizeof(*genl), devlink_attr_cb, tb);
 	if (!tb[DEVLINK_ATTR_INDEX] || !tb[DEVLINK_ATTR_NAME])
 		return MNL_CB_ERROR;
 
@@ -263,7 +562,7 @@ static int index_map_init(struct dl *dl)
 	list_init(&dl->index_map_list);
 
 	nlh = mnlg_msg_prepare(dl->nlg, DEVLINK_CMD_GET,
-			       NLM_F_REQUEST | NLM_F_ACK | NLM_F_DUMP);
+			       NLM_F_REQUEST | NLM_F_DUMP);
 
 	err = _mnlg_socket_send(dl->nlg, nlh);
 	if (err)
@@ -277,6 +576,29 @@ static int index_map_init(struct dl *dl)
 	return 0;
 }
 
+static int index_map_init_cached(struct dl *dl)
+{
+	struct dlcache_dev devs[DLCACHE_DEV_MAX];
+	struct index_map *index_map;
+	int count;
+	int i;
+
+	list_init(&dl->index_map_list);
+
+	count = dlcache_devs_get(dl->cache, devs, ARRAY_SIZE(devs));
+	if (count < 0)
+		return -errno;
+	for (i = 0; i < count; i++) {
+		index_map = index_map_alloc(devs[i].index, devs[i].name);
+		if (!index_map) {
+			index_map_fini(dl);
+			return -ENOMEM;
+		}
+		list_add_tail(&dl->index_map_list, &index_map->list);
+	}
+	return 0;
+}
+
 static int index_map_get_index(struct dl *dl, const char *name)
 {
 	struct index_map *index_map;
@@ -288,9 +610,51 @@ static int index_map_get_index(struct dl *dl, const char *name)
 	return -ENOENT;
 }
 
+static struct index_map *index_map_find(struct dl *dl, uint32_t index)
+{
+	struct index_map *index_map;
+
+	list_for_each_node_entry(index_map, &dl->index_map_list, list) {
+		if (index_map->index == index)
+			return index_map;
+	}
+	return NULL;
+}
+
+/* Applies a device notification to an already initialized map. */
+static int index_map_update(struct dl *dl, uint8_t cmd, uint32_t index,
+			    const char *name)
+{
+	struct index_map *index_map = index_map_find(dl, index);
+	char *new_name;
+
+	if (cmd == DEVLINK_CMD_DEL) {
+		if (index_map) {
+			list_del(&index_map->list);
+			index_map_free(index_map);
+		}
+		return 0;
+	}
+	if (!index_map) {
+		index_map = index_map_alloc(index, name);
+		if (!index_map)
+			return -ENOMEM;
+		list_add_tail(&dl->index_map_list, &index_map->list);
+		return 0;
+	}
+	if (strcmp(index_map->name, name) == 0)
+		return 0;
+	new_name = strdup(name);
+	if (!new_name)
+		return -ENOMEM;
+	free(index_map->name);
+	index_map->name = new_name;
+	return 0;
+}
+
 static const char *index_map_get_name(struct dl *dl, uint32_t index)
 {
-	static char tmp[32];
+	static __thread char tmp[32];
 	struct index_map *index_map;
 
 	list_for_each_node_entry(index_map, &dl->index_map_list, list) {
@@ -345,6 +709,105 @@ static int strtouint(const char *str)
 	return val;
 }
 
+static void port_tbl_fini(struct dl *dl)
+{
+	if (!dl->port_tbl)
+		return;
+	devlink_table_free(dl->port_tbl);
+	devlink_close(dl->devlink);
+	dl->port_tbl = NULL;
+}
+
+/* The reverse index is filled by a single port dump on first use and kept
+ * for the lifetime of dl, so a server only pays for it once.
+ */
+static int port_tbl_init(struct dl *dl)
+{
+	dl->devlink = devlink_attach(dl->nlg);
+	if (!dl->devlink)
+		return -ENOMEM;
+	dl->port_tbl = devlink_table_alloc();
+	if (!dl->port_tbl)
+		goto err_table_alloc;
+	if (devlink_port_dump(dl->devlink, dl->port_tbl)) {
+		pr_err("Failed to dump ports\n");
+		goto err_port_dump;
+	}
+	return 0;
+
+err_port_dump:
+	devlink_table_free(dl->port_tbl);
+	dl->port_tbl = NULL;
+err_table_alloc:
+	devlink_close(dl->devlink);
+	return -errno;
+}
+
+static int port_lookup_cached(struct dl *dl, const char *str, int ifindex,
+			      uint32_t *p_index, uint32_t *p_port_index)
+{
+	struct dlcache_port *ports;
+	int count;
+	int i;
+
+	ports = malloc(DLCACHE_PORT_MAX * sizeof(*ports));
+	if (!ports)
+		return -ENOMEM;
+	count = dlcache_ports_get(dl->cache, ports, DLCACHE_PORT_MAX);
+	if (count < 0) {
+		free(ports);
+		return -errno;
+	}
+	for (i = 0; i < count; i++) {
+		if (strcmp(ports[i].netdev_name, str) == 0 ||
+		    strcmp(ports[i].ibdev_name, str) == 0 ||
+		    (ifindex >= 0 &&
+		     ports[i].flags & DLCACHE_PORT_F_NETDEV_IFINDEX &&
+		     ports[i].netdev_ifindex == ifindex))
+			break;
+	}
+	if (i < count) {
+		*p_index = ports[i].index;
+		*p_port_index = ports[i].port_index;
+	}
+	free(ports);
+	return i < count ? 0 : -ENOENT;
+}
+
+static int port_lookup(struct dl *dl, const char *str,
+		       uint32_t *p_index, uint32_t *p_port_index)
+{
+	const struct devlink_port *port;
+	int ifindex = strtouint(str);
+	int err;
+
+	if (dl->cache) {
+		err = port_lookup_cached(dl, str, ifindex,
+					 p_index, p_port_index);
+		goto out;
+	}
+
+	if (!dl->port_tbl) {
+		err = port_tbl_init(dl);
+		if (err)
+			return err;
+	}
+	port = devlink_port_lookup_netdev(dl->port_tbl, str);
+	if (!port)
+		port = devlink_port_lookup_ibdev(dl->port_tbl, str);
+	if (!port && ifindex >= 0)
+		port = devlink_port_lookup_ifindex(dl->port_tbl, ifindex);
+	err = port ? 0 : -ENOENT;
+	if (port) {
+		*p_index = port->index;
+		*p_port_index = port->port_index;
+	}
+out:
+	if (err == -ENOENT)
+		pr_err("Port \"%s\" not found\n", str);
+	return err;
+}
+
 static int dl_argv_indexes(struct dl *dl, uint32_t *p_index,
 			   uint32_t *p_port_index)
 {
@@ -355,15 +818,13 @@ static int dl_argv_indexes(struct dl *dl, uint32_t *p_index,
 	int err;
 
 	if (!str) {
-		pr_err("Port identification (\"device/port_index\") expected\n");
+		pr_err("Port identification (\"device/port_index\", netdev or ifindex) expected\n");
 		return -EINVAL;
 	}
 
 	err = slashsplit(str, &devstr, &portstr);
-	if (err) {
-		pr_err("Wrong port identification string format. Expected \"device/port_index\"\n");
-		return err;
-	}
+	if (err)
+		return port_lookup(dl, str, p_index, p_port_index);
 	index = index_map_get_index(dl, devstr);
 	if (index < 0) {
 		pr_err("Device \"%s\" not found\n", devstr);
@@ -399,248 +860,386 @@ static int dl_argv_uint32_t(struct dl *dl, uint32_t *p_val)
 	return 0;
 }
 
-static void pr_out_dev(struct nlattr **tb)
+static int port_type_get(const char *typestr, enum devlink_port_type *p_type)
 {
-	pr_out("%d: %s:", mnl_attr_get_u32(tb[DEVLINK_ATTR_INDEX]),
-			  mnl_attr_get_str(tb[DEVLINK_ATTR_NAME]));
-	if (tb[DEVLINK_ATTR_BUS_NAME])
-		pr_out(" bus %s", mnl_attr_get_str(tb[DEVLINK_ATTR_BUS_NAME]));
-	if (tb[DEVLINK_ATTR_DEV_NAME])
-		pr_out(" dev %s", mnl_attr_get_str(tb[DEVLINK_ATTR_DEV_NAME]));
-	pr_out("\n");
+	if (strcmp(typestr, "auto") == 0) {
+		*p_type = DEVLINK_PORT_TYPE_AUTO;
+	} else if (strcmp(typestr, "eth") == 0) {
+		*p_type = DEVLINK_PORT_TYPE_ETH;
+	} else if (strcmp(typestr, "ib") == 0) {
+		*p_type = DEVLINK_PORT_TYPE_IB;
+	} else {
+		pr_err("Unknown port type \"%s\"\n", typestr);
+		return -EINVAL;
+	}
+	return 0;
 }
 
-static int cmd_dev_show_cb(const struct nlmsghdr *nlh, void *data)
-{
-	struct nlattr *tb[DEVLINK_ATTR_MAX + 1] = {};
-	struct genlmsghdr *genl = mnl_nlmsg_get_payload(nlh);
+/*
+ * Commands are described by static tables. Words are matched as prefixes
+ * in table order, so that the first entry wins where an abbreviation is
+ * ambiguous. The same tables give the help text and "dl complete".
+ */
 
-	mnl_attr_parse(nlh, sizeof(*genl), attr_cb, tb);
-	if (!tb[DEVLINK_ATTR_INDEX] || !tb[DEVLINK_ATTR_NAME])
-		return MNL_CB_ERROR;
-	pr_out_dev(tb);
-	return MNL_CB_OK;
-}
+enum dl_opt_type {
+	DL_OPT_STR,
+	DL_OPT_U32,
+	DL_OPT_PORT_TYPE,
+};
 
-static int cmd_dev_show(struct dl *dl)
-{
-	struct nlmsghdr *nlh;
-	uint16_t flags = NLM_F_REQUEST | NLM_F_ACK;
-	int err;
+/* A "NAME VALUE" pair going straight into a netlink attribute. */
+struct dl_opt {
+	const char *name;
+	enum dl_opt_type type;
+	uint16_t attr;
+	const char *arg;	/* the value, as shown by help */
+};
 
-	if (dl_argc(dl) == 0)
-		flags |= NLM_F_DUMP;
+#define DL_CMD_DEFAULT	(1 << 0)	/* run when no word is given */
+#define DL_CMD_HIDDEN	(1 << 1)	/* left out of help */
+#define DL_CMD_NO_NETNS	(1 << 2)	/* refused with --all-netns */
+#define DL_CMD_NO_INDEX_MAP (1 << 3)	/* dl_init() skips the index map */
+
+struct dl_cmd_table;
+
+struct dl_cmd {
+	const char *name;
+	size_t len;
+	unsigned int flags;
+	int (*fn)(struct dl *dl);	/* NULL for help of the table */
+	const struct dl_cmd_table *sub;
+	/* Arguments for help, one line each. Words starting with "--" are
+	 * also offered for completion.
+	 */
+	const char *args;
+	const struct dl_opt *opts;
+	unsigned int opt_count;
+};
 
-	nlh = mnlg_msg_prepare(dl->nlg, DEVLINK_CMD_GET, flags);
-	if (dl_argc(dl) == 1) {
-		int index = index_map_get_index(dl, dl_argv(dl));
+#define DL_CMD(_name, _fn, _flags, _args)				\
+	{ .name = _name, .len = sizeof(_name) - 1, .flags = _flags,	\
+	  .fn = _fn, .args = _args }
 
-		if (index < 0)
-			return index;
-		mnl_attr_put_u32(nlh, DEVLINK_ATTR_INDEX, index);
-	}
+#define DL_CMD_OPTS(_name, _fn, _args, _opts)				\
+	{ .name = _name, .len = sizeof(_name) - 1, .fn = _fn,		\
+	  .args = _args, .opts = _opts, .opt_count = ARRAY_SIZE(_opts) }
 
-	err = _mnlg_socket_send(dl->nlg, nlh);
-	if (err)
-		return err;
+#define DL_CMD_SUB(_name, _sub)						\
+	{ .name = _name, .len = sizeof(_name) - 1, .sub = _sub }
 
-	err = _mnlg_socket_recv_run(dl->nlg, cmd_dev_show_cb, NULL);
-	if (err)
-		return err;
+struct dl_cmd_table {
+	const char *prefix;	/* "dl port" */
+	const char *what;	/* "Command" or "Object" */
+	const struct dl_cmd *cmds;
+	unsigned int count;
+	const char *footer;	/* printed after the usage lines */
+	void (*help)(void);	/* instead of the usage lines */
+};
 
-	return 0;
+static const struct dl_cmd *dl_cmd_lookup(const struct dl_cmd_table *table,
+					  const char *word)
+{
+	size_t len = strlen(word);
+	unsigned int i;
+
+	for (i = 0; i < table->count; i++)
+		if (len <= table->cmds[i].len &&
+		    !memcmp(word, table->cmds[i].name, len))
+			return &table->cmds[i];
+	return NULL;
 }
 
-static int cmd_dev_set(struct dl *dl)
+static void pr_out_cmd_usage(const struct dl_cmd_table *table,
+			     const struct dl_cmd *cmd)
 {
-	struct nlmsghdr *nlh;
-	uint16_t flags = NLM_F_REQUEST | NLM_F_ACK;
-	uint32_t index;
-	int err;
+	const char *line = cmd->args;
+	const char *end;
+	unsigned int i;
+
+	do {
+		end = line ? strchrnul(line, '\n') : NULL;
+		out_mem("Usage: ", 7);
+		out_str(table->prefix);
+		out_char(' ');
+		out_str(cmd->name);
+		if (line && end != line) {
+			out_char(' ');
+			out_mem(line, end - line);
+		}
+		for (i = 0; i < cmd->opt_count; i++)
+			out_printf(" [ %s %s ]", cmd->opts[i].name,
+				   cmd->opts[i].arg);
+		out_char('\n');
+		line = end && *end ? end + 1 : NULL;
+	} while (line);
+}
 
-	nlh = mnlg_msg_prepare(dl->nlg, DEVLINK_CMD_SET, flags);
-	err = dl_argv_index(dl, &index);
-	if (err)
-		return err;
-	mnl_attr_put_u32(nlh, DEVLINK_ATTR_INDEX, index);
+static void pr_out_cmd_help(const struct dl_cmd_table *table)
+{
+	const struct dl_cmd *cmd;
+	unsigned int i;
 
-	while (dl_argc(dl)) {
-		if (dl_argv_match(dl, "name")) {
-			const char *name;
+	if (table->help) {
+		table->help();
+		return;
+	}
+	for (i = 0; i < table->count; i++) {
+		cmd = &table->cmds[i];
+		if (cmd->fn && !(cmd->flags & DL_CMD_HIDDEN))
+			pr_out_cmd_usage(table, cmd);
+	}
+	if (table->footer)
+		out_str(table->footer);
+}
 
-			dl_arg_inc(dl);
-			name = dl_argv_next(dl);
-			if (!name) {
-				pr_err("Name argument expected\n");
-				return -EINVAL;
-			}
-			mnl_attr_put_strz(nlh, DEVLINK_ATTR_NAME, name);
+static int dl_cmd_run(struct dl *dl, const struct dl_cmd_table *table)
+{
+	const struct dl_cmd *cmd = NULL;
+	unsigned int i;
+
+	if (dl_no_arg(dl)) {
+		for (i = 0; i < table->count; i++)
+			if (table->cmds[i].flags & DL_CMD_DEFAULT)
+				cmd = &table->cmds[i];
+	} else {
+		cmd = dl_cmd_lookup(table, dl_argv(dl));
+		if (!cmd) {
+			pr_err("%s \"%s\" not found\n", table->what,
+			       dl_argv(dl));
+			return -ENOENT;
 		}
 		dl_arg_inc(dl);
 	}
-	err = _mnlg_socket_send(dl->nlg, nlh);
-	if (err)
-		return err;
+	if (cmd && cmd->sub)
+		return dl_cmd_run(dl, cmd->sub);
+	if (!cmd || !cmd->fn) {
+		pr_out_cmd_help(table);
+		return 0;
+	}
+	return cmd->fn(dl);
+}
 
-	err = _mnlg_socket_recv_run(dl->nlg, cmd_dev_show_cb, NULL);
-	if (err)
-		return err;
+/* Puts every "NAME VALUE" pair up to the first word which names no
+ * option into nlh. If vals is given, numeric values are also stored
+ * there, at the position of their option. Returns a mask of the options
+ * seen.
+ */
+static int dl_argv_opts(struct dl *dl, struct nlmsghdr *nlh,
+			const struct dl_opt *opts, unsigned int count,
+			uint32_t *vals)
+{
+	enum devlink_port_type type;
+	const char *str;
+	unsigned int i;
+	int mask = 0;
+	int val;
+	int err;
 
-	return 0;
+	while (dl_argc(dl)) {
+		for (i = 0; i < count; i++)
+			if (dl_argv_match(dl, opts[i].name))
+				break;
+		if (i == count)
+			break;
+		dl_arg_inc(dl);
+		str = dl_argv_next(dl);
+		if (!str) {
+			pr_err("\"%s\" needs %s\n", opts[i].name, opts[i].arg);
+			return -EINVAL;
+		}
+		switch (opts[i].type) {
+		case DL_OPT_STR:
+			mnl_attr_put_strz(nlh, opts[i].attr, str);
+			break;
+		case DL_OPT_U32:
+			val = strtouint(str);
+			if (val < 0) {
+				pr_err("\"%s\" is not a number\n", str);
+				return val;
+			}
+			mnl_attr_put_u32(nlh, opts[i].attr, val);
+			if (vals)
+				vals[i] = val;
+			break;
+		case DL_OPT_PORT_TYPE:
+			err = port_type_get(str, &type);
+			if (err)
+				return err;
+			mnl_attr_put_u16(nlh, opts[i].attr, type);
+			if (vals)
+				vals[i] = type;
+			break;
+		}
+		mask |= 1 << i;
+	}
+	return mask;
 }
 
-static void cmd_dev_help() {
-	pr_out("Usage: dl dev show [DEV]\n");
-	pr_out("Usage: dl dev set DEV [ name NEWNAME ]\n");
+/* Offers the words of cmd's arguments which start with "--". */
+static void pr_out_complete_flags(const struct dl_cmd *cmd, const char *word)
+{
+	size_t len = strlen(word);
+	const char *pos = cmd->args;
+	const char *end;
+
+	while (pos && (pos = strstr(pos, "--"))) {
+		end = pos + strcspn(pos, " \n");
+		if (end - pos >= len && !memcmp(pos, word, len)) {
+			out_mem(pos, end - pos);
+			out_char('\n');
+		}
+		pos = end;
+	}
 }
 
-static int cmd_dev(struct dl *dl)
+/* "dl complete WORD..." prints the candidates for the last word. */
+static int dl_complete(const struct dl_cmd_table *table, int argc,
+		       char **argv)
 {
-	if (dl_argv_match(dl, "help")) {
-		cmd_dev_help();
+	const struct dl_cmd *cmd = NULL;
+	const char *word;
+	size_t len;
+	unsigned int i;
+
+	for (; argc > 1; argc--, argv++) {
+		if (!table)
+			continue;
+		cmd = dl_cmd_lookup(table, argv[0]);
+		if (!cmd)
+			return 0;
+		table = cmd->sub;
+	}
+	word = argc ? argv[0] : "";
+	len = strlen(word);
+	if (table) {
+		for (i = 0; i < table->count; i++) {
+			if (table->cmds[i].flags & DL_CMD_HIDDEN ||
+			    len > table->cmds[i].len ||
+			    memcmp(word, table->cmds[i].name, len))
+				continue;
+			out_str(table->cmds[i].name);
+			out_char('\n');
+		}
 		return 0;
-	} else if (dl_argv_match(dl, "show") || dl_no_arg(dl)) {
-		dl_arg_inc(dl);
-		return cmd_dev_show(dl);
-	} else if (dl_argv_match(dl, "set")) {
-		dl_arg_inc(dl);
-		return cmd_dev_set(dl);
-	} else {
-		pr_err("Command \"%s\" not found\n", dl_argv(dl));
-		return -ENOENT;
 	}
+	for (i = 0; i < cmd->opt_count; i++) {
+		if (strncmp(word, cmd->opts[i].name, len))
+			continue;
+		out_str(cmd->opts[i].name);
+		out_char('\n');
+	}
+	pr_out_complete_flags(cmd, word);
 	return 0;
 }
 
-static const char *port_type_name(uint32_t type)
+/* Shared by the netlink and the cache paths, NULL means not present. */
+static void pr_out_dev_fields(uint32_t index, const char *name,
+			      const char *bus_name, const char *dev_name)
 {
-	switch (type) {
-	case DEVLINK_PORT_TYPE_NOTSET: return "notset";
-	case DEVLINK_PORT_TYPE_AUTO: return "auto";
-	case DEVLINK_PORT_TYPE_ETH: return "eth";
-	case DEVLINK_PORT_TYPE_IB: return "ib";
-	default: return "<unknown type>";
+	out_u32(index);
+	out_mem(": ", 2);
+	out_str(name);
+	out_char(':');
+	if (bus_name) {
+		out_mem(" bus ", 5);
+		out_str(bus_name);
+	}
+	if (dev_name) {
+		out_mem(" dev ", 5);
+		out_str(dev_name);
 	}
+	out_char('\n');
+	out_record_end();
 }
 
-static void pr_out_port(struct dl *dl, struct nlattr **tb)
+static const char *attr_str(const struct nlattr *attr)
 {
-	pr_out("%s/%d:",
-	       index_map_get_name(dl, mnl_attr_get_u32(tb[DEVLINK_ATTR_INDEX])),
-	       mnl_attr_get_u32(tb[DEVLINK_ATTR_PORT_INDEX]));
-	if (tb[DEVLINK_ATTR_PORT_TYPE]) {
-		uint16_t port_type = mnl_attr_get_u16(tb[DEVLINK_ATTR_PORT_TYPE]);
-
-		pr_out(" type %s", port_type_name(port_type));
-		if (tb[DEVLINK_ATTR_PORT_DESIRED_TYPE]) {
-			uint16_t des_port_type = mnl_attr_get_u16(tb[DEVLINK_ATTR_PORT_DESIRED_TYPE]);
+	return attr ? mnl_attr_get_str(attr) : NULL;
+}
 
-			if (port_type != des_port_type)
-				pr_out("(%s)", port_type_name(des_port_type));
-		}
-	}
-	if (tb[DEVLINK_ATTR_PORT_NETDEV_NAME])
-		pr_out(" netdev %s",
-		       mnl_attr_get_str(tb[DEVLINK_ATTR_PORT_NETDEV_NAME]));
-	if (tb[DEVLINK_ATTR_PORT_IBDEV_NAME])
-		pr_out(" ibdev %s",
-		       mnl_attr_get_str(tb[DEVLINK_ATTR_PORT_IBDEV_NAME]));
-	pr_out("\n");
+static void pr_out_dev(struct nlattr **tb)
+{
+	pr_out_dev_fields(mnl_attr_get_u32(tb[DEVLINK_ATTR_INDEX]),
+			  mnl_attr_get_str(tb[DEVLINK_ATTR_NAME]),
+			  attr_str(tb[DEVLINK_ATTR_BUS_NAME]),
+			  attr_str(tb[DEVLINK_ATTR_DEV_NAME]));
 }
 
-static int cmd_port_show_cb(const struct nlmsghdr *nlh, void *data)
+static int cmd_dev_show_cb(const struct nlmsghdr *nlh, void *data)
 {
-	struct dl *dl = data;
 	struct nlattr *tb[DEVLINK_ATTR_MAX + 1] = {};
 	struct genlmsghdr *genl = mnl_nlmsg_get_payload(nlh);
 
-	mnl_attr_parse(nlh, sizeof(*genl), attr_cb, tb);
-	if (!tb[DEVLINK_ATTR_INDEX] || !tb[DEVLINK_ATTR_PORT_INDEX])
+	mnl_attr_parse(nlh, sizeof(*genl), devlink_attr_cb, tb);
+	if (!tb[DEVLINK_ATTR_INDEX] || !tb[DEVLINK_ATTR_NAME])
 		return MNL_CB_ERROR;
-	pr_out_port(dl, tb);
+	pr_out_dev(tb);
 	return MNL_CB_OK;
 }
 
-static int cmd_port_show(struct dl *dl)
+static int cmd_show_watch(struct dl *dl, bool ports);
+
+static int cmd_dev_show(struct dl *dl)
 {
 	struct nlmsghdr *nlh;
-	uint16_t flags = NLM_F_REQUEST | NLM_F_ACK;
+	uint16_t flags = NLM_F_REQUEST;
 	int err;
 
+	if (dl_argv_match(dl, "--watch")) {
+		dl_arg_inc(dl);
+		return cmd_show_watch(dl, false);
+	}
+
+	/* A dump is terminated by NLMSG_DONE, it needs no ack. */
 	if (dl_argc(dl) == 0)
 		flags |= NLM_F_DUMP;
+	else
+		flags |= NLM_F_ACK;
 
-	nlh = mnlg_msg_prepare(dl->nlg, DEVLINK_CMD_PORT_GET, flags);
+	nlh = mnlg_msg_prepare(dl->nlg, DEVLINK_CMD_GET, flags);
 	if (dl_argc(dl) == 1) {
-		uint32_t index;
-		uint32_t port_index;
+		int index = index_map_get_index(dl, dl_argv(dl));
 
-		err = dl_argv_indexes(dl, &index, &port_index);
-		if (err)
-			return err;
+		if (index < 0)
+			return index;
 		mnl_attr_put_u32(nlh, DEVLINK_ATTR_INDEX, index);
-		mnl_attr_put_u32(nlh, DEVLINK_ATTR_PORT_INDEX, port_index);
 	}
 
 	err = _mnlg_socket_send(dl->nlg, nlh);
 	if (err)
 		return err;
 
-	err = _mnlg_socket_recv_run(dl->nlg, cmd_port_show_cb, dl);
+	err = _mnlg_socket_recv_run(dl->nlg, cmd_dev_show_cb, NULL);
 	if (err)
 		return err;
 
 	return 0;
 }
 
-static int port_type_get(const char *typestr, enum devlink_port_type *p_type)
-{
-	if (strcmp(typestr, "auto") == 0) {
-		*p_type = DEVLINK_PORT_TYPE_AUTO;
-	} else if (strcmp(typestr, "eth") == 0) {
-		*p_type = DEVLINK_PORT_TYPE_ETH;
-	} else if (strcmp(typestr, "ib") == 0) {
-		*p_type = DEVLINK_PORT_TYPE_IB;
-	} else {
-		pr_err("Unknown port type \"%s\"\n", typestr);
-		return -EINVAL;
-	}
-	return 0;
-}
+static const struct dl_opt dev_set_opts[] = {
+	{ "name", DL_OPT_STR, DEVLINK_ATTR_NAME, "NEWNAME" },
+};
 
-static int cmd_port_set(struct dl *dl)
+static int cmd_dev_set(struct dl *dl)
 {
 	struct nlmsghdr *nlh;
 	uint16_t flags = NLM_F_REQUEST | NLM_F_ACK;
 	uint32_t index;
-	uint32_t port_index;
 	int err;
 
-	nlh = mnlg_msg_prepare(dl->nlg, DEVLINK_CMD_PORT_SET, flags);
-	err = dl_argv_indexes(dl, &index, &port_index);
+	nlh = mnlg_msg_prepare(dl->nlg, DEVLINK_CMD_SET, flags);
+	err = dl_argv_index(dl, &index);
 	if (err)
 		return err;
 	mnl_attr_put_u32(nlh, DEVLINK_ATTR_INDEX, index);
-	mnl_attr_put_u32(nlh, DEVLINK_ATTR_PORT_INDEX, port_index);
-
-	while (dl_argc(dl)) {
-		if (dl_argv_match(dl, "type")) {
-			const char *typestr;
-			enum devlink_port_type type;
-
-			dl_arg_inc(dl);
-			typestr = dl_argv_next(dl);
-			if (!typestr) {
-				pr_err("Type argument expected\n");
-				return -EINVAL;
-			}
-			err = port_type_get(typestr, &type);
-			if (err)
-				return err;
 
-			mnl_attr_put_u16(nlh, DEVLINK_ATTR_PORT_TYPE, type);
-		}
-		dl_arg_inc(dl);
+	err = dl_argv_opts(dl, nlh, dev_set_opts, ARRAY_SIZE(dev_set_opts),
+			   NULL);
+	if (err < 0)
+		return err;
+	if (dl_argc(dl)) {
+		pr_err("Unknown option \"%s\"\n", dl_argv(dl));
+		return -EINVAL;
 	}
 	err = _mnlg_socket_send(dl->nlg, nlh);
 	if (err)
@@ -653,292 +1252,5781 @@ static int cmd_port_set(struct dl *dl)
 	return 0;
 }
 
-static int cmd_port_split(struct dl *dl)
+static const struct dl_cmd dev_cmds[] = {
+	DL_CMD("help", NULL, 0, NULL),
+	DL_CMD("show", cmd_dev_show, DL_CMD_DEFAULT, "[DEV]\n--watch"),
+	DL_CMD_OPTS("set", cmd_dev_set, "DEV", dev_set_opts),
+};
+
+static const struct dl_cmd_table dev_table = {
+	.prefix = "dl dev",
+	.what = "Command",
+	.cmds = dev_cmds,
+	.count = ARRAY_SIZE(dev_cmds),
+};
+
+struct port_fields {
+	const char *dev_name;
+	uint32_t port_index;
+	bool has_type;
+	bool has_desired_type;
+	uint16_t type;
+	uint16_t desired_type;
+	const char *netdev_name;
+	const char *ibdev_name;
+};
+
+static void pr_out_port_fields(const struct port_fields *port)
 {
-	struct nlmsghdr *nlh;
-	uint16_t flags = NLM_F_REQUEST | NLM_F_ACK;
+	out_str(port->dev_name);
+	out_char('/');
+	out_u32(port->port_index);
+	out_char(':');
+	if (port->has_type) {
+		out_mem(" type ", 6);
+		out_str(devlink_port_type_name(port->type));
+		if (port->has_desired_type &&
+		    port->type != port->desired_type) {
+			out_char('(');
+			out_str(devlink_port_type_name(port->desired_type));
+			out_char(')');
+		}
+	}
+	if (port->netdev_name) {
+		out_mem(" netdev ", 8);
+		out_str(port->netdev_name);
+	}
+	if (port->ibdev_name) {
+		out_mem(" ibdev ", 7);
+		out_str(port->ibdev_name);
+	}
+	out_char('\n');
+	out_record_end();
+}
+
+/* Fills in everything but dev_name. */
+static void port_fields_parse(struct port_fields *port, struct nlattr **tb)
+{
+	memset(port, 0, sizeof(*port));
+	port->port_index = mnl_attr_get_u32(tb[DEVLINK_ATTR_PORT_INDEX]);
+	port->netdev_name = attr_str(tb[DEVLINK_ATTR_PORT_NETDEV_NAME]);
+	port->ibdev_name = attr_str(tb[DEVLINK_ATTR_PORT_IBDEV_NAME]);
+	if (tb[DEVLINK_ATTR_PORT_TYPE]) {
+		port->has_type = true;
+		port->type = mnl_attr_get_u16(tb[DEVLINK_ATTR_PORT_TYPE]);
+	}
+	if (tb[DEVLINK_ATTR_PORT_DESIRED_TYPE]) {
+		port->has_desired_type = true;
+		port->desired_type =
+			mnl_attr_get_u16(tb[DEVLINK_ATTR_PORT_DESIRED_TYPE]);
+	}
+}
+
+static void pr_out_port(struct dl *dl, struct nlattr **tb)
+{
+	struct port_fields port;
+
+	port_fields_parse(&port, tb);
+	port.dev_name = index_map_get_name(dl,
+				mnl_attr_get_u32(tb[DEVLINK_ATTR_INDEX]));
+	pr_out_port_fields(&port);
+}
+
+struct port_show_ctx {
+	struct dl *dl;
+	bool dev_filter;
 	uint32_t index;
-	uint32_t port_index;
-	uint32_t count;
-	int err;
+};
 
-	nlh = mnlg_msg_prepare(dl->nlg, DEVLINK_CMD_PORT_SPLIT, flags);
-	err = dl_argv_indexes(dl, &index, &port_index);
-	if (err)
-		return err;
-	mnl_attr_put_u32(nlh, DEVLINK_ATTR_INDEX, index);
-	mnl_attr_put_u32(nlh, DEVLINK_ATTR_PORT_INDEX, port_index);
+/* The kernel puts the device index first, so in the common case this only
+ * looks at the attribute at a fixed offset behind the genl header.
+ */
+static bool port_msg_index_match(const struct nlmsghdr *nlh, uint32_t index)
+{
+	const struct nlattr *attr;
 
-	err = dl_argv_uint32_t(dl, &count);
-	if (err)
-		return err;
-	mnl_attr_put_u32(nlh, DEVLINK_ATTR_PORT_SPLIT_COUNT, count);
+	mnl_attr_for_each(attr, nlh, sizeof(struct genlmsghdr)) {
+		if (mnl_attr_get_type(attr) != DEVLINK_ATTR_INDEX)
+			continue;
+		return mnl_attr_get_payload_len(attr) == sizeof(uint32_t) &&
+		       mnl_attr_get_u32(attr) == index;
+	}
+	return false;
+}
 
-	err = _mnlg_socket_send(dl->nlg, nlh);
-	if (err)
-		return err;
+static int cmd_port_show_cb(const struct nlmsghdr *nlh, void *data)
+{
+	struct port_show_ctx *ctx = data;
+	struct dl *dl = ctx->dl;
+	struct nlattr *tb[DEVLINK_ATTR_MAX + 1] = {};
+	struct genlmsghdr *genl = mnl_nlmsg_get_payload(nlh);
 
-	err = _mnlg_socket_recv_run(dl->nlg, cmd_dev_show_cb, NULL);
-	if (err)
-		return err;
+	/* Older kernels ignore the index on dump, filter here. */
+	if (ctx->dev_filter && !port_msg_index_match(nlh, ctx->index))
+		return MNL_CB_OK;
 
-	return 0;
+	mnl_attr_parse(nlh, sizeof(*genl), devlink_attr_cb, tb);
+	if (!tb[DEVLINK_ATTR_INDEX] || !tb[DEVLINK_ATTR_PORT_INDEX])
+		return MNL_CB_ERROR;
+	pr_out_port(dl, tb);
+	return MNL_CB_OK;
 }
 
-static int cmd_port_unsplit(struct dl *dl)
+/* A plain device name selects all ports of that device. */
+static bool dl_argv_dev(struct dl *dl, uint32_t *p_index)
 {
-	struct nlmsghdr *nlh;
-	uint16_t flags = NLM_F_REQUEST | NLM_F_ACK;
+	char *str = dl_argv(dl);
+	int index;
+
+	if (!str || strchr(str, '/'))
+		return false;
+	index = index_map_get_index(dl, str);
+	if (index < 0)
+		return false;
+	dl_arg_inc(dl);
+	*p_index = index;
+	return true;
+}
+
+/* Whether any word names the "--" option, matched as dl_argv_match() does. */
+static bool dl_argv_has(struct dl *dl, const char *opt)
+{
+	const char *arg;
+	int i;
+
+	for (i = 0; i < dl_argc(dl); i++) {
+		arg = dl->argv[i];
+		if (arg[0] == '-' && arg[1] == '-' && arg[2] &&
+		    strcmpx(arg, opt) == 0)
+			return true;
+	}
+	return false;
+}
+
+struct port_poll {
 	uint32_t index;
 	uint32_t port_index;
+	struct nlmsghdr *last;	/* previous reply, NULL if none */
+	int err;		/* errno the previous request failed with */
+};
+
+struct port_poll_ctx {
+	struct dl *dl;
+	struct mnlg_batch *batch;
+	struct port_poll *polls;
+	unsigned int count;
+};
+
+/* Prints a port only if its reply differs from the previous one. */
+static int port_poll_cb(const struct nlmsghdr *nlh, void *data)
+{
+	struct port_poll_ctx *ctx = data;
+	struct nlattr *tb[DEVLINK_ATTR_MAX + 1] = {};
+	struct genlmsghdr *genl = mnl_nlmsg_get_payload(nlh);
+	struct port_poll *port;
+	unsigned int i;
+
+	i = nlh->nlmsg_seq - mnlg_batch_seq(ctx->batch);
+	if (i >= ctx->count)
+		return MNL_CB_OK;
+	port = &ctx->polls[i];
+	if (port->last && port->last->nlmsg_len == nlh->nlmsg_len &&
+	    !memcmp(mnl_nlmsg_get_payload(port->last), genl,
+		    nlh->nlmsg_len - sizeof(*nlh)))
+		return MNL_CB_OK;
+
+	mnl_attr_parse(nlh, sizeof(*genl), devlink_attr_cb, tb);
+	if (!tb[DEVLINK_ATTR_INDEX] || !tb[DEVLINK_ATTR_PORT_INDEX])
+		return MNL_CB_ERROR;
+	free(port->last);
+	port->last = malloc(nlh->nlmsg_len);
+	if (!port->last)
+		return MNL_CB_ERROR;
+	memcpy(port->last, nlh, nlh->nlmsg_len);
+	pr_out_port(ctx->dl, tb);
+	return MNL_CB_OK;
+}
+
+static void port_poll_errors(struct port_poll_ctx *ctx)
+{
+	struct port_poll *port;
+	unsigned int i;
 	int err;
 
-	nlh = mnlg_msg_prepare(dl->nlg, DEVLINK_CMD_PORT_UNSPLIT, flags);
-	err = dl_argv_indexes(dl, &index, &port_index);
-	if (err)
-		return err;
-	mnl_attr_put_u32(nlh, DEVLINK_ATTR_INDEX, index);
-	mnl_attr_put_u32(nlh, DEVLINK_ATTR_PORT_INDEX, port_index);
+	for (i = 0; i < ctx->count; i++) {
+		port = &ctx->polls[i];
+		err = mnlg_batch_msg_error(ctx->batch, i);
+		if (err == port->err)
+			continue;
+		port->err = err;
+		if (!err)
+			continue;
+		/* Printed again once the port is back. */
+		free(port->last);
+		port->last = NULL;
+		out_printf("%s/%u: %s\n", index_map_get_name(ctx->dl,
+								port->index),
+			   port->port_index, strerror(err));
+		out_record_end();
+	}
+}
 
-	err = _mnlg_socket_send(dl->nlg, nlh);
-	if (err)
-		return err;
+static void ns_to_timespec(uint64_t ns, struct timespec *ts)
+{
+	ts->tv_sec = ns / 1000000000ULL;
+	ts->tv_nsec = ns % 1000000000ULL;
+}
 
-	err = _mnlg_socket_recv_run(dl->nlg, cmd_dev_show_cb, NULL);
-	if (err)
-		return err;
+/* The requests are built once. Each tick sends them all in one go and
+ * prints only the ports whose state changed since the previous one.
+ */
+static int cmd_port_show_poll(struct dl *dl)
+{
+	struct port_poll_ctx ctx = {
+		.dl = dl,
+	};
+	struct port_poll *polls;
+	struct nlmsghdr *nlh;
+	struct timespec ts;
+	uint32_t interval = 0;
+	uint64_t next;
+	uint64_t now;
+	unsigned int i;
+	int err;
+
+	if (dl_server_refuse(dl) || dl_all_netns_cmd_refuse(dl))
+		return -EOPNOTSUPP;
+
+	while (dl_argc(dl)) {
+		if (dl_argv_match(dl, "--interval")) {
+			dl_arg_inc(dl);
+			err = dl_argv_uint32_t(dl, &interval);
+			if (err)
+				goto out;
+			continue;
+		}
+		polls = realloc(ctx.polls, (ctx.count + 1) * sizeof(*polls));
+		if (!polls) {
+			err = -ENOMEM;
+			goto out;
+		}
+		ctx.polls = polls;
+		memset(&polls[ctx.count], 0, sizeof(*polls));
+		err = dl_argv_indexes(dl, &polls[ctx.count].index,
+				      &polls[ctx.count].port_index);
+		if (err)
+			goto out;
+		ctx.count++;
+	}
+	if (!ctx.count || !interval) {
+		pr_err("--interval needs a non-zero period and at least one port\n");
+		err = -EINVAL;
+		goto out;
+	}
+
+	ctx.batch = mnlg_batch_create(dl->nlg);
+	if (!ctx.batch) {
+		err = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < ctx.count; i++) {
+		nlh = mnlg_batch_msg_prepare(ctx.batch, DEVLINK_CMD_PORT_GET,
+					     NLM_F_REQUEST);
+		if (!nlh) {
+			err = -ENOMEM;
+			goto out;
+		}
+		mnl_attr_put_u32(nlh, DEVLINK_ATTR_INDEX, ctx.polls[i].index);
+		mnl_attr_put_u32(nlh, DEVLINK_ATTR_PORT_INDEX,
+				 ctx.polls[i].port_index);
+	}
+
+	g_out.line_buffered = true;
+	next = now_ns();
+	while (1) {
+		if (mnlg_batch_send(ctx.batch)) {
+			pr_err("Failed to send port requests\n");
+			err = -errno;
+			goto out;
+		}
+		if (mnlg_batch_recv_run(ctx.batch, port_poll_cb, &ctx)) {
+			err = _mnlg_socket_recv_err(dl->nlg);
+			goto out;
+		}
+		port_poll_errors(&ctx);
+
+		/* Ticks missed while busy are skipped, not caught up on. */
+		next += interval * 1000000ULL;
+		now = now_ns();
+		if (next < now)
+			next = now;
+		ns_to_timespec(next, &ts);
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+				       NULL) == EINTR)
+			;
+	}
+
+out:
+	if (ctx.batch)
+		mnlg_batch_destroy(ctx.batch);
+	for (i = 0; i < ctx.count; i++)
+		free(ctx.polls[i].last);
+	free(ctx.polls);
+	return err;
+}
+
+static int cmd_port_show(struct dl *dl)
+{
+	struct port_show_ctx ctx = {
+		.dl = dl,
+	};
+	struct nlmsghdr *nlh;
+	uint16_t flags = NLM_F_REQUEST;
+	int err;
+
+	if (dl_argv_has(dl, "--interval"))
+		return cmd_port_show_poll(dl);
+	if (dl_argv_match(dl, "--watch")) {
+		dl_arg_inc(dl);
+		return cmd_show_watch(dl, true);
+	}
+	if (dl_argc(dl) == 1 && dl_argv_dev(dl, &ctx.index))
+		ctx.dev_filter = true;
+	if (dl_argc(dl) == 0)
+		flags |= NLM_F_DUMP;
+	else
+		flags |= NLM_F_ACK;
+
+	nlh = mnlg_msg_prepare(dl->nlg, DEVLINK_CMD_PORT_GET, flags);
+	if (ctx.dev_filter)
+		mnl_attr_put_u32(nlh, DEVLINK_ATTR_INDEX, ctx.index);
+	if (dl_argc(dl) == 1) {
+		uint32_t index;
+		uint32_t port_index;
+
+		err = dl_argv_indexes(dl, &index, &port_index);
+		if (err)
+			return err;
+		mnl_attr_put_u32(nlh, DEVLINK_ATTR_INDEX, index);
+		mnl_attr_put_u32(nlh, DEVLINK_ATTR_PORT_INDEX, port_index);
+	}
+
+	err = _mnlg_socket_send(dl->nlg, nlh);
+	if (err)
+		return err;
+
+	err = _mnlg_socket_recv_run(dl->nlg, cmd_port_show_cb, &ctx);
+	if (err)
+		return err;
+
+	return 0;
+}
+
+/*
+ * --wait for port set, split and unsplit. Notifications are subscribed to
+ * before the request goes out, and the command returns only once they
+ * show the requested end state:
+ *   set: the port has the new type, with a netdev for eth and an ibdev
+ *        for ib.
+ *   split: count ports of the device were created, all with a netdev or
+ *          ibdev.
+ *   unsplit: at least one port of the device was created and has one.
+ */
+
+#define PORT_WAIT_TIMEOUT_MS 10000
+#define PORT_WAIT_PORTS_MAX 64
+
+struct port_wait {
+	bool enabled;
+	uint32_t timeout_ms;
+	struct mnlg_socket *nlg;
+	uint8_t cmd;		/* of the request */
+	uint32_t index;
+	uint32_t port_index;
+	bool has_type;
+	uint16_t type;
+	uint32_t count;		/* created ports needed */
+	uint32_t created[PORT_WAIT_PORTS_MAX];
+	bool ready[PORT_WAIT_PORTS_MAX];
+	unsigned int created_count;
+	bool done;
+	uint64_t start_ns;
+};
+
+/* "--wait [TIMEOUT]", the timeout in milliseconds. */
+static int dl_argv_wait(struct dl *dl, struct port_wait *wait)
+{
+	int val;
+
+	dl_arg_inc(dl);
+	wait->enabled = true;
+	wait->timeout_ms = PORT_WAIT_TIMEOUT_MS;
+	if (!dl_argc(dl))
+		return 0;
+	val = strtouint(dl_argv(dl));
+	if (val < 0)
+		return 0;
+	if (!val) {
+		pr_err("Timeout must not be zero\n");
+		return -EINVAL;
+	}
+	wait->timeout_ms = val;
+	dl_arg_inc(dl);
+	return 0;
+}
+
+static bool port_wait_has_dev(struct nlattr **tb)
+{
+	return tb[DEVLINK_ATTR_PORT_NETDEV_NAME] ||
+	       tb[DEVLINK_ATTR_PORT_IBDEV_NAME];
+}
+
+static bool port_wait_type_done(const struct port_wait *wait,
+				struct nlattr **tb)
+{
+	uint16_t type;
+
+	if (!tb[DEVLINK_ATTR_PORT_TYPE])
+		return false;
+	type = mnl_attr_get_u16(tb[DEVLINK_ATTR_PORT_TYPE]);
+	switch (wait->type) {
+	case DEVLINK_PORT_TYPE_ETH:
+		return type == wait->type &&
+		       tb[DEVLINK_ATTR_PORT_NETDEV_NAME];
+	case DEVLINK_PORT_TYPE_IB:
+		return type == wait->type &&
+		       tb[DEVLINK_ATTR_PORT_IBDEV_NAME];
+	default:
+		return type != DEVLINK_PORT_TYPE_NOTSET;
+	}
+}
+
+/* Tracks ports created since the request, and which of them are up. */
+static void port_wait_created(struct port_wait *wait, uint8_t cmd,
+			      uint32_t port_index, struct nlattr **tb)
+{
+	unsigned int ready = 0;
+	unsigned int i;
+
+	for (i = 0; i < wait->created_count; i++)
+		if (wait->created[i] == port_index)
+			break;
+	if (cmd == DEVLINK_CMD_PORT_DEL) {
+		if (i == wait->created_count)
+			return;
+		wait->created_count--;
+		wait->created[i] = wait->created[wait->created_count];
+		wait->ready[i] = wait->ready[wait->created_count];
+	} else if (i < wait->created_count) {
+		wait->ready[i] = port_wait_has_dev(tb);
+	} else if (cmd == DEVLINK_CMD_PORT_NEW &&
+		   wait->created_count < PORT_WAIT_PORTS_MAX) {
+		wait->created[i] = port_index;
+		wait->ready[i] = port_wait_has_dev(tb);
+		wait->created_count++;
+	}
+
+	for (i = 0; i < wait->created_count; i++)
+		ready += wait->ready[i];
+	wait->done = ready >= wait->count;
+}
+
+static int port_wait_cb(const struct nlmsghdr *nlh, void *data)
+{
+	struct port_wait *wait = data;
+	struct nlattr *tb[DEVLINK_ATTR_MAX + 1] = {};
+	struct genlmsghdr *genl = mnl_nlmsg_get_payload(nlh);
+	uint32_t port_index;
+
+	if (genl->cmd != DEVLINK_CMD_PORT_NEW &&
+	    genl->cmd != DEVLINK_CMD_PORT_SET &&
+	    genl->cmd != DEVLINK_CMD_PORT_DEL)
+		return MNL_CB_OK;
+	mnl_attr_parse(nlh, sizeof(*genl), devlink_attr_cb, tb);
+	if (!tb[DEVLINK_ATTR_INDEX] || !tb[DEVLINK_ATTR_PORT_INDEX])
+		return MNL_CB_ERROR;
+	if (mnl_attr_get_u32(tb[DEVLINK_ATTR_INDEX]) != wait->index)
+		return MNL_CB_OK;
+	port_index = mnl_attr_get_u32(tb[DEVLINK_ATTR_PORT_INDEX]);
+
+	if (wait->cmd != DEVLINK_CMD_PORT_SET)
+		port_wait_created(wait, genl->cmd, port_index, tb);
+	else if (port_index == wait->port_index &&
+		 genl->cmd != DEVLINK_CMD_PORT_DEL)
+		wait->done = port_wait_type_done(wait, tb);
+	return MNL_CB_OK;
+}
+
+/* Called before the request is sent. */
+static int port_wait_start(struct port_wait *wait, uint8_t cmd,
+			   uint32_t index, uint32_t port_index)
+{
+	int fd;
+	int err;
+
+	wait->cmd = cmd;
+	wait->index = index;
+	wait->port_index = port_index;
+	wait->nlg = mnlg_socket_open(DEVLINK_GENL_NAME, DEVLINK_GENL_VERSION);
+	if (!wait->nlg) {
+		pr_err("Failed to connect to devlink Netlink\n");
+		return -errno;
+	}
+	err = _mnlg_socket_group_add(wait->nlg,
+				     DEVLINK_GENL_MCGRP_CONFIG_NAME);
+	if (err) {
+		mnlg_socket_close(wait->nlg);
+		wait->nlg = NULL;
+		return err;
+	}
+	fd = mnlg_socket_get_fd(wait->nlg);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	wait->start_ns = now_ns();
+	return 0;
+}
+
+/* The type may already have been what was asked for, then there is
+ * nothing to be notified about.
+ */
+static int port_wait_query(struct dl *dl, struct port_wait *wait)
+{
+	struct nlmsghdr *nlh;
+	int err;
+
+	nlh = mnlg_msg_prepare(dl->nlg, DEVLINK_CMD_PORT_GET,
+			       NLM_F_REQUEST | NLM_F_ACK);
+	mnl_attr_put_u32(nlh, DEVLINK_ATTR_INDEX, wait->index);
+	mnl_attr_put_u32(nlh, DEVLINK_ATTR_PORT_INDEX, wait->port_index);
+	err = _mnlg_socket_send(dl->nlg, nlh);
+	if (err)
+		return err;
+	return _mnlg_socket_recv_run(dl->nlg, port_wait_cb, wait);
+}
+
+/* Called once the request was acked. */
+static int port_wait_run(struct dl *dl, struct port_wait *wait)
+{
+	struct pollfd pfd = {
+		.fd = mnlg_socket_get_fd(wait->nlg),
+		.events = POLLIN,
+	};
+	uint64_t deadline;
+	uint64_t now;
+	int err = 0;
+
+	if (wait->cmd == DEVLINK_CMD_PORT_SET) {
+		if (!wait->has_type)
+			wait->done = true;
+		else
+			err = port_wait_query(dl, wait);
+	}
+	deadline = wait->start_ns + wait->timeout_ms * 1000000ULL;
+	while (!err && !wait->done) {
+		if (mnlg_socket_recv_run(wait->nlg, port_wait_cb, wait) < 0 &&
+		    errno != EAGAIN) {
+			if (errno == ENOBUFS)
+				pr_err("Notifications were lost\n");
+			err = _mnlg_socket_recv_err(wait->nlg);
+			break;
+		}
+		if (wait->done)
+			break;
+		now = now_ns();
+		if (now >= deadline) {
+			pr_err("Timed out waiting for the port change\n");
+			err = -ETIMEDOUT;
+			break;
+		}
+		if (poll(&pfd, 1, (deadline - now + 999999) / 1000000) < 0 &&
+		    errno != EINTR) {
+			err = -errno;
+			break;
+		}
+	}
+	if (!err) {
+		now = now_ns() - wait->start_ns;
+		pr_out("Completed in %" PRIu64 ".%03" PRIu64 " ms\n",
+		       now / 1000000, now / 1000 % 1000);
+	}
+	mnlg_socket_close(wait->nlg);
+	wait->nlg = NULL;
+	return err;
+}
+
+static void port_wait_cancel(struct port_wait *wait)
+{
+	if (wait->nlg)
+		mnlg_socket_close(wait->nlg);
+	wait->nlg = NULL;
+}
+
+/* Sends a port request which was fully prepared and waits for the ack,
+ * plus the end state with --wait.
+ */
+static int port_request_run(struct dl *dl, struct nlmsghdr *nlh,
+			    struct port_wait *wait, uint32_t index,
+			    uint32_t port_index)
+{
+	struct genlmsghdr *genl = mnl_nlmsg_get_payload(nlh);
+	int err;
+
+	if (wait->enabled) {
+		err = port_wait_start(wait, genl->cmd, index, port_index);
+		if (err)
+			return err;
+	}
+	err = _mnlg_socket_send(dl->nlg, nlh);
+	if (err)
+		goto err_request;
+
+	err = _mnlg_socket_recv_run(dl->nlg, cmd_dev_show_cb, NULL);
+	if (err)
+		goto err_request;
+
+	if (wait->enabled)
+		return port_wait_run(dl, wait);
+	return 0;
+
+err_request:
+	port_wait_cancel(wait);
+	return err;
+}
+
+static const struct dl_opt port_set_opts[] = {
+	{ "type", DL_OPT_PORT_TYPE, DEVLINK_ATTR_PORT_TYPE,
+	  "{ eth | ib | auto }" },
+};
+
+static int cmd_port_set(struct dl *dl)
+{
+	uint32_t vals[ARRAY_SIZE(port_set_opts)];
+	struct port_wait wait = {};
+	struct nlmsghdr *nlh;
+	uint16_t flags = NLM_F_REQUEST | NLM_F_ACK;
+	uint32_t index;
+	uint32_t port_index;
+	int err;
+
+	nlh = mnlg_msg_prepare(dl->nlg, DEVLINK_CMD_PORT_SET, flags);
+	err = dl_argv_indexes(dl, &index, &port_index);
+	if (err)
+		return err;
+	mnl_attr_put_u32(nlh, DEVLINK_ATTR_INDEX, index);
+	mnl_attr_put_u32(nlh, DEVLINK_ATTR_PORT_INDEX, port_index);
+
+	while (dl_argc(dl)) {
+		err = dl_argv_opts(dl, nlh, port_set_opts,
+				   ARRAY_SIZE(port_set_opts), vals);
+		if (err < 0)
+			return err;
+		if (err & 1) {
+			wait.has_type = true;
+			wait.type = vals[0];
+		}
+		if (!dl_argc(dl))
+			break;
+		if (!dl_argv_match(dl, "--wait")) {
+			pr_err("Unknown option \"%s\"\n", dl_argv(dl));
+			return -EINVAL;
+		}
+		err = dl_argv_wait(dl, &wait);
+		if (err)
+			return err;
+	}
+	return port_request_run(dl, nlh, &wait, index, port_index);
+}
+
+static int cmd_port_split(struct dl *dl)
+{
+	struct port_wait wait = {};
+	struct nlmsghdr *nlh;
+	uint16_t flags = NLM_F_REQUEST | NLM_F_ACK;
+	uint32_t index;
+	uint32_t port_index;
+	uint32_t count;
+	int err;
+
+	nlh = mnlg_msg_prepare(dl->nlg, DEVLINK_CMD_PORT_SPLIT, flags);
+	err = dl_argv_indexes(dl, &index, &port_index);
+	if (err)
+		return err;
+	mnl_attr_put_u32(nlh, DEVLINK_ATTR_INDEX, index);
+	mnl_attr_put_u32(nlh, DEVLINK_ATTR_PORT_INDEX, port_index);
+
+	err = dl_argv_uint32_t(dl, &count);
+	if (err)
+		return err;
+	mnl_attr_put_u32(nlh, DEVLINK_ATTR_PORT_SPLIT_COUNT, count);
+
+	if (dl_argv_match(dl, "--wait")) {
+		err = dl_argv_wait(dl, &wait);
+		if (err)
+			return err;
+		wait.count = count;
+	}
+	return port_request_run(dl, nlh, &wait, index, port_index);
+}
+
+static int cmd_port_unsplit(struct dl *dl)
+{
+	struct port_wait wait = {};
+	struct nlmsghdr *nlh;
+	uint16_t flags = NLM_F_REQUEST | NLM_F_ACK;
+	uint32_t index;
+	uint32_t port_index;
+	int err;
+
+	nlh = mnlg_msg_prepare(dl->nlg, DEVLINK_CMD_PORT_UNSPLIT, flags);
+	err = dl_argv_indexes(dl, &index, &port_index);
+	if (err)
+		return err;
+	mnl_attr_put_u32(nlh, DEVLINK_ATTR_INDEX, index);
+	mnl_attr_put_u32(nlh, DEVLINK_ATTR_PORT_INDEX, port_index);
+
+	if (dl_argv_match(dl, "--wait")) {
+		err = dl_argv_wait(dl, &wait);
+		if (err)
+			return err;
+		wait.count = 1;
+	}
+	return port_request_run(dl, nlh, &wait, index, port_index);
+}
+
+static const char *cached_str(const char *str)
+{
+	return str[0] ? str : NULL;
+}
+
+static void pr_out_cached_dev(const struct dlcache_dev *dev)
+{
+	pr_out_dev_fields(dev->index, dev->name, cached_str(dev->bus_name),
+			  cached_str(dev->dev_name));
+}
+
+static int cmd_dev_show_cached(struct dl *dl)
+{
+	struct dlcache_dev devs[DLCACHE_DEV_MAX];
+	bool filter = false;
+	uint32_t index;
+	int count;
+	int err;
+	int i;
+
+	if (dl_argc(dl) == 1) {
+		err = dl_argv_index(dl, &index);
+		if (err)
+			return err;
+		filter = true;
+	}
+
+	count = dlcache_devs_get(dl->cache, devs, ARRAY_SIZE(devs));
+	if (count < 0)
+		return -errno;
+	for (i = 0; i < count; i++) {
+		if (filter && devs[i].index != index)
+			continue;
+		pr_out_cached_dev(&devs[i]);
+	}
+	return 0;
+}
+
+static void pr_out_cached_port(struct dl *dl, const struct dlcache_port *port)
+{
+	struct port_fields fields = {
+		.dev_name = index_map_get_name(dl, port->index),
+		.port_index = port->port_index,
+		.has_type = port->flags & DLCACHE_PORT_F_TYPE,
+		.has_desired_type = port->flags & DLCACHE_PORT_F_DESIRED_TYPE,
+		.type = port->type,
+		.desired_type = port->desired_type,
+		.netdev_name = cached_str(port->netdev_name),
+		.ibdev_name = cached_str(port->ibdev_name),
+	};
+
+	pr_out_port_fields(&fields);
+}
+
+static int cmd_port_show_cached(struct dl *dl)
+{
+	struct dlcache_port *ports;
+	struct dlcache_port port;
+	bool dev_filter = false;
+	uint32_t dev_index;
+	int count;
+	int err;
+	int i;
+
+	if (dl_argc(dl) == 1 && dl_argv_dev(dl, &dev_index))
+		dev_filter = true;
+	if (dl_argc(dl) == 1) {
+		uint32_t index;
+		uint32_t port_index;
+
+		err = dl_argv_indexes(dl, &index, &port_index);
+		if (err)
+			return err;
+		if (dlcache_port_get(dl->cache, index, port_index, &port))
+			return -errno;
+		pr_out_cached_port(dl, &port);
+		return 0;
+	}
+
+	ports = malloc(DLCACHE_PORT_MAX * sizeof(*ports));
+	if (!ports)
+		return -ENOMEM;
+	count = dlcache_ports_get(dl->cache, ports, DLCACHE_PORT_MAX);
+	if (count < 0) {
+		free(ports);
+		return -errno;
+	}
+	for (i = 0; i < count; i++)
+		if (!dev_filter || ports[i].index == dev_index)
+			pr_out_cached_port(dl, &ports[i]);
+	free(ports);
+	return 0;
+}
+
+static const struct dl_cmd port_cmds[] = {
+	DL_CMD("help", NULL, 0, NULL),
+	DL_CMD("show", cmd_port_show, DL_CMD_DEFAULT,
+	       "[ DEV | PORT ]\n"
+	       "PORT [ PORT ... ] --interval MS\n"
+	       "--watch"),
+	DL_CMD_OPTS("set", cmd_port_set, "PORT [ --wait [ TIMEOUT_MS ] ]",
+		    port_set_opts),
+	DL_CMD("split", cmd_port_split, 0,
+	       "PORT count [ --wait [ TIMEOUT_MS ] ]"),
+	DL_CMD("unsplit", cmd_port_unsplit, 0,
+	       "PORT [ --wait [ TIMEOUT_MS ] ]"),
+};
+
+static const struct dl_cmd_table port_table = {
+	.prefix = "dl port",
+	.what = "Command",
+	.cmds = port_cmds,
+	.count = ARRAY_SIZE(port_cmds),
+	.footer = "where  PORT := { DEV/PORT_INDEX | NETDEV | IFINDEX | IBDEV }\n",
+};
+
+/* "dl show" runs the device and the port dump at the same time, each on
+ * its own socket, and hangs every port off its device by index as the
+ * replies come in. Ports may well arrive before their device does.
+ */
+
+#define SHOW_HASH_SIZE 64
+
+struct show_port {
+	struct show_port *next;
+	struct nlmsghdr nlh[];	/* copy of the PORT_GET reply */
+};
+
+struct show_dev {
+	struct show_dev *hash_next;
+	struct list_item list;	/* in dump order, once the reply is in */
+	uint32_t index;
+	struct nlmsghdr *nlh;	/* copy of the GET reply, NULL until then */
+	struct show_port *ports;
+	struct show_port **ports_tail;
+};
+
+struct show_ctx {
+	struct show_dev *hash[SHOW_HASH_SIZE];
+	struct list_item dev_list;
+};
+
+static struct show_dev *show_dev_get(struct show_ctx *ctx, uint32_t index)
+{
+	struct show_dev **bucket = &ctx->hash[index % SHOW_HASH_SIZE];
+	struct show_dev *dev;
+
+	for (dev = *bucket; dev; dev = dev->hash_next)
+		if (dev->index == index)
+			return dev;
+	dev = myzalloc(sizeof(*dev));
+	if (!dev)
+		return NULL;
+	dev->index = index;
+	dev->ports_tail = &dev->ports;
+	dev->hash_next = *bucket;
+	*bucket = dev;
+	return dev;
+}
+
+static void show_fini(struct show_ctx *ctx)
+{
+	struct show_port *port, *port_next;
+	struct show_dev *dev, *dev_next;
+	int i;
+
+	for (i = 0; i < SHOW_HASH_SIZE; i++) {
+		for (dev = ctx->hash[i]; dev; dev = dev_next) {
+			dev_next = dev->hash_next;
+			for (port = dev->ports; port; port = port_next) {
+				port_next = port->next;
+				free(port);
+			}
+			free(dev->nlh);
+			free(dev);
+		}
+	}
+}
+
+static int show_dev_cb(const struct nlmsghdr *nlh, void *data)
+{
+	struct nlattr *tb[DEVLINK_ATTR_MAX + 1] = {};
+	struct genlmsghdr *genl = mnl_nlmsg_get_payload(nlh);
+	struct show_ctx *ctx = data;
+	struct show_dev *dev;
+
+	mnl_attr_parse(nlh, sizeof(*genl), devlink_attr_cb, tb);
+	if (!tb[DEVLINK_ATTR_INDEX] || !tb[DEVLINK_ATTR_NAME])
+		return MNL_CB_ERROR;
+	dev = show_dev_get(ctx, mnl_attr_get_u32(tb[DEVLINK_ATTR_INDEX]));
+	if (!dev)
+		return MNL_CB_ERROR;
+	if (dev->nlh)
+		return MNL_CB_OK;
+	dev->nlh = malloc(nlh->nlmsg_len);
+	if (!dev->nlh)
+		return MNL_CB_ERROR;
+	memcpy(dev->nlh, nlh, nlh->nlmsg_len);
+	list_add_tail(&ctx->dev_list, &dev->list);
+	return MNL_CB_OK;
+}
+
+static int show_port_cb(const struct nlmsghdr *nlh, void *data)
+{
+	struct nlattr *tb[DEVLINK_ATTR_MAX + 1] = {};
+	struct genlmsghdr *genl = mnl_nlmsg_get_payload(nlh);
+	struct show_ctx *ctx = data;
+	struct show_port *port;
+	struct show_dev *dev;
+
+	mnl_attr_parse(nlh, sizeof(*genl), devlink_attr_cb, tb);
+	if (!tb[DEVLINK_ATTR_INDEX] || !tb[DEVLINK_ATTR_PORT_INDEX])
+		return MNL_CB_ERROR;
+	dev = show_dev_get(ctx, mnl_attr_get_u32(tb[DEVLINK_ATTR_INDEX]));
+	if (!dev)
+		return MNL_CB_ERROR;
+	port = malloc(sizeof(*port) + nlh->nlmsg_len);
+	if (!port)
+		return MNL_CB_ERROR;
+	memcpy(port->nlh, nlh, nlh->nlmsg_len);
+	port->next = NULL;
+	*dev->ports_tail = port;
+	dev->ports_tail = &port->next;
+	return MNL_CB_OK;
+}
+
+/* Ports of a device that went away between the two dumps are left out. */
+static void pr_out_show(struct show_ctx *ctx)
+{
+	struct nlattr *tb[DEVLINK_ATTR_MAX + 1];
+	struct port_fields fields;
+	struct show_port *port;
+	struct show_dev *dev;
+	const char *name;
+
+	list_for_each_node_entry(dev, &ctx->dev_list, list) {
+		memset(tb, 0, sizeof(tb));
+		mnl_attr_parse(dev->nlh, sizeof(struct genlmsghdr),
+			       devlink_attr_cb, tb);
+		pr_out_dev(tb);
+		name = mnl_attr_get_str(tb[DEVLINK_ATTR_NAME]);
+		for (port = dev->ports; port; port = port->next) {
+			memset(tb, 0, sizeof(tb));
+			mnl_attr_parse(port->nlh, sizeof(struct genlmsghdr),
+				       devlink_attr_cb, tb);
+			port_fields_parse(&fields, tb);
+			fields.dev_name = name;
+			out_mem("  ", 2);
+			pr_out_port_fields(&fields);
+		}
+	}
+}
+
+/* Returns 0 and leaves *done alone while the dump is still running. */
+static int show_recv(struct mnlg_socket *nlg, mnl_cb_t data_cb,
+		     struct show_ctx *ctx, bool *done)
+{
+	int err;
+
+	err = mnlg_socket_recv_run(nlg, data_cb, ctx);
+	if (err < 0 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	if (err < 0)
+		return _mnlg_socket_recv_err(nlg);
+	*done = true;
+	return 0;
+}
+
+static int cmd_show(struct dl *dl)
+{
+	struct show_ctx ctx = {};
+	struct mnlg_socket *port_nlg;
+	struct pollfd pfds[2];
+	struct nlmsghdr *nlh;
+	bool dev_done = false;
+	bool port_done = false;
+	int dev_flags = -1;
+	int fd;
+	int err;
+
+	if (dl_argc(dl)) {
+		pr_err("Command \"%s\" not found\n", dl_argv(dl));
+		return -ENOENT;
+	}
+
+	list_init(&ctx.dev_list);
+	port_nlg = mnlg_socket_open(DEVLINK_GENL_NAME, DEVLINK_GENL_VERSION);
+	if (!port_nlg) {
+		pr_err("Failed to connect to devlink Netlink\n");
+		return -errno;
+	}
+
+	nlh = mnlg_msg_prepare(port_nlg, DEVLINK_CMD_PORT_GET,
+			       NLM_F_REQUEST | NLM_F_DUMP);
+	err = _mnlg_socket_send(port_nlg, nlh);
+	if (err)
+		goto out;
+	nlh = mnlg_msg_prepare(dl->nlg, DEVLINK_CMD_GET,
+			       NLM_F_REQUEST | NLM_F_DUMP);
+	err = _mnlg_socket_send(dl->nlg, nlh);
+	if (err)
+		goto out;
+
+	fd = mnlg_socket_get_fd(port_nlg);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	pfds[1].fd = fd;
+	pfds[1].events = POLLIN;
+
+	/* An io_uring socket may not be polled. The device dump then
+	 * completes first, the ports queue up on the other socket meanwhile.
+	 */
+	if (dl->uring) {
+		err = _mnlg_socket_recv_run(dl->nlg, show_dev_cb, &ctx);
+		if (err)
+			goto out;
+		dev_done = true;
+	} else {
+		fd = mnlg_socket_get_fd(dl->nlg);
+		dev_flags = fcntl(fd, F_GETFL);
+		fcntl(fd, F_SETFL, dev_flags | O_NONBLOCK);
+	}
+	pfds[0].fd = fd;
+	pfds[0].events = POLLIN;
+
+	while (!dev_done || !port_done) {
+		/* poll() skips negative fds. */
+		if (dev_done)
+			pfds[0].fd = -1;
+		if (port_done)
+			pfds[1].fd = -1;
+		if (poll(pfds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			err = -errno;
+			goto out;
+		}
+		if (!dev_done && pfds[0].revents) {
+			err = show_recv(dl->nlg, show_dev_cb, &ctx, &dev_done);
+			if (err)
+				goto out;
+		}
+		if (!port_done && pfds[1].revents) {
+			err = show_recv(port_nlg, show_port_cb, &ctx,
+					&port_done);
+			if (err)
+				goto out;
+		}
+	}
+	pr_out_show(&ctx);
+
+out:
+	/* The server runs further commands on the same socket. */
+	if (dev_flags != -1)
+		fcntl(mnlg_socket_get_fd(dl->nlg), F_SETFL, dev_flags);
+	show_fini(&ctx);
+	mnlg_socket_close(port_nlg);
+	return err;
+}
+
+static const char *cmd_name(uint8_t cmd)
+{
+	switch (cmd) {
+	case DEVLINK_CMD_UNSPEC: return "unspec";
+	case DEVLINK_CMD_GET: return "dev get";
+	case DEVLINK_CMD_SET: return "dev set";
+	case DEVLINK_CMD_NEW: return "dev new";
+	case DEVLINK_CMD_DEL: return "dev del";
+	case DEVLINK_CMD_HWMSG_NEW: return "hwmsg";
+	case DEVLINK_CMD_PORT_GET: return "port get";
+	case DEVLINK_CMD_PORT_SET: return "port set";
+	case DEVLINK_CMD_PORT_NEW: return "port net";
+	case DEVLINK_CMD_PORT_DEL: return "port del";
+	default: return "<unknown cmd>";
+	}
+}
+
+static void pr_out_mon_header(struct dl *dl, uint8_t cmd)
+{
+	if (dl->ts)
+		out_printf("[%lld.%09ld] ", (long long) dl->ts->tv_sec,
+			   dl->ts->tv_nsec);
+	out_char('[');
+	out_str(cmd_name(cmd));
+	out_mem("] ", 2);
+}
+
+static const char *hwmsg_type_name(uint32_t type)
+{
+	switch (type) {
+	case DEVLINK_HWMSG_TYPE_MLX_EMAD: return "mlx_emad";
+	case DEVLINK_HWMSG_TYPE_MLX_CMD_REG: return "mlx_cmd_reg";
+	default: return "<unknown type>";
+	}
+}
+
+/* Per-type statistics keep the known types and one bucket for the rest. */
+#define HWMSG_TYPE_STATS (DEVLINK_HWMSG_TYPE_MLX_CMD_REG + 2)
+
+static uint32_t hwmsg_type_stat(uint32_t type)
+{
+	return type < HWMSG_TYPE_STATS - 1 ? type : HWMSG_TYPE_STATS - 1;
+}
+
+static const char *hwmsg_type_stat_name(uint32_t stat)
+{
+	return stat == HWMSG_TYPE_STATS - 1 ? "other" : hwmsg_type_name(stat);
+}
+
+static const char *hwmsg_dir_name(uint8_t dir)
+{
+	switch (dir) {
+	case DEVLINK_HWMSG_DIR_TO_HW: return "to_hw";
+	case DEVLINK_HWMSG_DIR_FROM_HW: return "from_hw";
+	default: return "<unknown dir>";
+	}
+}
+
+static void pr_out_hwmsg(struct dl *dl, struct nlattr **tb)
+{
+	uint32_t index = mnl_attr_get_u32(tb[DEVLINK_ATTR_INDEX]);
+	uint32_t type = mnl_attr_get_u32(tb[DEVLINK_ATTR_HWMSG_TYPE]);
+	uint8_t dir = mnl_attr_get_u8(tb[DEVLINK_ATTR_HWMSG_DIR]);
+	uint16_t payload_len = mnl_attr_get_payload_len(tb[DEVLINK_ATTR_HWMSG_PAYLOAD]);
+	unsigned char *payload = mnl_attr_get_payload(tb[DEVLINK_ATTR_HWMSG_PAYLOAD]);
+	uint16_t show_len = payload_len;
+	int i;
+
+	if (dl->snaplen && dl->snaplen < show_len)
+		show_len = dl->snaplen;
+	out_u32(index);
+	out_mem(": ", 2);
+	out_str(hwmsg_type_name(type));
+	out_char(' ');
+	out_str(hwmsg_dir_name(dir));
+	out_char(' ');
+	out_u32(payload_len);
+	out_mem(" bytes\n", 7);
+	if (g_verbosity < VERB2) {
+		out_record_end();
+		return;
+	}
+	for (i = 0; i < show_len; i++) {
+		if (i) {
+			if (i % 8 == 0)
+				out_char('\n');
+			else
+				out_char(' ');
+		}
+		if (i % 8 == 0) {
+			out_mem("  0x", 4);
+			out_hex(i, 4);
+			out_mem(":  ", 3);
+		}
+		out_hex(payload[i], 2);
+	}
+	if (i != 0)
+		out_char('\n');
+	if (show_len < payload_len) {
+		dl->snap_msgs++;
+		dl->snap_bytes += payload_len - show_len;
+		out_mem("  ... ", 6);
+		out_u32(payload_len - show_len);
+		out_mem(" bytes not shown\n", 17);
+	}
+	out_record_end();
+}
+
+/* Well formed hwmsg of any type. */
+static bool check_cmd_hwmsg_fields(struct nlattr **tb)
+{
+	uint8_t dir;
+
+	if (!tb[DEVLINK_ATTR_INDEX] ||
+	    !tb[DEVLINK_ATTR_HWMSG_PAYLOAD] ||
+	    !tb[DEVLINK_ATTR_HWMSG_TYPE] ||
+	    !tb[DEVLINK_ATTR_HWMSG_DIR])
+		return false;
+	dir = mnl_attr_get_u8(tb[DEVLINK_ATTR_HWMSG_DIR]);
+	if (dir != DEVLINK_HWMSG_DIR_TO_HW && dir != DEVLINK_HWMSG_DIR_FROM_HW)
+		return false;
+	return true;
+}
+
+/* Well formed EMAD, the only type whose payload is looked into. */
+static bool check_cmd_hwmsg(struct nlattr **tb)
+{
+	return check_cmd_hwmsg_fields(tb) &&
+	       mnl_attr_get_u32(tb[DEVLINK_ATTR_HWMSG_TYPE]) ==
+	       DEVLINK_HWMSG_TYPE_MLX_EMAD;
+}
+
+enum mon_obj {
+	MON_OBJ_NONE,
+	MON_OBJ_DEV,
+	MON_OBJ_PORT,
+	MON_OBJ_HWMSG,
+};
+
+/* Fills in tb and tells what the message is about, -EINVAL if it lacks
+ * the attributes needed to print it.
+ */
+static int mon_msg_parse(const struct nlmsghdr *nlh, struct nlattr **tb)
+{
+	struct genlmsghdr *genl = mnl_nlmsg_get_payload(nlh);
+
+	switch (genl->cmd) {
+	case DEVLINK_CMD_GET: /* fall through */
+	case DEVLINK_CMD_SET: /* fall through */
+	case DEVLINK_CMD_NEW: /* fall through */
+	case DEVLINK_CMD_DEL:
+		mnl_attr_parse(nlh, sizeof(*genl), devlink_attr_cb, tb);
+		if (!tb[DEVLINK_ATTR_INDEX] || !tb[DEVLINK_ATTR_NAME])
+			return -EINVAL;
+		return MON_OBJ_DEV;
+	case DEVLINK_CMD_HWMSG_NEW:
+		mnl_attr_parse(nlh, sizeof(*genl), devlink_attr_cb, tb);
+		if (!check_cmd_hwmsg(tb))
+			return -EINVAL;
+		return MON_OBJ_HWMSG;
+	case DEVLINK_CMD_PORT_GET: /* fall through */
+	case DEVLINK_CMD_PORT_SET: /* fall through */
+	case DEVLINK_CMD_PORT_NEW: /* fall through */
+	case DEVLINK_CMD_PORT_DEL:
+		mnl_attr_parse(nlh, sizeof(*genl), devlink_attr_cb, tb);
+		if (!tb[DEVLINK_ATTR_INDEX] || !tb[DEVLINK_ATTR_PORT_INDEX])
+			return -EINVAL;
+		return MON_OBJ_PORT;
+	}
+	return MON_OBJ_NONE;
+}
+
+static int cmd_mon_show_cb(const struct nlmsghdr *nlh, void *data)
+{
+	struct dl *dl = data;
+	struct nlattr *tb[DEVLINK_ATTR_MAX + 1] = {};
+	struct genlmsghdr *genl = mnl_nlmsg_get_payload(nlh);
+
+	switch (mon_msg_parse(nlh, tb)) {
+	case MON_OBJ_DEV:
+		pr_out_mon_header(dl, genl->cmd);
+		pr_out_dev(tb);
+		break;
+	case MON_OBJ_HWMSG:
+		pr_out_mon_header(dl, genl->cmd);
+		pr_out_hwmsg(dl, tb);
+		break;
+	case MON_OBJ_PORT:
+		pr_out_mon_header(dl, genl->cmd);
+		pr_out_port(dl, tb);
+		break;
+	case MON_OBJ_NONE:
+		break;
+	default:
+		return MNL_CB_ERROR;
+	}
+	return MNL_CB_OK;
+}
+
+/* "dl dev show --watch" and "dl port show --watch" keep the last message
+ * of every row and print a row again only when a notification changes
+ * it. Device rows use WATCH_DEV as port index.
+ */
+
+#define WATCH_HASH_SIZE 256
+#define WATCH_DEV UINT32_MAX
+
+struct watch_row {
+	struct watch_row *next;
+	uint32_t index;
+	uint32_t port_index;
+	unsigned int gen;	/* of the dump which last saw the row */
+	struct nlmsghdr *nlh;
+};
+
+struct watch_ctx {
+	struct dl *dl;
+	bool ports;
+	unsigned int gen;
+	struct watch_row *hash[WATCH_HASH_SIZE];
+};
+
+static struct watch_row **watch_row_slot(struct watch_ctx *ctx,
+					 uint32_t index, uint32_t port_index)
+{
+	struct watch_row **slot;
+
+	slot = &ctx->hash[(index * 31 + port_index) % WATCH_HASH_SIZE];
+	while (*slot && ((*slot)->index != index ||
+			 (*slot)->port_index != port_index))
+		slot = &(*slot)->next;
+	return slot;
+}
+
+static void pr_out_watch_row(struct watch_ctx *ctx, struct watch_row *row,
+			     bool deleted)
+{
+	struct nlattr *tb[DEVLINK_ATTR_MAX + 1] = {};
+
+	mnl_attr_parse(row->nlh, sizeof(struct genlmsghdr),
+		       devlink_attr_cb, tb);
+	if (deleted)
+		out_mem("deleted ", 8);
+	if (row->port_index == WATCH_DEV)
+		pr_out_dev(tb);
+	else
+		pr_out_port(ctx->dl, tb);
+}
+
+static void watch_row_del(struct watch_ctx *ctx, struct watch_row **slot)
+{
+	struct watch_row *row = *slot;
+
+	pr_out_watch_row(ctx, row, true);
+	*slot = row->next;
+	free(row->nlh);
+	free(row);
+}
+
+/* Rows of devices which are gone, or left behind by a previous dump. */
+static void watch_sweep(struct watch_ctx *ctx, uint32_t index, bool stale)
+{
+	struct watch_row **slot;
+	int i;
+
+	for (i = 0; i < WATCH_HASH_SIZE; i++) {
+		slot = &ctx->hash[i];
+		while (*slot) {
+			if (stale ? (*slot)->gen != ctx->gen :
+				    (*slot)->index == index)
+				watch_row_del(ctx, slot);
+			else
+				slot = &(*slot)->next;
+		}
+	}
+}
+
+static int watch_row_update(struct watch_ctx *ctx, const struct nlmsghdr *nlh,
+			    uint32_t index, uint32_t port_index, bool del)
+{
+	struct watch_row **slot = watch_row_slot(ctx, index, port_index);
+	struct watch_row *row = *slot;
+	size_t len = nlh->nlmsg_len - NLMSG_HDRLEN - GENL_HDRLEN;
+
+	if (del) {
+		if (row)
+			watch_row_del(ctx, slot);
+		return 0;
+	}
+	if (row) {
+		row->gen = ctx->gen;
+		/* SET, NEW and dump replies differ only in the command. */
+		if (row->nlh->nlmsg_len == nlh->nlmsg_len &&
+		    !memcmp(mnl_nlmsg_get_payload_offset(row->nlh,
+							 GENL_HDRLEN),
+			    mnl_nlmsg_get_payload_offset(nlh, GENL_HDRLEN),
+			    len))
+			return 0;
+		free(row->nlh);
+	} else {
+		row = myzalloc(sizeof(*row));
+		if (!row)
+			return -ENOMEM;
+		row->index = index;
+		row->port_index = port_index;
+		row->gen = ctx->gen;
+		*slot = row;
+	}
+	row->nlh = malloc(nlh->nlmsg_len);
+	if (!row->nlh) {
+		*slot = row->next;
+		free(row);
+		return -ENOMEM;
+	}
+	memcpy(row->nlh, nlh, nlh->nlmsg_len);
+	pr_out_watch_row(ctx, row, false);
+	return 0;
+}
+
+static int watch_cb(const struct nlmsghdr *nlh, void *data)
+{
+	struct watch_ctx *ctx = data;
+	struct nlattr *tb[DEVLINK_ATTR_MAX + 1] = {};
+	struct genlmsghdr *genl = mnl_nlmsg_get_payload(nlh);
+	uint32_t index;
+	int err = 0;
+
+	switch (mon_msg_parse(nlh, tb)) {
+	case MON_OBJ_DEV:
+		index = mnl_attr_get_u32(tb[DEVLINK_ATTR_INDEX]);
+		if (!ctx->ports) {
+			err = watch_row_update(ctx, nlh, index, WATCH_DEV,
+					       genl->cmd == DEVLINK_CMD_DEL);
+			break;
+		}
+		/* Port rows are printed with the device name. */
+		if (genl->cmd == DEVLINK_CMD_DEL)
+			watch_sweep(ctx, index, false);
+		err = index_map_update(ctx->dl, genl->cmd, index,
+				mnl_attr_get_str(tb[DEVLINK_ATTR_NAME]));
+		break;
+	case MON_OBJ_PORT:
+		if (!ctx->ports)
+			break;
+		err = watch_row_update(ctx, nlh,
+				mnl_attr_get_u32(tb[DEVLINK_ATTR_INDEX]),
+				mnl_attr_get_u32(tb[DEVLINK_ATTR_PORT_INDEX]),
+				genl->cmd == DEVLINK_CMD_PORT_DEL);
+		break;
+	case MON_OBJ_HWMSG: /* fall through */
+	case MON_OBJ_NONE:
+		break;
+	default:
+		return MNL_CB_ERROR;
+	}
+	return err ? MNL_CB_ERROR : MNL_CB_OK;
+}
+
+/* Prints rows which are new or changed and drops those which are gone. */
+static int watch_dump(struct watch_ctx *ctx)
+{
+	struct dl *dl = ctx->dl;
+	struct nlmsghdr *nlh;
+	int err;
+
+	ctx->gen++;
+	nlh = mnlg_msg_prepare(dl->nlg, ctx->ports ? DEVLINK_CMD_PORT_GET :
+						     DEVLINK_CMD_GET,
+			       NLM_F_REQUEST | NLM_F_DUMP);
+	err = _mnlg_socket_send(dl->nlg, nlh);
+	if (err)
+		return err;
+	err = _mnlg_socket_recv_run(dl->nlg, watch_cb, ctx);
+	if (err)
+		return err;
+	watch_sweep(ctx, 0, true);
+	return 0;
+}
+
+static void watch_fini(struct watch_ctx *ctx)
+{
+	struct watch_row *row, *next;
+	int i;
+
+	for (i = 0; i < WATCH_HASH_SIZE; i++) {
+		for (row = ctx->hash[i]; row; row = next) {
+			next = row->next;
+			free(row->nlh);
+			free(row);
+		}
+	}
+}
+
+static int cmd_show_watch(struct dl *dl, bool ports)
+{
+	struct watch_ctx ctx = {
+		.dl = dl,
+		.ports = ports,
+	};
+	struct mnlg_socket *notify_nlg;
+	int err;
+
+	if (dl_server_refuse(dl) || dl_all_netns_cmd_refuse(dl))
+		return -EOPNOTSUPP;
+	if (dl_argc(dl)) {
+		pr_err("--watch takes no other arguments\n");
+		return -EINVAL;
+	}
+
+	/* Joined before the dump, so that no change in between is lost. */
+	notify_nlg = mnlg_socket_open(DEVLINK_GENL_NAME, DEVLINK_GENL_VERSION);
+	if (!notify_nlg) {
+		pr_err("Failed to connect to devlink Netlink\n");
+		return -errno;
+	}
+	err = _mnlg_socket_group_add(notify_nlg,
+				     DEVLINK_GENL_MCGRP_CONFIG_NAME);
+	if (err)
+		goto out;
+
+	g_out.line_buffered = true;
+	err = watch_dump(&ctx);
+	while (!err) {
+		if (mnlg_socket_recv_run(notify_nlg, watch_cb, &ctx) >= 0)
+			continue;
+		if (errno != ENOBUFS) {
+			err = _mnlg_socket_recv_err(notify_nlg);
+			break;
+		}
+		pr_err("Notifications were lost, reloading\n");
+		if (ports) {
+			index_map_fini(dl);
+			err = index_map_init(dl);
+			if (err)
+				break;
+		}
+		err = watch_dump(&ctx);
+	}
+
+out:
+	watch_fini(&ctx);
+	mnlg_socket_close(notify_nlg);
+	return err;
+}
+
+static volatile sig_atomic_t g_stop;
+static volatile sig_atomic_t g_usr1;
+
+static void stop_sig_handler(int sig)
+{
+	g_stop = 1;
+}
+
+static void usr1_sig_handler(int sig)
+{
+	g_usr1 = 1;
+}
+
+/*
+ * Kernel to userspace delivery lag, bucket i counts lags in
+ * [2^(i - 1), 2^i) microseconds, bucket 0 those under a microsecond and
+ * the last one everything above.
+ */
+#define LAG_HIST_BUCKETS 32
+
+struct lag_hist {
+	uint64_t buckets[LAG_HIST_BUCKETS];
+	uint64_t count;
+	uint64_t sum_ns;
+	uint64_t sum_sq_us;
+	uint64_t min_ns;
+	uint64_t max_ns;
+	uint64_t events;
+	uint32_t rmem_max;	/* peak receive queue occupancy */
+	uint32_t rcvbuf;
+};
+
+static void lag_hist_add_ns(struct lag_hist *hist, uint64_t lag_ns)
+{
+	uint64_t lag_us = lag_ns / 1000;
+	int i = 0;
+
+	if (lag_us)
+		i = 64 - __builtin_clzll(lag_us);
+	if (i >= LAG_HIST_BUCKETS)
+		i = LAG_HIST_BUCKETS - 1;
+	hist->buckets[i]++;
+	if (!hist->count || lag_ns < hist->min_ns)
+		hist->min_ns = lag_ns;
+	hist->count++;
+	hist->sum_ns += lag_ns;
+	hist->sum_sq_us += lag_us * lag_us;
+	if (lag_ns > hist->max_ns)
+		hist->max_ns = lag_ns;
+}
+
+static void lag_hist_add(struct lag_hist *hist, const struct timespec *ts)
+{
+	struct timespec now;
+	uint64_t lag_ns = 0;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	/* The clock can be stepped back in between, count that as no lag. */
+	if (now.tv_sec > ts->tv_sec ||
+	    (now.tv_sec == ts->tv_sec && now.tv_nsec > ts->tv_nsec))
+		lag_ns = (now.tv_sec - ts->tv_sec) * 1000000000ULL +
+			 now.tv_nsec - ts->tv_nsec;
+	lag_hist_add_ns(hist, lag_ns);
+}
+
+static uint64_t isqrt(uint64_t val)
+{
+	uint64_t x = val;
+	uint64_t y = (x + 1) / 2;
+
+	while (y < x) {
+		x = y;
+		y = (x + val / x) / 2;
+	}
+	return x;
+}
+
+static void lag_hist_print_samples(const struct lag_hist *hist,
+				   const char *what)
+{
+	uint64_t avg_us;
+	uint64_t var;
+	int i;
+
+	avg_us = hist->sum_ns / hist->count / 1000;
+	var = hist->sum_sq_us / hist->count;
+	var = var > avg_us * avg_us ? var - avg_us * avg_us : 0;
+	pr_err("%s: %" PRIu64 " samples", what, hist->count);
+	pr_err(", avg %" PRIu64 " us, min %" PRIu64 " us, max %" PRIu64
+	       " us, jitter (stddev) %" PRIu64 " us\n", avg_us,
+	       hist->min_ns / 1000, hist->max_ns / 1000, isqrt(var));
+	for (i = 0; i < LAG_HIST_BUCKETS; i++) {
+		if (!hist->buckets[i])
+			continue;
+		if (i == 0)
+			pr_err("  %10s < %10u us: %" PRIu64 "\n", "", 1,
+			       hist->buckets[i]);
+		else if (i == LAG_HIST_BUCKETS - 1)
+			pr_err("  %10u <= %8s us: %" PRIu64 "\n", 1U << (i - 1),
+			       "", hist->buckets[i]);
+		else
+			pr_err("  %10u - %10u us: %" PRIu64 "\n",
+			       1U << (i - 1), 1U << i, hist->buckets[i]);
+	}
+}
+
+static void lag_hist_print(const struct lag_hist *hist)
+{
+	if (hist->rcvbuf)
+		pr_err("Receive queue: peak %u of %u bytes\n",
+		       hist->rmem_max, hist->rcvbuf);
+	if (!hist->count) {
+		pr_err("Delivery lag: no kernel timestamps in %" PRIu64
+		       " events\n", hist->events);
+		return;
+	}
+	lag_hist_print_samples(hist, "Delivery lag");
+}
+
+/* Stops at the first record whose length runs past the end of the block. */
+#define dllog_for_each_rec(rec, data, used)				\
+	for (rec = (const struct dllog_rec *) (data);			\
+	     (const char *) (rec + 1) <= (data) + (used) &&		\
+	     rec->len <= (data) + (used) - (const char *) (rec + 1) &&	\
+	     (const char *) rec + dllog_rec_size(rec->len) <=		\
+	     (data) + (used);						\
+	     rec = (const struct dllog_rec *) ((const char *) rec +	\
+					       dllog_rec_size(rec->len)))
+
+/*
+ * EMAD frames start with a 16 byte Ethernet and Mellanox header followed
+ * by the operation TLV, whose third byte holds the status and whose
+ * fifth and sixth the register id.
+ */
+#define EMAD_OP_TLV_OFFSET 16
+#define EMAD_OP_TLV_LEN 16
+#define EMAD_HDR_LEN (EMAD_OP_TLV_OFFSET + EMAD_OP_TLV_LEN)
+
+static uint8_t emad_status(const unsigned char *payload, uint16_t len)
+{
+	if (len < EMAD_HDR_LEN)
+		return 0;
+	return payload[EMAD_OP_TLV_OFFSET + 2] & 0x7f;
+}
+
+static uint16_t emad_reg_id(const unsigned char *payload)
+{
+	return payload[EMAD_OP_TLV_OFFSET + 4] << 8 |
+	       payload[EMAD_OP_TLV_OFFSET + 5];
+}
+
+/*
+ * Delta coding of the EMAD payloads in a block of records. Whatever
+ * follows the operation TLV is XORed with the last payload seen for the
+ * same device, direction and register, earlier in the same block. The
+ * headers are left alone, they carry the key. Encoding takes refs from
+ * the raw records, decoding from the already decoded ones, so running
+ * it over the delta coded records with data == ref restores them.
+ */
+#define DELTA_SLOTS 64
+
+struct delta_slot {
+	uint32_t index;
+	uint16_t reg_id;
+	uint8_t dir;
+	bool valid;
+	uint32_t offset;	/* of the payload */
+	uint16_t len;
+};
+
+static void dllog_delta(char *data, const char *ref, uint32_t used)
+{
+	struct delta_slot slots[DELTA_SLOTS] = {};
+	struct nlattr *tb[DEVLINK_ATTR_MAX + 1];
+	const struct dllog_rec *rec;
+	const struct nlmsghdr *nlh;
+	struct genlmsghdr *genl;
+	struct delta_slot *slot;
+	unsigned char *payload;
+	const unsigned char *prev;
+	uint16_t reg_id;
+	uint32_t index;
+	uint16_t len;
+	uint8_t dir;
+	int i;
+
+	dllog_for_each_rec(rec, data, used) {
+		nlh = (const struct nlmsghdr *) (rec + 1);
+		if (rec->len < NLMSG_HDRLEN + GENL_HDRLEN ||
+		    nlh->nlmsg_len != rec->len)
+			continue;
+		genl = mnl_nlmsg_get_payload(nlh);
+		if (genl->cmd != DEVLINK_CMD_HWMSG_NEW)
+			continue;
+		memset(tb, 0, sizeof(tb));
+		mnl_attr_parse(nlh, sizeof(*genl), devlink_attr_cb, tb);
+		if (!check_cmd_hwmsg(tb))
+			continue;
+		payload = mnl_attr_get_payload(tb[DEVLINK_ATTR_HWMSG_PAYLOAD]);
+		len = mnl_attr_get_payload_len(tb[DEVLINK_ATTR_HWMSG_PAYLOAD]);
+		if (len <= EMAD_HDR_LEN)
+			continue;
+
+		index = mnl_attr_get_u32(tb[DEVLINK_ATTR_INDEX]);
+		dir = mnl_attr_get_u8(tb[DEVLINK_ATTR_HWMSG_DIR]);
+		reg_id = emad_reg_id(payload);
+		slot = &slots[(index * 31 + reg_id * 2 + dir) % DELTA_SLOTS];
+		if (slot->valid && slot->index == index &&
+		    slot->reg_id == reg_id && slot->dir == dir) {
+			prev = (const unsigned char *) ref + slot->offset;
+			for (i = EMAD_HDR_LEN; i < len && i < slot->len; i++)
+				payload[i] ^= prev[i];
+		}
+		slot->valid = true;
+		slot->index = index;
+		slot->reg_id = reg_id;
+		slot->dir = dir;
+		slot->offset = (char *) payload - data;
+		slot->len = len;
+	}
+}
+
+/*
+ * Byte oriented LZ77, in the spirit of LZ4. A sequence is a token byte
+ * holding the literal count in its high and the match length less
+ * LZ_MIN_MATCH in its low nibble, a nibble of 15 being continued by
+ * bytes added up until one is not 255. The literals follow, then a
+ * little endian 16-bit match offset. The last sequence has literals
+ * only.
+ */
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+
+static uint32_t lz_read32(const unsigned char *p)
+{
+	uint32_t val;
+
+	memcpy(&val, p, sizeof(val));
+	return val;
+}
+
+static uint32_t lz_hash(uint32_t val)
+{
+	return (val * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static unsigned char *lz_put_len(unsigned char *op, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+	return op;
+}
+
+static unsigned char *lz_put_seq(unsigned char *op, const unsigned char *oend,
+				 const unsigned char *lit, size_t lit_len,
+				 size_t offset, size_t match_len)
+{
+	unsigned char *token;
+
+	if (oend - op < lit_len + lit_len / 255 + match_len / 255 + 6)
+		return NULL;
+	token = op++;
+	*token = (lit_len < 15 ? lit_len : 15) << 4;
+	if (lit_len >= 15)
+		op = lz_put_len(op, lit_len - 15);
+	memcpy(op, lit, lit_len);
+	op += lit_len;
+	if (!match_len)
+		return op;
+	*op++ = offset;
+	*op++ = offset >> 8;
+	match_len -= LZ_MIN_MATCH;
+	*token |= match_len < 15 ? match_len : 15;
+	if (match_len >= 15)
+		op = lz_put_len(op, match_len - 15);
+	return op;
+}
+
+/* Returns the compressed size, 0 if it does not fit in dst_len. */
+static size_t lz_compress(const unsigned char *src, size_t len,
+			  unsigned char *dst, size_t dst_len)
+{
+	uint32_t table[1 << LZ_HASH_BITS] = {};
+	const unsigned char *end = src + len;
+	const unsigned char *dend = dst + dst_len;
+	const unsigned char *anchor = src;
+	const unsigned char *ip = src;
+	const unsigned char *ref;
+	unsigned char *op = dst;
+	size_t match_len;
+	uint32_t hash;
+
+	while (end - ip >= LZ_MIN_MATCH) {
+		hash = lz_hash(lz_read32(ip));
+		ref = src + table[hash];
+		table[hash] = ip - src;
+		if (ref >= ip || ip - ref > LZ_MAX_OFFSET ||
+		    lz_read32(ref) != lz_read32(ip)) {
+			ip++;
+			continue;
+		}
+		match_len = LZ_MIN_MATCH;
+		while (ip + match_len < end && ref[match_len] == ip[match_len])
+			match_len++;
+		op = lz_put_seq(op, dend, anchor, ip - anchor, ip - ref,
+				match_len);
+		if (!op)
+			return 0;
+		ip += match_len;
+		anchor = ip;
+	}
+	op = lz_put_seq(op, dend, anchor, end - anchor, 0, 0);
+	return op ? op - dst : 0;
+}
+
+static int lz_get_len(const unsigned char **pip, const unsigned char *iend,
+		      size_t *p_len)
+{
+	const unsigned char *ip = *pip;
+	unsigned char byte;
+
+	do {
+		if (ip == iend)
+			return -EPROTO;
+		byte = *ip++;
+		*p_len += byte;
+	} while (byte == 255);
+	*pip = ip;
+	return 0;
+}
+
+/* Returns the decompressed size or -EPROTO on damaged input. */
+static ssize_t lz_decompress(const unsigned char *src, size_t len,
+			     unsigned char *dst, size_t dst_len)
+{
+	const unsigned char *iend = src + len;
+	unsigned char *oend = dst + dst_len;
+	const unsigned char *ip = src;
+	unsigned char *op = dst;
+	unsigned char token;
+	size_t offset;
+	size_t n;
+
+	while (ip < iend) {
+		token = *ip++;
+		n = token >> 4;
+		if (n == 15 && lz_get_len(&ip, iend, &n))
+			return -EPROTO;
+		if (n > iend - ip || n > oend - op)
+			return -EPROTO;
+		memcpy(op, ip, n);
+		op += n;
+		ip += n;
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -EPROTO;
+		offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		n = token & 15;
+		if (n == 15 && lz_get_len(&ip, iend, &n))
+			return -EPROTO;
+		n += LZ_MIN_MATCH;
+		if (!offset || offset > op - dst || n > oend - op)
+			return -EPROTO;
+		if (offset >= n) {
+			memcpy(op, op - offset, n);
+			op += n;
+		} else {
+			/* Overlapping copy repeats the last offset bytes. */
+			for (; n; n--, op++)
+				*op = *(op - offset);
+		}
+	}
+	return op - dst;
+}
+
+struct dllog_writer {
+	struct dllog_header header;
+	int fd;
+	struct dllog_block *block;	/* the one being filled */
+	struct dllog_block *index;
+	uint64_t *offsets;		/* of completed blocks, compressed */
+	uint64_t block_count;		/* completed blocks */
+	uint64_t index_alloc;
+	uint64_t flush_ns;
+	uint64_t dropped;
+	bool compressed;
+	char *delta;			/* delta coded records */
+	struct dllog_block *zblock;	/* as written */
+	off_t offset;			/* of the block being filled */
+	size_t block_len;		/* as last written */
+	uint64_t raw_bytes;
+	uint64_t disk_bytes;
+	uint64_t encode_bytes;
+	uint64_t encode_ns;
+};
+
+static uint64_t timespec_ns(const struct timespec *ts)
+{
+	return ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+static int dllog_pwrite(int fd, const void *buf, size_t len, off_t offset)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = pwrite(fd, buf, len, offset);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		buf = (const char *) buf + ret;
+		len -= ret;
+		offset += ret;
+	}
+	return 0;
+}
+
+static off_t dllog_block_offset(uint64_t block)
+{
+	return DLLOG_HEADER_SIZE + block * DLLOG_BLOCK_SIZE;
+}
+
+static size_t dllog_zblock_len(uint32_t csize)
+{
+	return sizeof(struct dllog_block) +
+	       ((csize + DLLOG_ALIGN - 1) & ~(DLLOG_ALIGN - 1));
+}
+
+static int dllog_zblock_write(struct dllog_writer *log)
+{
+	struct dllog_block *block = log->block;
+	unsigned char *zdata = (unsigned char *) (log->zblock + 1);
+	uint64_t start = now_ns();
+	size_t csize;
+
+	memcpy(log->delta, block + 1, block->used);
+	dllog_delta(log->delta, (const char *) (block + 1), block->used);
+	csize = lz_compress((const unsigned char *) log->delta, block->used,
+			    zdata, block->used - 1);
+	if (!csize) {
+		memcpy(zdata, log->delta, block->used);
+		csize = block->used;
+	}
+	block->csize = csize;
+	*log->zblock = *block;
+	log->block_len = dllog_zblock_len(csize);
+	memset(zdata + csize, 0,
+	       log->block_len - sizeof(*block) - csize);
+	log->encode_ns += now_ns() - start;
+	log->encode_bytes += block->used;
+
+	return dllog_pwrite(log->fd, log->zblock, log->block_len, log->offset);
+}
+
+/* Also used to get a partially filled block to disk once in a while. */
+static int dllog_block_write(struct dllog_writer *log)
+{
+	log->flush_ns = now_ns();
+	if (log->compressed)
+		return dllog_zblock_write(log);
+	return dllog_pwrite(log->fd, log->block, DLLOG_BLOCK_SIZE,
+			    dllog_block_offset(log->block_count));
+}
+
+static int dllog_block_finish(struct dllog_writer *log)
+{
+	struct dllog_block *index;
+	uint64_t *offsets;
+	uint64_t alloc;
+	int err;
+
+	if (!log->block->count)
+		return 0;
+	err = dllog_block_write(log);
+	if (err)
+		return err;
+
+	if (log->block_count == log->index_alloc) {
+		alloc = log->index_alloc ? log->index_alloc * 2 : 64;
+		index = realloc(log->index, alloc * sizeof(*index));
+		if (!index)
+			return -ENOMEM;
+		log->index = index;
+		offsets = realloc(log->offsets, alloc * sizeof(*offsets));
+		if (!offsets)
+			return -ENOMEM;
+		log->offsets = offsets;
+		log->index_alloc = alloc;
+	}
+	log->raw_bytes += sizeof(*log->block) + log->block->used;
+	if (log->compressed) {
+		log->offsets[log->block_count] = log->offset;
+		log->offset += log->block_len;
+		log->disk_bytes += log->block_len;
+	}
+	log->index[log->block_count++] = *log->block;
+
+	memset(log->block, 0, DLLOG_BLOCK_SIZE);
+	log->block->magic = DLLOG_BLOCK_MAGIC;
+	return 0;
+}
+
+static uint32_t dllog_msg_dev(const struct nlmsghdr *nlh)
+{
+	struct nlattr *tb[DEVLINK_ATTR_MAX + 1] = {};
+	struct genlmsghdr *genl = mnl_nlmsg_get_payload(nlh);
+
+	mnl_attr_parse(nlh, sizeof(*genl), devlink_attr_cb, tb);
+	if (!tb[DEVLINK_ATTR_INDEX])
+		return DLLOG_DEV_NONE;
+	return mnl_attr_get_u32(tb[DEVLINK_ATTR_INDEX]);
+}
+
+static int dllog_write(struct dllog_writer *log, uint64_t ts,
+		       const struct nlmsghdr *nlh)
+{
+	struct dllog_block *block = log->block;
+	size_t size = dllog_rec_size(nlh->nlmsg_len);
+	struct dllog_rec *rec;
+	int err;
+
+	if (size > DLLOG_BLOCK_SIZE - sizeof(*block)) {
+		log->dropped++;
+		return 0;
+	}
+	if (block->used + size > DLLOG_BLOCK_SIZE - sizeof(*block)) {
+		err = dllog_block_finish(log);
+		if (err)
+			return err;
+	}
+
+	rec = (struct dllog_rec *) ((char *) (block + 1) + block->used);
+	rec->ts = ts;
+	rec->len = nlh->nlmsg_len;
+	rec->dev = dllog_msg_dev(nlh);
+	memcpy(rec + 1, nlh, nlh->nlmsg_len);
+
+	if (!block->count)
+		block->first_ts = ts;
+	block->last_ts = ts;
+	if (rec->dev != DLLOG_DEV_NONE)
+		dllog_bitmap_set(block->dev_bitmap, rec->dev);
+	block->used += size;
+	block->count++;
+
+	/* Whatever is older than a second is on disk should we crash. */
+	if (now_ns() - log->flush_ns > 1000000000ULL)
+		return dllog_block_write(log);
+	return 0;
+}
+
+static struct dllog_writer *dllog_open(struct dl *dl, const char *path,
+				       bool compressed)
+{
+	struct dllog_header *header;
+	struct index_map *index_map;
+	struct dllog_writer *log;
+	struct dllog_dev *dev;
+	int err;
+
+	log = myzalloc(sizeof(*log));
+	if (!log)
+		return NULL;
+	log->block = myzalloc(DLLOG_BLOCK_SIZE);
+	if (!log->block)
+		goto err_block_alloc;
+	log->block->magic = DLLOG_BLOCK_MAGIC;
+	if (compressed) {
+		log->compressed = true;
+		log->delta = malloc(DLLOG_BLOCK_SIZE);
+		log->zblock = malloc(DLLOG_BLOCK_SIZE);
+		if (!log->delta || !log->zblock)
+			goto err_open;
+		log->offset = DLLOG_HEADER_SIZE;
+	}
+
+	log->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (log->fd < 0)
+		goto err_open;
+
+	header = &log->header;
+	header->magic = DLLOG_MAGIC;
+	header->version = compressed ? DLLOG_VERSION_COMPRESSED :
+				       DLLOG_VERSION;
+	header->block_size = DLLOG_BLOCK_SIZE;
+	list_for_each_node_entry(index_map, &dl->index_map_list, list) {
+		if (header->dev_count == DLLOG_DEV_MAX)
+			break;
+		dev = &header->devs[header->dev_count++];
+		dev->index = index_map->index;
+		mystrlcpy(dev->name, index_map->name, sizeof(dev->name));
+	}
+	err = dllog_pwrite(log->fd, header, sizeof(*header), 0);
+	if (err) {
+		errno = -err;
+		goto err_write;
+	}
+	log->flush_ns = now_ns();
+	return log;
+
+err_write:
+	close(log->fd);
+err_open:
+	free(log->zblock);
+	free(log->delta);
+	free(log->block);
+err_block_alloc:
+	free(log);
+	return NULL;
+}
+
+/* Writes out the last block and the index, the header goes last so
+ * that a log is either indexed completely or not at all.
+ */
+static int dllog_close(struct dllog_writer *log)
+{
+	off_t index_offset;
+	int err;
+
+	err = dllog_block_finish(log);
+	if (err)
+		goto out;
+
+	if (log->compressed)
+		index_offset = log->offset;
+	else
+		index_offset = dllog_block_offset(log->block_count);
+	err = dllog_pwrite(log->fd, log->index,
+			   log->block_count * sizeof(*log->index),
+			   index_offset);
+	if (err)
+		goto out;
+	if (log->compressed) {
+		err = dllog_pwrite(log->fd, log->offsets,
+				   log->block_count * sizeof(*log->offsets),
+				   index_offset + log->block_count *
+						  sizeof(*log->index));
+		if (err)
+			goto out;
+	}
+
+	log->header.block_count = log->block_count;
+	log->header.index_offset = index_offset;
+	err = dllog_pwrite(log->fd, &log->header, sizeof(log->header), 0);
+
+out:
+	if (log->dropped)
+		pr_err("%" PRIu64 " oversized messages were not logged\n",
+		       log->dropped);
+	if (log->compressed && log->disk_bytes && log->encode_ns)
+		pr_err("Compressed %" PRIu64 " bytes to %" PRIu64
+		       " (ratio %.2f), encoding at %.1f MB/s\n",
+		       log->raw_bytes, log->disk_bytes,
+		       (double) log->raw_bytes / log->disk_bytes,
+		       log->encode_bytes * 1000.0 / log->encode_ns);
+	close(log->fd);
+	free(log->offsets);
+	free(log->index);
+	free(log->zblock);
+	free(log->delta);
+	free(log->block);
+	free(log);
+	return err;
+}
+
+/*
+ * Flight recorder keeps the most recent records in a fixed ring, laid
+ * out the same way as records in a dllog block. A record which would
+ * cross the end of the ring starts over at its beginning, the rest is
+ * marked as padding.
+ */
+#define FLIGHT_PAD UINT32_MAX
+#define FLIGHT_SIZE_MIN 65536
+
+struct flight_recorder {
+	char *buf;
+	size_t size;
+	size_t head;
+	size_t tail;
+	size_t used;
+	uint64_t count;
+	uint64_t overwritten;
+	const char *file;
+	unsigned int dumps;
+	bool trigger_emad_error;
+	bool trigger_dev_del;
+	bool compressed;
+};
+
+static int flight_init(struct flight_recorder *fr, size_t size)
+{
+	fr->size = size & ~(size_t) (DLLOG_ALIGN - 1);
+	fr->buf = malloc(fr->size);
+	if (!fr->buf)
+		return -ENOMEM;
+	/* Fault all of it in now rather than while recording. */
+	memset(fr->buf, 0, fr->size);
+	return 0;
+}
+
+static void flight_fini(struct flight_recorder *fr)
+{
+	free(fr->buf);
+}
+
+static bool flight_pad_at(const struct flight_recorder *fr, size_t pos)
+{
+	return fr->size - pos < sizeof(struct dllog_rec) ||
+	       ((const struct dllog_rec *) (fr->buf + pos))->len == FLIGHT_PAD;
+}
+
+static void flight_evict(struct flight_recorder *fr)
+{
+	const struct dllog_rec *rec;
+	size_t size;
+
+	if (flight_pad_at(fr, fr->tail)) {
+		fr->used -= fr->size - fr->tail;
+		fr->tail = 0;
+		return;
+	}
+	rec = (const struct dllog_rec *) (fr->buf + fr->tail);
+	size = dllog_rec_size(rec->len);
+	fr->tail += size;
+	fr->used -= size;
+	if (fr->tail == fr->size)
+		fr->tail = 0;
+	fr->count--;
+	fr->overwritten++;
+}
+
+static void flight_record(struct flight_recorder *fr, uint64_t ts,
+			  const struct nlmsghdr *nlh)
+{
+	size_t size = dllog_rec_size(nlh->nlmsg_len);
+	struct dllog_rec *rec;
+	size_t pad = 0;
+
+	if (size > fr->size / 2)
+		return;
+	if (fr->head + size > fr->size)
+		pad = fr->size - fr->head;
+	while (fr->size - fr->used < pad + size)
+		flight_evict(fr);
+	if (pad) {
+		if (pad >= sizeof(*rec))
+			((struct dllog_rec *) (fr->buf + fr->head))->len =
+								FLIGHT_PAD;
+		fr->used += pad;
+		fr->head = 0;
+	}
+
+	rec = (struct dllog_rec *) (fr->buf + fr->head);
+	rec->ts = ts;
+	rec->len = nlh->nlmsg_len;
+	rec->dev = DLLOG_DEV_NONE;
+	memcpy(rec + 1, nlh, nlh->nlmsg_len);
+	fr->head += size;
+	fr->used += size;
+	if (fr->head == fr->size)
+		fr->head = 0;
+	fr->count++;
+}
+
+/* Writes the ring out as a dllog file and starts over empty. */
+static int flight_dump(struct dl *dl, struct flight_recorder *fr,
+		       const char *reason)
+{
+	const struct dllog_rec *rec;
+	struct dllog_writer *log;
+	char path[PATH_MAX];
+	uint64_t count = fr->count;
+	size_t pos = fr->tail;
+	size_t left = fr->used;
+	int err = 0;
+
+	snprintf(path, sizeof(path), "%s.%u", fr->file, fr->dumps++);
+	log = dllog_open(dl, path, fr->compressed);
+	if (!log) {
+		pr_err("Failed to open \"%s\"\n", path);
+		return -errno;
+	}
+	while (left && !err) {
+		if (flight_pad_at(fr, pos)) {
+			left -= fr->size - pos;
+			pos = 0;
+			continue;
+		}
+		rec = (const struct dllog_rec *) (fr->buf + pos);
+		err = dllog_write(log, rec->ts,
+				  (const struct nlmsghdr *) (rec + 1));
+		pos += dllog_rec_size(rec->len);
+		left -= dllog_rec_size(rec->len);
+		if (pos == fr->size)
+			pos = 0;
+	}
+	if (!err)
+		err = dllog_close(log);
+	else
+		dllog_close(log);
+	if (err) {
+		pr_err("Failed to write \"%s\"\n", path);
+		return err;
+	}
+	pr_err("Flight recorder: %s, %" PRIu64 " records (%" PRIu64
+	       " overwritten) written to \"%s\"\n", reason, count,
+	       fr->overwritten, path);
+
+	fr->head = fr->tail = fr->used = 0;
+	fr->count = fr->overwritten = 0;
+	return 0;
+}
+
+static bool flight_trigger(const struct flight_recorder *fr,
+			   const struct nlmsghdr *nlh, const char **p_reason)
+{
+	struct nlattr *tb[DEVLINK_ATTR_MAX + 1] = {};
+	struct genlmsghdr *genl = mnl_nlmsg_get_payload(nlh);
+	const unsigned char *payload;
+	uint16_t len;
+
+	if (genl->cmd == DEVLINK_CMD_DEL && fr->trigger_dev_del) {
+		*p_reason = "device removed";
+		return true;
+	}
+	if (genl->cmd != DEVLINK_CMD_HWMSG_NEW || !fr->trigger_emad_error)
+		return false;
+	mnl_attr_parse(nlh, sizeof(*genl), devlink_attr_cb, tb);
+	if (!check_cmd_hwmsg(tb) ||
+	    mnl_attr_get_u8(tb[DEVLINK_ATTR_HWMSG_DIR]) !=
+	    DEVLINK_HWMSG_DIR_FROM_HW)
+		return false;
+	payload = mnl_attr_get_payload(tb[DEVLINK_ATTR_HWMSG_PAYLOAD]);
+	len = mnl_attr_get_payload_len(tb[DEVLINK_ATTR_HWMSG_PAYLOAD]);
+	if (!emad_status(payload, len))
+		return false;
+	*p_reason = "EMAD error status";
+	return true;
+}
+
+/* Parses SIZE[k|m|g]. */
+static int dl_argv_size(struct dl *dl, size_t *p_size)
+{
+	const char *str = dl_argv_next(dl);
+	unsigned long long size;
+	char *end;
+
+	if (!str) {
+		pr_err("Size expected\n");
+		return -EINVAL;
+	}
+	size = strtoull(str, &end, 0);
+	switch (*end) {
+	case 'g': case 'G': size <<= 10; /* fall through */
+	case 'm': case 'M': size <<= 10; /* fall through */
+	case 'k': case 'K': size <<= 10; end++; break;
+	}
+	if (end == str || *end) {
+		pr_err("Invalid size \"%s\"\n", str);
+		return -EINVAL;
+	}
+	*p_size = size;
+	return 0;
+}
+
+/*
+ * Bounds what high rate hwmsg traffic costs: only every sample-th
+ * message is taken, then each device may pass rate messages a second
+ * with bursts of up to burst. Whatever is left out is still counted.
+ */
+struct mon_limit {
+	uint32_t index;
+	double tokens;
+	uint64_t last_ns;
+};
+
+struct mon_filter {
+	uint32_t sample;		/* 1 in sample, 0 or 1 for all */
+	uint32_t rate;			/* per device and second, 0 none */
+	uint32_t burst;
+	uint64_t seen;
+	struct mon_limit *limits;
+	unsigned int limit_count;
+	uint64_t passed_msgs;
+	uint64_t passed_bytes;
+	uint64_t sampled_msgs;
+	uint64_t sampled_bytes;
+	uint64_t limited_msgs;
+	uint64_t limited_bytes;
+};
+
+static bool mon_filter_active(const struct mon_filter *filter)
+{
+	return filter->sample > 1 || filter->rate;
+}
+
+static struct mon_limit *mon_limit_get(struct mon_filter *filter,
+				       uint32_t index, uint64_t now)
+{
+	struct mon_limit *limits;
+	unsigned int i;
+
+	for (i = 0; i < filter->limit_count; i++)
+		if (filter->limits[i].index == index)
+			return &filter->limits[i];
+	limits = realloc(filter->limits,
+			 (filter->limit_count + 1) * sizeof(*limits));
+	if (!limits)
+		return NULL;
+	filter->limits = limits;
+	limits += filter->limit_count++;
+	limits->index = index;
+	limits->tokens = filter->burst;
+	limits->last_ns = now;
+	return limits;
+}
+
+static bool mon_limit_take(struct mon_filter *filter, struct mon_limit *limit,
+			   uint64_t now)
+{
+	limit->tokens += (now - limit->last_ns) * 1e-9 * filter->rate;
+	if (limit->tokens > filter->burst)
+		limit->tokens = filter->burst;
+	limit->last_ns = now;
+	if (limit->tokens < 1)
+		return false;
+	limit->tokens--;
+	return true;
+}
+
+/* Returns whether a DEVLINK_CMD_HWMSG_NEW message is to be processed. */
+static bool mon_filter_pass(struct mon_filter *filter,
+			    const struct nlmsghdr *nlh)
+{
+	struct mon_limit *limit;
+	uint64_t now;
+
+	if (filter->sample > 1 && filter->seen++ % filter->sample) {
+		filter->sampled_msgs++;
+		filter->sampled_bytes += nlh->nlmsg_len;
+		return false;
+	}
+	if (filter->rate) {
+		now = now_ns();
+		limit = mon_limit_get(filter, dllog_msg_dev(nlh), now);
+		if (limit && !mon_limit_take(filter, limit, now)) {
+			filter->limited_msgs++;
+			filter->limited_bytes += nlh->nlmsg_len;
+			return false;
+		}
+	}
+	filter->passed_msgs++;
+	filter->passed_bytes += nlh->nlmsg_len;
+	return true;
+}
+
+static void mon_filter_print(const struct mon_filter *filter,
+			     const struct dl *dl)
+{
+	if (mon_filter_active(filter))
+		pr_err("hwmsg: %" PRIu64 " passed (%" PRIu64 " bytes), %" PRIu64
+		       " sampled out (%" PRIu64 " bytes), %" PRIu64
+		       " rate limited (%" PRIu64 " bytes)\n",
+		       filter->passed_msgs, filter->passed_bytes,
+		       filter->sampled_msgs, filter->sampled_bytes,
+		       filter->limited_msgs, filter->limited_bytes);
+	if (dl->snaplen)
+		pr_err("hwmsg: %" PRIu64 " cut by snaplen (%" PRIu64
+		       " bytes not shown)\n", dl->snap_msgs, dl->snap_bytes);
+}
+
+struct mon_ctx {
+	struct dl *dl;
+	bool measure_lag;	/* with -t */
+	bool busy_poll;
+	uint64_t empty_polls;
+	uint64_t last_rx_ns;
+	struct lag_hist gap;	/* between receives, with --busy-poll */
+	struct lag_hist lag;
+	struct dllog_writer *log;
+	struct flight_recorder *fr;
+	struct mon_filter filter;
+};
+
+/* What is still queued behind this event shows how far behind we are. */
+static void lag_hist_rmem_sample(struct lag_hist *hist, int fd)
+{
+	uint32_t meminfo[SK_MEMINFO_VARS];
+	socklen_t len = sizeof(meminfo);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_MEMINFO, meminfo, &len) < 0)
+		return;
+	if (meminfo[SK_MEMINFO_RMEM_ALLOC] > hist->rmem_max)
+		hist->rmem_max = meminfo[SK_MEMINFO_RMEM_ALLOC];
+	hist->rcvbuf = meminfo[SK_MEMINFO_RCVBUF];
+}
+
+static int cmd_mon_show_ts_cb(const struct nlmsghdr *nlh,
+			      const struct timespec *ts, void *data)
+{
+	struct mon_ctx *ctx = data;
+	struct genlmsghdr *genl;
+	struct timespec now;
+	const char *reason;
+	uint64_t rx_ns;
+	int err;
+
+	/* Netlink carries no kernel timestamps, so busy polling measures
+	 * the jitter of its own receive times.
+	 */
+	if (ctx->busy_poll) {
+		rx_ns = now_ns();
+		if (ctx->last_rx_ns)
+			lag_hist_add_ns(&ctx->gap, rx_ns - ctx->last_rx_ns);
+		ctx->last_rx_ns = rx_ns;
+	}
+	if (ctx->measure_lag) {
+		ctx->lag.events++;
+		lag_hist_rmem_sample(&ctx->lag,
+				     mnlg_socket_get_fd(ctx->dl->nlg));
+		if (ts)
+			lag_hist_add(&ctx->lag, ts);
+	}
+	if (!ts) {
+		/* Not all kernels stamp netlink, use the receive time. */
+		clock_gettime(CLOCK_REALTIME, &now);
+		ts = &now;
+	}
+	genl = mnl_nlmsg_get_payload(nlh);
+	if (ctx->fr) {
+		if (genl->cmd == DEVLINK_CMD_HWMSG_NEW ||
+		    genl->cmd == DEVLINK_CMD_DEL)
+			flight_record(ctx->fr, timespec_ns(ts), nlh);
+		if (flight_trigger(ctx->fr, nlh, &reason))
+			flight_dump(ctx->dl, ctx->fr, reason);
+		return MNL_CB_OK;
+	}
+	if (genl->cmd == DEVLINK_CMD_HWMSG_NEW &&
+	    mon_filter_active(&ctx->filter) &&
+	    !mon_filter_pass(&ctx->filter, nlh))
+		return MNL_CB_OK;
+	if (ctx->log) {
+		err = dllog_write(ctx->log, timespec_ns(ts), nlh);
+		if (err) {
+			errno = -err;
+			return MNL_CB_ERROR;
+		}
+		return MNL_CB_OK;
+	}
+	ctx->dl->ts = ctx->dl->timestamp ? ts : NULL;
+	return cmd_mon_show_cb(nlh, ctx->dl);
+}
+
+static void mon_stats_print(const struct mon_ctx *ctx)
+{
+	mon_filter_print(&ctx->filter, ctx->dl);
+	if (ctx->measure_lag)
+		lag_hist_print(&ctx->lag);
+	if (!ctx->busy_poll)
+		return;
+	pr_err("Busy poll: %" PRIu64 " empty receives\n", ctx->empty_polls);
+	if (ctx->gap.count)
+		lag_hist_print_samples(&ctx->gap, "Receive interval");
+}
+
+/* Timestamped, logging, recording, filtering or busy polling monitor
+ * runs until SIGINT/SIGTERM. SIGUSR1 dumps the flight recorder, if any,
+ * prints the filter counters, with -t the delivery lag histogram and
+ * receive queue peak and with --busy-poll the histogram of intervals
+ * between receives collected so far.
+ */
+static int cmd_monitor_ts(struct mon_ctx *ctx)
+{
+	struct dl *dl = ctx->dl;
+	struct sigaction sa = {
+		.sa_handler = stop_sig_handler,
+	};
+	int fd;
+	int err;
+
+	err = mnlg_socket_timestamp_enable(dl->nlg);
+	if (err < 0) {
+		pr_err("Failed to enable socket timestamps\n");
+		return -errno;
+	}
+	if (ctx->busy_poll) {
+		fd = mnlg_socket_get_fd(dl->nlg);
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	}
+
+	/* No SA_RESTART, a signal has to interrupt the blocking receive. */
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sa.sa_handler = usr1_sig_handler;
+	sigaction(SIGUSR1, &sa, NULL);
+
+	while (!g_stop) {
+		err = mnlg_socket_recv_run_ts(dl->nlg, cmd_mon_show_ts_cb, ctx);
+		if (err >= 0)
+			break;
+		if (ctx->busy_poll && errno == EAGAIN) {
+			ctx->empty_polls++;
+		} else if (errno != EINTR) {
+			pr_err("Failed to call mnlg_socket_recv_run_ts\n");
+			err = -errno;
+			break;
+		}
+		if (g_usr1) {
+			g_usr1 = 0;
+			if (ctx->fr)
+				flight_dump(dl, ctx->fr, "SIGUSR1");
+			mon_stats_print(ctx);
+		}
+	}
+	dl->ts = NULL;
+	mon_stats_print(ctx);
+	free(ctx->filter.limits);
+	if (g_stop)
+		return 0;
+	return err < 0 ? err : 0;
+}
+
+/* For --busy-poll, though none of it needs it. */
+struct mon_rt {
+	int cpu;		/* -1 to keep the affinity */
+	uint32_t fifo_prio;	/* 0 to keep the policy */
+	bool mlock;
+};
+
+#define MON_STACK_PREFAULT (256 * 1024)
+
+static void mon_prefault_stack(void)
+{
+	volatile char stack[MON_STACK_PREFAULT];
+	size_t i;
+
+	for (i = 0; i < sizeof(stack); i += 4096)
+		stack[i] = 0;
+}
+
+/* Called before any buffer is set up, so that MCL_FUTURE faults them all
+ * in right when they are mapped.
+ */
+static int mon_rt_setup(const struct mon_rt *rt)
+{
+	struct sched_param param = {
+		.sched_priority = rt->fifo_prio,
+	};
+	cpu_set_t set;
+
+	if (rt->cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(rt->cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set)) {
+			pr_err("Failed to pin to CPU %d\n", rt->cpu);
+			return -errno;
+		}
+	}
+	if (rt->mlock) {
+		if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+			pr_err("Failed to lock memory\n");
+			return -errno;
+		}
+		mon_prefault_stack();
+	}
+	if (rt->fifo_prio && sched_setscheduler(0, SCHED_FIFO, &param)) {
+		pr_err("Failed to switch to SCHED_FIFO\n");
+		return -errno;
+	}
+	return 0;
+}
+
+static void cmd_mon_help(void)
+{
+	pr_out("Usage: dl monitor [ -o FILE [ --compress ] | --snaplen BYTES ]\n"
+	       "                  [ --sample N ] [ --rate-limit MSGS [ --burst MSGS ] ]\n");
+	pr_out("       dl monitor --flight-recorder SIZE [ --trigger TRIGGER ]...\n"
+	       "                  [ --dump-file PATH ] [ --compress ]\n"
+	       "TRIGGER := { emad-error | dev-del }\n");
+	pr_out("Both take [ --busy-poll ] [ --cpu CPU ] [ --fifo PRIO ] [ --mlock ]\n");
+}
+
+static int cmd_monitor(struct dl *dl)
+{
+	struct flight_recorder fr = {
+		.file = "dl-flight",
+	};
+	struct mon_ctx ctx = {
+		.dl = dl,
+	};
+	struct mon_rt rt = {
+		.cpu = -1,
+	};
+	const char *file = NULL;
+	bool dump_file = false;
+	uint32_t cpu;
+	bool compressed = false;
+	size_t fr_size = 0;
+	const char *str;
+	int close_err;
+	int err;
+
+	if (dl_server_refuse(dl))
+		return -EOPNOTSUPP;
+
+	while (dl_argc(dl)) {
+		if (dl_argv_match(dl, "help")) {
+			cmd_mon_help();
+			return 0;
+		} else if (dl_argv_match(dl, "-o")) {
+			dl_arg_inc(dl);
+			file = dl_argv_next(dl);
+			if (!file) {
+				pr_err("File name expected\n");
+				return -EINVAL;
+			}
+		} else if (dl_argv_match(dl, "--flight-recorder")) {
+			dl_arg_inc(dl);
+			err = dl_argv_size(dl, &fr_size);
+			if (err)
+				return err;
+			if (fr_size < FLIGHT_SIZE_MIN) {
+				pr_err("Flight recorder needs at least %u bytes\n",
+				       FLIGHT_SIZE_MIN);
+				return -EINVAL;
+			}
+		} else if (dl_argv_match(dl, "--trigger")) {
+			dl_arg_inc(dl);
+			str = dl_argv_next(dl);
+			if (str && !strcmp(str, "emad-error")) {
+				fr.trigger_emad_error = true;
+			} else if (str && !strcmp(str, "dev-del")) {
+				fr.trigger_dev_del = true;
+			} else {
+				pr_err("Unknown trigger \"%s\"\n", str ? str : "");
+				return -EINVAL;
+			}
+		} else if (dl_argv_match(dl, "--sample")) {
+			dl_arg_inc(dl);
+			err = dl_argv_uint32_t(dl, &ctx.filter.sample);
+			if (err)
+				return err;
+		} else if (dl_argv_match(dl, "--rate-limit")) {
+			dl_arg_inc(dl);
+			err = dl_argv_uint32_t(dl, &ctx.filter.rate);
+			if (err)
+				return err;
+		} else if (dl_argv_match(dl, "--burst")) {
+			dl_arg_inc(dl);
+			err = dl_argv_uint32_t(dl, &ctx.filter.burst);
+			if (err)
+				return err;
+		} else if (dl_argv_match(dl, "--snaplen")) {
+			dl_arg_inc(dl);
+			err = dl_argv_uint32_t(dl, &dl->snaplen);
+			if (err)
+				return err;
+		} else if (dl_argv_match(dl, "--compress")) {
+			dl_arg_inc(dl);
+			compressed = true;
+		} else if (dl_argv_match(dl, "--busy-poll")) {
+			dl_arg_inc(dl);
+			ctx.busy_poll = true;
+		} else if (dl_argv_match(dl, "--cpu")) {
+			dl_arg_inc(dl);
+			err = dl_argv_uint32_t(dl, &cpu);
+			if (err)
+				return err;
+			if (cpu >= CPU_SETSIZE) {
+				pr_err("CPU %u is out of range\n", cpu);
+				return -EINVAL;
+			}
+			rt.cpu = cpu;
+		} else if (dl_argv_match(dl, "--fifo")) {
+			dl_arg_inc(dl);
+			err = dl_argv_uint32_t(dl, &rt.fifo_prio);
+			if (err)
+				return err;
+			if (rt.fifo_prio < sched_get_priority_min(SCHED_FIFO) ||
+			    rt.fifo_prio > sched_get_priority_max(SCHED_FIFO)) {
+				pr_err("SCHED_FIFO priority %u is out of range\n",
+				       rt.fifo_prio);
+				return -EINVAL;
+			}
+		} else if (dl_argv_match(dl, "--mlock")) {
+			dl_arg_inc(dl);
+			rt.mlock = true;
+		} else if (dl_argv_match(dl, "--dump-file")) {
+			dl_arg_inc(dl);
+			fr.file = dl_argv_next(dl);
+			if (!fr.file) {
+				pr_err("File name expected\n");
+				return -EINVAL;
+			}
+			dump_file = true;
+		} else {
+			pr_err("Unknown option \"%s\"\n", dl_argv(dl));
+			return -EINVAL;
+		}
+	}
+	if (file && fr_size) {
+		pr_err("-o and --flight-recorder are mutually exclusive\n");
+		return -EINVAL;
+	}
+	if (compressed && !file && !fr_size) {
+		pr_err("--compress needs -o or --flight-recorder\n");
+		return -EINVAL;
+	}
+	if ((fr.trigger_emad_error || fr.trigger_dev_del) && !fr_size) {
+		pr_err("--trigger needs --flight-recorder\n");
+		return -EINVAL;
+	}
+	if (dump_file && !fr_size) {
+		pr_err("--dump-file needs --flight-recorder\n");
+		return -EINVAL;
+	}
+	/* The recorder keeps every message, none of these would apply. */
+	if (fr_size && (ctx.filter.sample || ctx.filter.rate ||
+			ctx.filter.burst || dl->snaplen)) {
+		pr_err("--sample, --rate-limit, --burst and --snaplen do not work with --flight-recorder\n");
+		return -EINVAL;
+	}
+	if (file && dl->snaplen) {
+		pr_err("--snaplen does not work with -o, the log keeps whole messages\n");
+		return -EINVAL;
+	}
+	if (!ctx.filter.burst)
+		ctx.filter.burst = ctx.filter.rate ? ctx.filter.rate : 1;
+	if (ctx.busy_poll && dl->uring) {
+		pr_err("--busy-poll does not work with --uring\n");
+		return -EINVAL;
+	}
+	ctx.measure_lag = dl->timestamp;
+
+	err = _mnlg_socket_group_add(dl->nlg, DEVLINK_GENL_MCGRP_CONFIG_NAME);
+	if (err)
+		return err;
+	err = _mnlg_socket_group_add(dl->nlg, DEVLINK_GENL_MCGRP_HWMSG_NAME);
+	if (err)
+		return err;
+	err = mon_rt_setup(&rt);
+	if (err)
+		return err;
+
+	if (file) {
+		ctx.log = dllog_open(dl, file, compressed);
+		if (!ctx.log) {
+			pr_err("Failed to open \"%s\"\n", file);
+			return -errno;
+		}
+		err = cmd_monitor_ts(&ctx);
+		close_err = dllog_close(ctx.log);
+		return err ? err : close_err;
+	}
+	if (fr_size) {
+		err = flight_init(&fr, fr_size);
+		if (err)
+			return err;
+		fr.compressed = compressed;
+		ctx.fr = &fr;
+		err = cmd_monitor_ts(&ctx);
+		flight_fini(&fr);
+		return err;
+	}
+
+	/* Events have to show up as they come, whatever stdout is. */
+	g_out.line_buffered = true;
+	if (ctx.measure_lag || ctx.busy_poll ||
+	    mon_filter_active(&ctx.filter) || dl->snaplen)
+		return cmd_monitor_ts(&ctx);
+	err = _mnlg_socket_recv_run(dl->nlg, cmd_mon_show_cb, dl);
+	if (err)
+		return err;
+	return 0;
+}
+
+struct dllog_reader {
+	const char *map;
+	size_t size;
+	const struct dllog_header *header;
+	const char *index;
+	size_t index_stride;
+	uint64_t block_count;
+	bool compressed;
+	const uint64_t *offsets;	/* of blocks, compressed */
+	uint64_t *walk_offsets;
+};
+
+static bool dllog_zblock_valid(const struct dllog_reader *log,
+			       uint64_t offset)
+{
+	const struct dllog_block *hdr;
+
+	if (offset < DLLOG_HEADER_SIZE || offset % DLLOG_ALIGN ||
+	    offset + sizeof(*hdr) > log->size)
+		return false;
+	hdr = (const struct dllog_block *) (log->map + offset);
+	return hdr->magic == DLLOG_BLOCK_MAGIC &&
+	       hdr->used <= DLLOG_BLOCK_SIZE - sizeof(*hdr) &&
+	       hdr->csize <= hdr->used &&
+	       offset + dllog_zblock_len(hdr->csize) <= log->size;
+}
+
+/* Compressed blocks vary in size, find them one after another. */
+static int dllog_zwalk(struct dllog_reader *log)
+{
+	const struct dllog_block *hdr;
+	uint64_t offset = DLLOG_HEADER_SIZE;
+	uint64_t alloc = 0;
+	uint64_t *offsets;
+
+	log->block_count = 0;
+	while (dllog_zblock_valid(log, offset)) {
+		if (log->block_count == alloc) {
+			alloc = alloc ? alloc * 2 : 64;
+			offsets = realloc(log->walk_offsets,
+					  alloc * sizeof(*offsets));
+			if (!offsets)
+				return -ENOMEM;
+			log->walk_offsets = offsets;
+		}
+		log->walk_offsets[log->block_count++] = offset;
+		hdr = (const struct dllog_block *) (log->map + offset);
+		offset += dllog_zblock_len(hdr->csize);
+	}
+	log->offsets = log->walk_offsets;
+	return 0;
+}
+
+static void dllog_unmap(struct dllog_reader *log)
+{
+	munmap((void *) log->map, log->size);
+	free(log->walk_offsets);
+}
+
+/* The header is not trusted, a damaged one must not point the index or
+ * the blocks it covers outside of the file.
+ */
+static bool dllog_index_valid(const struct dllog_reader *log)
+{
+	const struct dllog_header *header = log->header;
+	uint64_t stride = sizeof(struct dllog_block);
+
+	if (log->compressed)
+		stride += sizeof(uint64_t);
+	if (header->index_offset < DLLOG_HEADER_SIZE ||
+	    header->index_offset > log->size ||
+	    header->block_count > (log->size - header->index_offset) / stride)
+		return false;
+	/* Plain blocks sit between the header and the index. */
+	return log->compressed ||
+	       header->block_count <= (header->index_offset -
+				       DLLOG_HEADER_SIZE) / DLLOG_BLOCK_SIZE;
+}
+
+static int dllog_map(const char *path, struct dllog_reader *log)
+{
+	const struct dllog_header *header;
+	struct stat st;
+	int err;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -errno;
+	}
+	if (st.st_size < DLLOG_HEADER_SIZE) {
+		close(fd);
+		return -EPROTO;
+	}
+	log->size = st.st_size;
+	log->map = mmap(NULL, log->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (log->map == MAP_FAILED)
+		return -errno;
+
+	header = log->header = (const struct dllog_header *) log->map;
+	if (header->magic != DLLOG_MAGIC ||
+	    (header->version != DLLOG_VERSION &&
+	     header->version != DLLOG_VERSION_COMPRESSED) ||
+	    header->block_size != DLLOG_BLOCK_SIZE ||
+	    header->dev_count > DLLOG_DEV_MAX) {
+		munmap((void *) log->map, log->size);
+		return -EPROTO;
+	}
+	log->compressed = header->version == DLLOG_VERSION_COMPRESSED;
+
+	if (dllog_index_valid(log)) {
+		log->index = log->map + header->index_offset;
+		log->index_stride = sizeof(struct dllog_block);
+		log->block_count = header->block_count;
+		if (log->compressed)
+			log->offsets = (const uint64_t *) (log->index +
+				header->block_count * sizeof(struct dllog_block));
+	} else if (log->compressed) {
+		err = dllog_zwalk(log);
+		if (err) {
+			dllog_unmap(log);
+			return err;
+		}
+		log->index = NULL;
+	} else {
+		/* The writer did not close the log, walk blocks in place. */
+		log->index = log->map + DLLOG_HEADER_SIZE;
+		log->index_stride = DLLOG_BLOCK_SIZE;
+		log->block_count = (log->size - DLLOG_HEADER_SIZE) /
+				   DLLOG_BLOCK_SIZE;
+	}
+	return 0;
+}
+
+static const struct dllog_block *dllog_index(const struct dllog_reader *log,
+					     uint64_t block)
+{
+	if (!log->index)
+		return (const struct dllog_block *) (log->map +
+						     log->offsets[block]);
+	return (const struct dllog_block *) (log->index +
+					     block * log->index_stride);
+}
+
+/* Returns the records of a block, NULL if it is damaged. Compressed
+ * blocks are decoded into buf of DLLOG_BLOCK_SIZE bytes.
+ */
+static const char *dllog_block_data(const struct dllog_reader *log,
+				    uint64_t block, char *buf,
+				    uint32_t *p_used)
+{
+	const struct dllog_block *hdr;
+	const unsigned char *zdata;
+
+	if (log->compressed) {
+		if (!dllog_zblock_valid(log, log->offsets[block]))
+			return NULL;
+		hdr = (const struct dllog_block *) (log->map +
+						    log->offsets[block]);
+		zdata = (const unsigned char *) (hdr + 1);
+		if (hdr->csize == hdr->used)
+			memcpy(buf, zdata, hdr->used);
+		else if (lz_decompress(zdata, hdr->csize, (unsigned char *) buf,
+				       hdr->used) != hdr->used)
+			return NULL;
+		dllog_delta(buf, buf, hdr->used);
+		*p_used = hdr->used;
+		return buf;
+	}
+
+	if (block >= (log->size - DLLOG_HEADER_SIZE) / DLLOG_BLOCK_SIZE)
+		return NULL;
+	hdr = (const struct dllog_block *) (log->map + DLLOG_HEADER_SIZE +
+					    block * DLLOG_BLOCK_SIZE);
+	if (hdr->magic != DLLOG_BLOCK_MAGIC ||
+	    hdr->used > DLLOG_BLOCK_SIZE - sizeof(*hdr))
+		return NULL;
+	*p_used = hdr->used;
+	return (const char *) (hdr + 1);
+}
+
+/* First block which can hold records at or after ts. */
+static uint64_t dllog_seek(const struct dllog_reader *log, uint64_t ts)
+{
+	uint64_t lo = 0;
+	uint64_t hi = log->block_count;
+	uint64_t mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (dllog_index(log, mid)->last_ts < ts)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static int index_map_init_log(struct dl *dl, const struct dllog_header *header)
+{
+	struct index_map *index_map;
+	char name[DLLOG_DEV_NAME_LEN + 1];
+	uint32_t i;
+
+	for (i = 0; i < header->dev_count; i++) {
+		mystrlcpy(name, header->devs[i].name, sizeof(name));
+		index_map = index_map_alloc(header->devs[i].index, name);
+		if (!index_map)
+			return -ENOMEM;
+		list_add_tail(&dl->index_map_list, &index_map->list);
+	}
+	return 0;
+}
+
+/* Accepts seconds since the epoch or local YYYY-MM-DDTHH:MM:SS, both
+ * optionally followed by a fraction.
+ */
+static int dl_argv_time(struct dl *dl, uint64_t *p_ts)
+{
+	const char *str = dl_argv_next(dl);
+	struct tm tm = {};
+	double frac = 0;
+	char *end;
+	time_t sec;
+
+	if (!str) {
+		pr_err("Time expected\n");
+		return -EINVAL;
+	}
+	end = strptime(str, "%Y-%m-%dT%H:%M:%S", &tm);
+	if (end) {
+		tm.tm_isdst = -1;
+		sec = mktime(&tm);
+	} else {
+		sec = strtoll(str, &end, 10);
+	}
+	if (*end == '.')
+		frac = strtod(end, &end);
+	if (end == str || *end || sec < 0) {
+		pr_err("Invalid time \"%s\"\n", str);
+		return -EINVAL;
+	}
+	*p_ts = sec * 1000000000ULL + (uint64_t) (frac * 1000000000 + 0.5);
+	return 0;
+}
+
+static void log_rec_show(struct dl *dl, const struct dllog_rec *rec)
+{
+	const struct nlmsghdr *nlh = (const struct nlmsghdr *) (rec + 1);
+	struct nlattr *tb[DEVLINK_ATTR_MAX + 1] = {};
+	struct genlmsghdr *genl;
+	struct timespec ts = {
+		.tv_sec = rec->ts / 1000000000,
+		.tv_nsec = rec->ts % 1000000000,
+	};
+
+	if (rec->len < NLMSG_HDRLEN + GENL_HDRLEN || nlh->nlmsg_len != rec->len)
+		return;
+	genl = mnl_nlmsg_get_payload(nlh);
+
+	/* Keeps names of devices which showed up after the log started. */
+	switch (genl->cmd) {
+	case DEVLINK_CMD_NEW: /* fall through */
+	case DEVLINK_CMD_DEL:
+		mnl_attr_parse(nlh, sizeof(*genl), devlink_attr_cb, tb);
+		if (tb[DEVLINK_ATTR_INDEX] && tb[DEVLINK_ATTR_NAME])
+			index_map_update(dl, genl->cmd,
+					 mnl_attr_get_u32(tb[DEVLINK_ATTR_INDEX]),
+					 mnl_attr_get_str(tb[DEVLINK_ATTR_NAME]));
+		break;
+	}
+
+	dl->ts = &ts;
+	cmd_mon_show_cb(nlh, dl);
+	dl->ts = NULL;
+}
+
+static void cmd_log_help(void)
+{
+	pr_out("Usage: dl log query FILE [ --from TIME ] [ --to TIME ] [ --dev DEV ]\n"
+	       "where  TIME := { SECONDS[.FRACTION] | YYYY-MM-DDTHH:MM:SS[.FRACTION] }\n");
+}
+
+static int cmd_log_query(struct dl *dl)
+{
+	struct dllog_reader log = {};
+	const struct dllog_block *hdr;
+	const struct dllog_rec *rec;
+	const char *dev_name = NULL;
+	uint64_t to = UINT64_MAX;
+	uint64_t from = 0;
+	const char *file;
+	const char *data;
+	char *buf = NULL;
+	uint32_t index = 0;
+	uint32_t used;
+	uint64_t i;
+	int err;
+
+	file = dl_argv_next(dl);
+	if (!file) {
+		pr_err("File name expected\n");
+		return -EINVAL;
+	}
+	while (dl_argc(dl)) {
+		if (dl_argv_match(dl, "--from")) {
+			dl_arg_inc(dl);
+			err = dl_argv_time(dl, &from);
+			if (err)
+				return err;
+		} else if (dl_argv_match(dl, "--to")) {
+			dl_arg_inc(dl);
+			err = dl_argv_time(dl, &to);
+			if (err)
+				return err;
+		} else if (dl_argv_match(dl, "--dev")) {
+			dl_arg_inc(dl);
+			dev_name = dl_argv_next(dl);
+			if (!dev_name) {
+				pr_err("Device name expected\n");
+				return -EINVAL;
+			}
+		} else {
+			pr_err("Unknown option \"%s\"\n", dl_argv(dl));
+			return -EINVAL;
+		}
+	}
+
+	err = dllog_map(file, &log);
+	if (err) {
+		pr_err("Failed to map log \"%s\"\n", file);
+		return err;
+	}
+	err = index_map_init_log(dl, log.header);
+	if (err)
+		goto out;
+	buf = malloc(DLLOG_BLOCK_SIZE);
+	if (!buf) {
+		err = -ENOMEM;
+		goto out;
+	}
+	if (dev_name) {
+		err = index_map_get_index(dl, dev_name);
+		if (err < 0) {
+			pr_err("Device \"%s\" not found in log\n", dev_name);
+			goto out;
+		}
+		index = err;
+		err = 0;
+	}
+
+	for (i = dllog_seek(&log, from); i < log.block_count; i++) {
+		hdr = dllog_index(&log, i);
+		if (hdr->first_ts > to)
+			break;
+		if (dev_name && !dllog_bitmap_test(hdr->dev_bitmap, index))
+			continue;
+		data = dllog_block_data(&log, i, buf, &used);
+		if (!data)
+			continue;
+		dllog_for_each_rec(rec, data, used) {
+			if (rec->ts < from || rec->ts > to)
+				continue;
+			if (dev_name && rec->dev != index)
+				continue;
+			log_rec_show(dl, rec);
+		}
+	}
+
+out:
+	free(buf);
+	dllog_unmap(&log);
+	return err;
+}
+
+static int cmd_log(struct dl *dl)
+{
+	if (dl_argv_match(dl, "help") || dl_no_arg(dl)) {
+		cmd_log_help();
+		return 0;
+	} else if (dl_argv_match(dl, "query")) {
+		dl_arg_inc(dl);
+		return cmd_log_query(dl);
+	}
+	pr_err("Command \"%s\" not found\n", dl_argv(dl));
+	return -ENOENT;
+}
+
+#define ANALYZE_DEV_MAX 256
+#define ANALYZE_SIZE_BUCKETS 18	/* log2 of payload length, up to 64k */
+
+struct analyze_dev {
+	uint32_t index;
+	uint64_t msgs[2];	/* per direction */
+	uint64_t bytes;
+};
+
+/* Partial result of one thread, merged into the first one at the end. */
+struct analyze_stats {
+	uint64_t records;
+	uint64_t bytes;
+	uint64_t first_ts;
+	uint64_t last_ts;
+	uint64_t cmds[256];
+	uint64_t hwmsgs;
+	uint64_t hwmsg_invalid;
+	uint64_t types[HWMSG_TYPE_STATS];
+	uint64_t sizes[ANALYZE_SIZE_BUCKETS];
+	unsigned int dev_count;
+	struct analyze_dev devs[ANALYZE_DEV_MAX];
+};
+
+struct analyze_job {
+	pthread_t thread;
+	const struct dllog_reader *log;
+	uint64_t block_first;
+	uint64_t block_last;
+	struct analyze_stats stats;
+	char buf[DLLOG_BLOCK_SIZE];	/* for decoding compressed blocks */
+};
+
+static struct analyze_dev *analyze_dev_get(struct analyze_stats *stats,
+					   uint32_t index)
+{
+	struct analyze_dev *dev;
+	unsigned int i;
+
+	for (i = 0; i < stats->dev_count; i++)
+		if (stats->devs[i].index == index)
+			return &stats->devs[i];
+	if (stats->dev_count == ANALYZE_DEV_MAX)
+		return NULL;
+	dev = &stats->devs[stats->dev_count++];
+	memset(dev, 0, sizeof(*dev));
+	dev->index = index;
+	return dev;
+}
+
+static void analyze_hwmsg(struct analyze_stats *stats,
+			  const struct nlmsghdr *nlh)
+{
+	struct nlattr *tb[DEVLINK_ATTR_MAX + 1] = {};
+	struct genlmsghdr *genl = mnl_nlmsg_get_payload(nlh);
+	struct analyze_dev *dev;
+	uint16_t payload_len;
+	uint32_t type;
+	uint8_t dir;
+	int bucket;
+
+	stats->hwmsgs++;
+	mnl_attr_parse(nlh, sizeof(*genl), devlink_attr_cb, tb);
+	if (tb[DEVLINK_ATTR_HWMSG_TYPE]) {
+		type = mnl_attr_get_u32(tb[DEVLINK_ATTR_HWMSG_TYPE]);
+		stats->types[hwmsg_type_stat(type)]++;
+	}
+	if (!check_cmd_hwmsg_fields(tb)) {
+		stats->hwmsg_invalid++;
+		return;
+	}
+
+	dir = mnl_attr_get_u8(tb[DEVLINK_ATTR_HWMSG_DIR]);
+	payload_len = mnl_attr_get_payload_len(tb[DEVLINK_ATTR_HWMSG_PAYLOAD]);
+	bucket = payload_len ? 32 - __builtin_clz(payload_len) : 0;
+	stats->sizes[bucket]++;
+
+	dev = analyze_dev_get(stats, mnl_attr_get_u32(tb[DEVLINK_ATTR_INDEX]));
+	if (!dev)
+		return;
+	dev->msgs[dir == DEVLINK_HWMSG_DIR_FROM_HW]++;
+	dev->bytes += payload_len;
+}
+
+static void *analyze_worker(void *data)
+{
+	struct analyze_job *job = data;
+	struct analyze_stats *stats = &job->stats;
+	const struct dllog_rec *rec;
+	const struct nlmsghdr *nlh;
+	struct genlmsghdr *genl;
+	const char *blk;
+	uint32_t used;
+	uint64_t i;
+
+	stats->first_ts = UINT64_MAX;
+	for (i = job->block_first; i < job->block_last; i++) {
+		blk = dllog_block_data(job->log, i, job->buf, &used);
+		if (!blk)
+			continue;
+		dllog_for_each_rec(rec, blk, used) {
+			nlh = (const struct nlmsghdr *) (rec + 1);
+			if (rec->len < NLMSG_HDRLEN + GENL_HDRLEN ||
+			    nlh->nlmsg_len != rec->len)
+				continue;
+			stats->records++;
+			stats->bytes += rec->len;
+			if (rec->ts < stats->first_ts)
+				stats->first_ts = rec->ts;
+			if (rec->ts > stats->last_ts)
+				stats->last_ts = rec->ts;
+			genl = mnl_nlmsg_get_payload(nlh);
+			stats->cmds[genl->cmd]++;
+			if (genl->cmd == DEVLINK_CMD_HWMSG_NEW)
+				analyze_hwmsg(stats, nlh);
+		}
+	}
+	return NULL;
+}
+
+static void analyze_merge(struct analyze_stats *sum,
+			  const struct analyze_stats *stats)
+{
+	struct analyze_dev *dev;
+	unsigned int i;
+
+	sum->records += stats->records;
+	sum->bytes += stats->bytes;
+	if (stats->first_ts < sum->first_ts)
+		sum->first_ts = stats->first_ts;
+	if (stats->last_ts > sum->last_ts)
+		sum->last_ts = stats->last_ts;
+	for (i = 0; i < ARRAY_SIZE(sum->cmds); i++)
+		sum->cmds[i] += stats->cmds[i];
+	sum->hwmsgs += stats->hwmsgs;
+	sum->hwmsg_invalid += stats->hwmsg_invalid;
+	for (i = 0; i < HWMSG_TYPE_STATS; i++)
+		sum->types[i] += stats->types[i];
+	for (i = 0; i < ANALYZE_SIZE_BUCKETS; i++)
+		sum->sizes[i] += stats->sizes[i];
+	for (i = 0; i < stats->dev_count; i++) {
+		dev = analyze_dev_get(sum, stats->devs[i].index);
+		if (!dev)
+			continue;
+		dev->msgs[0] += stats->devs[i].msgs[0];
+		dev->msgs[1] += stats->devs[i].msgs[1];
+		dev->bytes += stats->devs[i].bytes;
+	}
+}
+
+static void pr_out_analyze(struct dl *dl, const struct analyze_stats *stats)
+{
+	unsigned int i;
+
+	pr_out("records %" PRIu64 " bytes %" PRIu64, stats->records,
+	       stats->bytes);
+	if (stats->records)
+		pr_out(" span %.3f s", (stats->last_ts - stats->first_ts) / 1e9);
+	pr_out("\n");
+
+	pr_out("commands:\n");
+	for (i = 0; i < ARRAY_SIZE(stats->cmds); i++)
+		if (stats->cmds[i])
+			pr_out("  %-14s %" PRIu64 "\n", cmd_name(i),
+			       stats->cmds[i]);
+
+	if (!stats->hwmsgs)
+		return;
+	pr_out("hwmsg: %" PRIu64 " invalid %" PRIu64 "\n", stats->hwmsgs,
+	       stats->hwmsg_invalid);
+	for (i = 0; i < HWMSG_TYPE_STATS; i++)
+		if (stats->types[i])
+			pr_out("  type %-14s %" PRIu64 "\n",
+			       hwmsg_type_stat_name(i), stats->types[i]);
+	for (i = 0; i < stats->dev_count; i++)
+		pr_out("  dev %-15s %s %" PRIu64 " %s %" PRIu64
+		       " payload %" PRIu64 " bytes\n",
+		       index_map_get_name(dl, stats->devs[i].index),
+		       hwmsg_dir_name(DEVLINK_HWMSG_DIR_TO_HW),
+		       stats->devs[i].msgs[0],
+		       hwmsg_dir_name(DEVLINK_HWMSG_DIR_FROM_HW),
+		       stats->devs[i].msgs[1], stats->devs[i].bytes);
+	pr_out("payload size:\n");
+	for (i = 0; i < ANALYZE_SIZE_BUCKETS; i++) {
+		if (!stats->sizes[i])
+			continue;
+		if (i == 0) {
+			pr_out("  %6u %8s %" PRIu64 "\n", 0, "",
+			       stats->sizes[i]);
+		} else {
+			pr_out("  %6u - %6u %" PRIu64 "\n", 1U << (i - 1),
+			       (1U << i) - 1, stats->sizes[i]);
+		}
+	}
+}
+
+static void cmd_analyze_help(void)
+{
+	pr_out("Usage: dl analyze FILE [ threads COUNT ]\n");
+}
+
+static int cmd_analyze(struct dl *dl)
+{
+	struct dllog_reader log = {};
+	struct analyze_job *jobs;
+	unsigned int threads;
+	unsigned int started;
+	const char *file;
+	uint64_t per_job;
+	uint64_t block;
+	uint32_t count;
+	unsigned int i;
+	long cpus;
+	int err;
+
+	if (dl_argv_match(dl, "help") || dl_no_arg(dl)) {
+		cmd_analyze_help();
+		return 0;
+	}
+	file = dl_argv_next(dl);
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	threads = cpus > 0 ? cpus : 1;
+	while (dl_argc(dl)) {
+		if (dl_argv_match(dl, "threads")) {
+			dl_arg_inc(dl);
+			err = dl_argv_uint32_t(dl, &count);
+			if (err)
+				return err;
+			threads = count ? count : 1;
+		} else {
+			pr_err("Unknown option \"%s\"\n", dl_argv(dl));
+			return -EINVAL;
+		}
+	}
+
+	err = dllog_map(file, &log);
+	if (err) {
+		pr_err("Failed to map log \"%s\"\n", file);
+		return err;
+	}
+	err = index_map_init_log(dl, log.header);
+	if (err)
+		goto err_index_map;
+	madvise((void *) log.map, log.size, MADV_SEQUENTIAL);
+
+	/* Blocks never split records, so they are the chunks. */
+	if (threads > log.block_count)
+		threads = log.block_count ? log.block_count : 1;
+	jobs = calloc(threads, sizeof(*jobs));
+	if (!jobs) {
+		err = -ENOMEM;
+		goto err_jobs_alloc;
+	}
+	per_job = log.block_count / threads;
+	for (i = 0, block = 0; i < threads; i++) {
+		jobs[i].log = &log;
+		jobs[i].block_first = block;
+		block += per_job + (i < log.block_count % threads);
+		jobs[i].block_last = block;
+	}
+
+	for (started = 1; started < threads; started++)
+		if (pthread_create(&jobs[started].thread, NULL,
+				   analyze_worker, &jobs[started]))
+			break;
+	/* Chunks which did not get a thread of their own are done here. */
+	analyze_worker(&jobs[0]);
+	for (i = started; i < threads; i++)
+		analyze_worker(&jobs[i]);
+	for (i = 1; i < threads; i++) {
+		if (i < started)
+			pthread_join(jobs[i].thread, NULL);
+		analyze_merge(&jobs[0].stats, &jobs[i].stats);
+	}
+	pr_out_analyze(dl, &jobs[0].stats);
+
+	free(jobs);
+err_jobs_alloc:
+err_index_map:
+	dllog_unmap(&log);
+	return err;
+}
+
+struct snap_ctx {
+	struct dl *dl;
+	uint32_t kind;		/* of the records being dumped */
+	struct dlsnap_rec *recs;
+	size_t count;
+	size_t alloc;
+};
+
+static int snap_cb(const struct nlmsghdr *nlh, void *data)
+{
+	struct nlattr *tb[DEVLINK_ATTR_MAX + 1] = {};
+	struct genlmsghdr *genl = mnl_nlmsg_get_payload(nlh);
+	struct snap_ctx *ctx = data;
+	struct dlsnap_rec *rec;
+	size_t alloc;
+
+	mnl_attr_parse(nlh, sizeof(*genl), devlink_attr_cb, tb);
+	if (!tb[DEVLINK_ATTR_INDEX])
+		return MNL_CB_ERROR;
+	if (ctx->kind == DLSNAP_REC_DEV && !tb[DEVLINK_ATTR_NAME])
+		return MNL_CB_ERROR;
+	if (ctx->kind == DLSNAP_REC_PORT && !tb[DEVLINK_ATTR_PORT_INDEX])
+		return MNL_CB_ERROR;
+
+	if (ctx->count == ctx->alloc) {
+		alloc = ctx->alloc ? ctx->alloc * 2 : 64;
+		rec = realloc(ctx->recs, alloc * sizeof(*rec));
+		if (!rec)
+			return MNL_CB_ERROR;
+		ctx->recs = rec;
+		ctx->alloc = alloc;
+	}
+	rec = &ctx->recs[ctx->count++];
+	memset(rec, 0, sizeof(*rec));
+	rec->index = mnl_attr_get_u32(tb[DEVLINK_ATTR_INDEX]);
+	rec->kind = ctx->kind;
+	if (ctx->kind == DLSNAP_REC_PORT)
+		rec->port_index = mnl_attr_get_u32(tb[DEVLINK_ATTR_PORT_INDEX]);
+	else
+		mystrlcpy(rec->name, mnl_attr_get_str(tb[DEVLINK_ATTR_NAME]),
+			  sizeof(rec->name));
+	rec->hash = dlsnap_hash((const char *) genl + GENL_HDRLEN,
+				mnl_nlmsg_get_payload_len(nlh) - GENL_HDRLEN);
+	return MNL_CB_OK;
+}
+
+static int snap_dump(struct snap_ctx *ctx, uint8_t cmd, uint32_t kind)
+{
+	struct mnlg_socket *nlg = ctx->dl->nlg;
+	struct nlmsghdr *nlh;
+	int err;
+
+	ctx->kind = kind;
+	nlh = mnlg_msg_prepare(nlg, cmd, NLM_F_REQUEST | NLM_F_DUMP);
+	err = _mnlg_socket_send(nlg, nlh);
+	if (err)
+		return err;
+	return _mnlg_socket_recv_run(nlg, snap_cb, ctx);
+}
+
+static int snap_rec_qsort_cmp(const void *a, const void *b)
+{
+	return dlsnap_rec_cmp(a, b);
+}
+
+/* Ports take the name of their device, which sorts right before them. */
+static void snap_port_names(struct snap_ctx *ctx)
+{
+	const struct dlsnap_rec *dev = NULL;
+	struct dlsnap_rec *rec;
+	size_t i;
+
+	for (i = 0; i < ctx->count; i++) {
+		rec = &ctx->recs[i];
+		if (rec->kind == DLSNAP_REC_DEV)
+			dev = rec;
+		else if (dev && dev->index == rec->index)
+			memcpy(rec->name, dev->name, sizeof(rec->name));
+		else
+			snprintf(rec->name, sizeof(rec->name), "<index %u>",
+				 rec->index);
+	}
+}
+
+/* The device dump is all the name lookup the ports need, dl_init() does
+ * not build the index map for snapshots.
+ */
+static int snap_take(struct snap_ctx *ctx)
+{
+	int err;
+
+	err = snap_dump(ctx, DEVLINK_CMD_GET, DLSNAP_REC_DEV);
+	if (err)
+		return err;
+	err = snap_dump(ctx, DEVLINK_CMD_PORT_GET, DLSNAP_REC_PORT);
+	if (err)
+		return err;
+	qsort(ctx->recs, ctx->count, sizeof(*ctx->recs), snap_rec_qsort_cmp);
+	snap_port_names(ctx);
+	return 0;
+}
+
+static void pr_out_snap_rec(const char *what, const struct dlsnap_rec *rec)
+{
+	out_str(what);
+	out_char(' ');
+	out_mem(rec->name, strnlen(rec->name, sizeof(rec->name)));
+	if (rec->kind == DLSNAP_REC_PORT) {
+		out_char('/');
+		out_u32(rec->port_index);
+	}
+	out_char('\n');
+	out_record_end();
+}
+
+/* Written next to the target and renamed over it, so that readers never
+ * see a partial snapshot.
+ */
+static int cmd_snapshot_save(struct dl *dl)
+{
+	struct dlsnap_header header = {
+		.magic = DLSNAP_MAGIC,
+		.version = DLSNAP_VERSION,
+		.rec_size = sizeof(struct dlsnap_rec),
+	};
+	struct snap_ctx ctx = {
+		.dl = dl,
+	};
+	char tmp[PATH_MAX];
+	struct timespec now;
+	const char *file;
+	int err;
+	int fd;
+
+	file = dl_argv_next(dl);
+	if (!file || dl_argc(dl)) {
+		pr_err("Snapshot file expected\n");
+		return -EINVAL;
+	}
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", file) >= sizeof(tmp))
+		return -ENAMETOOLONG;
+
+	err = snap_take(&ctx);
+	if (err)
+		goto out;
+	header.rec_count = ctx.count;
+	clock_gettime(CLOCK_REALTIME, &now);
+	header.time = timespec_ns(&now);
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		pr_err("Failed to create \"%s\"\n", tmp);
+		err = -errno;
+		goto out;
+	}
+	err = dllog_pwrite(fd, &header, sizeof(header), 0);
+	if (!err)
+		err = dllog_pwrite(fd, ctx.recs, ctx.count * sizeof(*ctx.recs),
+				   sizeof(header));
+	if (!err && fsync(fd) < 0)
+		err = -errno;
+	close(fd);
+	if (!err && rename(tmp, file) < 0)
+		err = -errno;
+	if (err) {
+		pr_err("Failed to write \"%s\"\n", file);
+		unlink(tmp);
+	}
+out:
+	free(ctx.recs);
+	return err;
+}
+
+/* Maps the snapshot and checks that its records can be merge-joined. */
+static int snap_map(const char *path, const struct dlsnap_header **p_header,
+		    size_t *p_size)
+{
+	const struct dlsnap_header *header;
+	const struct dlsnap_rec *recs;
+	const void *map;
+	struct stat st;
+	size_t count;
+	size_t i;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -errno;
+	}
+	if (st.st_size < sizeof(*header)) {
+		close(fd);
+		return -EPROTO;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -errno;
+
+	header = map;
+	recs = (const struct dlsnap_rec *) (header + 1);
+	count = header->rec_count;
+	if (header->magic != DLSNAP_MAGIC ||
+	    header->version != DLSNAP_VERSION ||
+	    header->rec_size != sizeof(*recs) ||
+	    header->rec_count > (st.st_size - sizeof(*header)) / sizeof(*recs))
+		goto err_proto;
+	for (i = 1; i < count; i++)
+		if (dlsnap_rec_cmp(&recs[i - 1], &recs[i]) >= 0)
+			goto err_proto;
+
+	*p_header = header;
+	*p_size = st.st_size;
+	return 0;
+
+err_proto:
+	munmap((void *) map, st.st_size);
+	return -EPROTO;
+}
+
+static int cmd_snapshot_diff(struct dl *dl)
+{
+	struct snap_ctx ctx = {
+		.dl = dl,
+	};
+	const struct dlsnap_header *header = NULL;
+	const struct dlsnap_rec *old;
+	const struct dlsnap_rec *new;
+	const char *file;
+	size_t old_count;
+	size_t size = 0;
+	size_t i = 0;
+	size_t j = 0;
+	int cmp;
+	int err;
+
+	file = dl_argv_next(dl);
+	if (!file || dl_argc(dl)) {
+		pr_err("Snapshot file expected\n");
+		return -EINVAL;
+	}
+	err = snap_map(file, &header, &size);
+	if (err) {
+		pr_err("Failed to read snapshot \"%s\"\n", file);
+		return err;
+	}
+	old = (const struct dlsnap_rec *) (header + 1);
+	old_count = header->rec_count;
+	err = snap_take(&ctx);
+	if (err)
+		goto out;
+
+	new = ctx.recs;
+	while (i < old_count || j < ctx.count) {
+		if (i == old_count)
+			cmp = 1;
+		else if (j == ctx.count)
+			cmp = -1;
+		else
+			cmp = dlsnap_rec_cmp(&old[i], &new[j]);
+		if (cmp < 0) {
+			pr_out_snap_rec("removed", &old[i++]);
+		} else if (cmp > 0) {
+			pr_out_snap_rec("added", &new[j++]);
+		} else {
+			if (old[i].hash != new[j].hash)
+				pr_out_snap_rec("changed", &new[j]);
+			i++;
+			j++;
+		}
+	}
+out:
+	free(ctx.recs);
+	munmap((void *) header, size);
+	return err;
+}
+
+static const struct dl_cmd snapshot_cmds[] = {
+	DL_CMD("help", NULL, DL_CMD_DEFAULT, NULL),
+	/* Every run would write the same FILE.tmp. */
+	DL_CMD("save", cmd_snapshot_save,
+	       DL_CMD_NO_INDEX_MAP | DL_CMD_NO_NETNS, "FILE"),
+	DL_CMD("diff", cmd_snapshot_diff, DL_CMD_NO_INDEX_MAP, "FILE"),
+};
+
+static const struct dl_cmd_table snapshot_table = {
+	.prefix = "dl snapshot",
+	.what = "Command",
+	.cmds = snapshot_cmds,
+	.count = ARRAY_SIZE(snapshot_cmds),
+};
+
+struct dl_daemon {
+	struct dlcache_shm *shm;
+	struct dlcache_shm *target;
+	const char *shm_name;
+	mnl_cb_t cb;		/* gets the daemon, for the dumps */
+};
+
+static void dlcache_write_begin(struct dlcache_shm *shm)
+{
+	__atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void dlcache_write_end(struct dlcache_shm *shm)
+{
+	shm->generation++;
+	__atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELEASE);
+}
+
+static struct dlcache_dev *dlcache_dev_find(struct dlcache_shm *shm,
+					    uint32_t index)
+{
+	unsigned int i;
+
+	for (i = 0; i < shm->dev_count; i++)
+		if (shm->devs[i].index == index)
+			return &shm->devs[i];
+	return NULL;
+}
+
+static struct dlcache_port *dlcache_port_find(struct dlcache_shm *shm,
+					      uint32_t index,
+					      uint32_t port_index)
+{
+	unsigned int i;
+
+	for (i = 0; i < shm->port_count; i++)
+		if (shm->ports[i].index == index &&
+		    shm->ports[i].port_index == port_index)
+			return &shm->ports[i];
+	return NULL;
+}
+
+static void dlcache_port_remove(struct dlcache_shm *shm,
+				struct dlcache_port *port)
+{
+	struct dlcache_port *last = &shm->ports[shm->port_count - 1];
+
+	if (port != last)
+		memcpy(port, last, sizeof(*port));
+	shm->port_count--;
+}
+
+static void dlcache_dev_remove(struct dlcache_shm *shm,
+			       struct dlcache_dev *dev)
+{
+	struct dlcache_dev *last = &shm->devs[shm->dev_count - 1];
+	unsigned int i = 0;
+
+	while (i < shm->port_count) {
+		if (shm->ports[i].index == dev->index)
+			dlcache_port_remove(shm, &shm->ports[i]);
+		else
+			i++;
+	}
+	if (dev != last)
+		memcpy(dev, last, sizeof(*dev));
+	shm->dev_count--;
+}
+
+static void dlcache_dev_fill(struct dlcache_dev *dev, struct nlattr **tb)
+{
+	memset(dev, 0, sizeof(*dev));
+	dev->index = mnl_attr_get_u32(tb[DEVLINK_ATTR_INDEX]);
+	mystrlcpy(dev->name, mnl_attr_get_str(tb[DEVLINK_ATTR_NAME]),
+		  sizeof(dev->name));
+	if (tb[DEVLINK_ATTR_BUS_NAME])
+		mystrlcpy(dev->bus_name,
+			  mnl_attr_get_str(tb[DEVLINK_ATTR_BUS_NAME]),
+			  sizeof(dev->bus_name));
+	if (tb[DEVLINK_ATTR_DEV_NAME])
+		mystrlcpy(dev->dev_name,
+			  mnl_attr_get_str(tb[DEVLINK_ATTR_DEV_NAME]),
+			  sizeof(dev->dev_name));
+}
+
+static void dlcache_port_fill(struct dlcache_port *port, struct nlattr **tb)
+{
+	memset(port, 0, sizeof(*port));
+	port->index = mnl_attr_get_u32(tb[DEVLINK_ATTR_INDEX]);
+	port->port_index = mnl_attr_get_u32(tb[DEVLINK_ATTR_PORT_INDEX]);
+	if (tb[DEVLINK_ATTR_PORT_TYPE]) {
+		port->type = mnl_attr_get_u16(tb[DEVLINK_ATTR_PORT_TYPE]);
+		port->flags |= DLCACHE_PORT_F_TYPE;
+	}
+	if (tb[DEVLINK_ATTR_PORT_DESIRED_TYPE]) {
+		port->desired_type =
+			mnl_attr_get_u16(tb[DEVLINK_ATTR_PORT_DESIRED_TYPE]);
+		port->flags |= DLCACHE_PORT_F_DESIRED_TYPE;
+	}
+	if (tb[DEVLINK_ATTR_PORT_NETDEV_IFINDEX]) {
+		port->netdev_ifindex =
+			mnl_attr_get_u32(tb[DEVLINK_ATTR_PORT_NETDEV_IFINDEX]);
+		port->flags |= DLCACHE_PORT_F_NETDEV_IFINDEX;
+	}
+	if (tb[DEVLINK_ATTR_PORT_NETDEV_NAME])
+		mystrlcpy(port->netdev_name,
+			  mnl_attr_get_str(tb[DEVLINK_ATTR_PORT_NETDEV_NAME]),
+			  sizeof(port->netdev_name));
+	if (tb[DEVLINK_ATTR_PORT_IBDEV_NAME])
+		mystrlcpy(port->ibdev_name,
+			  mnl_attr_get_str(tb[DEVLINK_ATTR_PORT_IBDEV_NAME]),
+			  sizeof(port->ibdev_name));
+}
+
+static void dlcache_dev_update(struct dlcache_shm *shm, uint8_t cmd,
+			       struct nlattr **tb)
+{
+	uint32_t index = mnl_attr_get_u32(tb[DEVLINK_ATTR_INDEX]);
+	struct dlcache_dev *dev = dlcache_dev_find(shm, index);
+	bool new = false;
+
+	if (cmd == DEVLINK_CMD_DEL) {
+		if (!dev)
+			return;
+		dlcache_write_begin(shm);
+		dlcache_dev_remove(shm, dev);
+		dlcache_write_end(shm);
+		return;
+	}
+	if (!dev) {
+		if (shm->dev_count == DLCACHE_DEV_MAX) {
+			pr_err("Cache is full, device %d not stored\n", index);
+			return;
+		}
+		dev = &shm->devs[shm->dev_count];
+		new = true;
+	}
+	dlcache_write_begin(shm);
+	dlcache_dev_fill(dev, tb);
+	if (new)
+		shm->dev_count++;
+	dlcache_write_end(shm);
+}
+
+static void dlcache_port_update(struct dlcache_shm *shm, uint8_t cmd,
+				struct nlattr **tb)
+{
+	uint32_t index = mnl_attr_get_u32(tb[DEVLINK_ATTR_INDEX]);
+	uint32_t port_index = mnl_attr_get_u32(tb[DEVLINK_ATTR_PORT_INDEX]);
+	struct dlcache_port *port = dlcache_port_find(shm, index, port_index);
+	bool new = false;
+
+	if (cmd == DEVLINK_CMD_PORT_DEL) {
+		if (!port)
+			return;
+		dlcache_write_begin(shm);
+		dlcache_port_remove(shm, port);
+		dlcache_write_end(shm);
+		return;
+	}
+	if (!port) {
+		if (shm->port_count == DLCACHE_PORT_MAX) {
+			pr_err("Cache is full, port %d/%d not stored\n",
+			       index, port_index);
+			return;
+		}
+		port = &shm->ports[shm->port_count];
+		new = true;
+	}
+	dlcache_write_begin(shm);
+	dlcache_port_fill(port, tb);
+	if (new)
+		shm->port_count++;
+	dlcache_write_end(shm);
+}
+
+static int cmd_daemon_cb(const struct nlmsghdr *nlh, void *data)
+{
+	struct dl_daemon *daemon = data;
+	struct nlattr *tb[DEVLINK_ATTR_MAX + 1] = {};
+	struct genlmsghdr *genl = mnl_nlmsg_get_payload(nlh);
+	uint8_t cmd = genl->cmd;
+
+	switch (cmd) {
+	case DEVLINK_CMD_GET: /* fall through */
+	case DEVLINK_CMD_SET: /* fall through */
+	case DEVLINK_CMD_NEW: /* fall through */
+	case DEVLINK_CMD_DEL:
+		mnl_attr_parse(nlh, sizeof(*genl), devlink_attr_cb, tb);
+		if (!tb[DEVLINK_ATTR_INDEX] || !tb[DEVLINK_ATTR_NAME])
+			return MNL_CB_ERROR;
+		dlcache_dev_update(daemon->target, cmd, tb);
+		break;
+	case DEVLINK_CMD_PORT_GET: /* fall through */
+	case DEVLINK_CMD_PORT_SET: /* fall through */
+	case DEVLINK_CMD_PORT_NEW: /* fall through */
+	case DEVLINK_CMD_PORT_DEL:
+		mnl_attr_parse(nlh, sizeof(*genl), devlink_attr_cb, tb);
+		if (!tb[DEVLINK_ATTR_INDEX] || !tb[DEVLINK_ATTR_PORT_INDEX])
+			return MNL_CB_ERROR;
+		dlcache_port_update(daemon->target, cmd, tb);
+		break;
+	}
+	return MNL_CB_OK;
+}
+
+static int daemon_dump(struct dl *dl, struct dl_daemon *daemon, uint8_t cmd)
+{
+	struct nlmsghdr *nlh;
+	int err;
+
+	nlh = mnlg_msg_prepare(dl->nlg, cmd,
+			       NLM_F_REQUEST | NLM_F_DUMP);
+	err = _mnlg_socket_send(dl->nlg, nlh);
+	if (err)
+		return err;
+	return _mnlg_socket_recv_run(dl->nlg, daemon->cb, daemon);
+}
+
+/* Dump into a private copy first so readers never see a partial table. */
+static int daemon_seed(struct dl *dl, struct dl_daemon *daemon)
+{
+	struct dlcache_shm *shadow;
+	struct dlcache_shm *shm = daemon->shm;
+	int err;
+
+	shadow = myzalloc(sizeof(*shadow));
+	if (!shadow)
+		return -ENOMEM;
+	daemon->target = shadow;
+
+	err = daemon_dump(dl, daemon, DEVLINK_CMD_GET);
+	if (err)
+		goto out;
+	err = daemon_dump(dl, daemon, DEVLINK_CMD_PORT_GET);
+	if (err)
+		goto out;
+
+	dlcache_write_begin(shm);
+	memcpy(shm->devs, shadow->devs,
+	       shadow->dev_count * sizeof(shadow->devs[0]));
+	memcpy(shm->ports, shadow->ports,
+	       shadow->port_count * sizeof(shadow->ports[0]));
+	shm->dev_count = shadow->dev_count;
+	shm->port_count = shadow->port_count;
+	dlcache_write_end(shm);
+
+out:
+	daemon->target = shm;
+	free(shadow);
+	return err;
+}
+
+/* Returns the daemon recorded in the segment at name, 0 if there is none.
+ * The magic is not checked, a daemon still seeding owns the name too.
+ */
+static pid_t daemon_shm_pid(const char *name)
+{
+	struct dlcache_shm *shm;
+	struct stat st;
+	pid_t pid = 0;
+	int fd;
+
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0)
+		return 0;
+	if (fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(*shm)) {
+		shm = mmap(NULL, sizeof(*shm), PROT_READ, MAP_SHARED, fd, 0);
+		if (shm != MAP_FAILED) {
+			pid = shm->pid;
+			munmap(shm, sizeof(*shm));
+		}
+	}
+	close(fd);
+	return pid;
+}
+
+static struct dlcache_shm *daemon_shm_create(const char *name)
+{
+	struct dlcache_shm *shm;
+	pid_t pid;
+	int fd;
+
+	/* A running daemon keeps its name, one left by a dead daemon is
+	 * removed rather than reused.
+	 */
+	pid = daemon_shm_pid(name);
+	if (pid && (kill(pid, 0) == 0 || errno == EPERM)) {
+		errno = EEXIST;
+		return NULL;
+	}
+	shm_unlink(name);
+	fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+	if (fd < 0)
+		return NULL;
+	if (ftruncate(fd, sizeof(*shm)) < 0) {
+		close(fd);
+		return NULL;
+	}
+	shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE,
+		   MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED)
+		return NULL;
+
+	/* Readers refuse to map the region until the magic is in place. */
+	__atomic_store_n(&shm->magic, 0, __ATOMIC_RELEASE);
+	dlcache_write_begin(shm);
+	shm->dev_count = 0;
+	shm->port_count = 0;
+	dlcache_write_end(shm);
+	shm->version = DLCACHE_VERSION;
+	shm->pid = getpid();
+	shm->dev_max = DLCACHE_DEV_MAX;
+	shm->port_max = DLCACHE_PORT_MAX;
+	return shm;
+}
+
+static void cmd_daemon_help() {
+	pr_out("Usage: dl daemon [ shm NAME ]\n");
+}
+
+static int cmd_daemon(struct dl *dl)
+{
+	struct dl_daemon daemon = {
+		.shm_name = DLCACHE_DEFAULT_NAME,
+		.cb = cmd_daemon_cb,
+	};
+	struct sigaction sa = {
+		.sa_handler = stop_sig_handler,
+	};
+	int err;
+
+	if (dl_server_refuse(dl))
+		return -EOPNOTSUPP;
+
+	while (dl_argc(dl)) {
+		if (dl_argv_match(dl, "help")) {
+			cmd_daemon_help();
+			return 0;
+		} else if (dl_argv_match(dl, "shm")) {
+			dl_arg_inc(dl);
+			daemon.shm_name = dl_argv_next(dl);
+			if (!daemon.shm_name) {
+				pr_err("Shared memory name expected\n");
+				return -EINVAL;
+			}
+		} else {
+			pr_err("Unknown option \"%s\"\n", dl_argv(dl));
+			return -EINVAL;
+		}
+	}
+
+	daemon.shm = daemon_shm_create(daemon.shm_name);
+	if (!daemon.shm) {
+		err = -errno;
+		if (err == -EEXIST)
+			pr_err("Shared memory \"%s\" is served by a running daemon\n",
+			       daemon.shm_name);
+		else
+			pr_err("Failed to create shared memory \"%s\"\n",
+			       daemon.shm_name);
+		return err;
+	}
+
+	/* No SA_RESTART, a signal has to interrupt the blocking receive. */
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	/* Join before the dump so that no change is missed in between. */
+	err = _mnlg_socket_group_add(dl->nlg, DEVLINK_GENL_MCGRP_CONFIG_NAME);
+	if (err)
+		goto out;
+
+	while (!g_stop) {
+		err = daemon_seed(dl, &daemon);
+		if (err == -ENOBUFS)
+			continue;
+		if (err)
+			break;
+		__atomic_store_n(&daemon.shm->magic, DLCACHE_MAGIC,
+				 __ATOMIC_RELEASE);
+
+		err = mnlg_socket_recv_run(dl->nlg, cmd_daemon_cb, &daemon);
+		if (err >= 0)
+			break;
+		if (errno == ENOBUFS) {
+			pr_err("Notifications were lost, resynchronizing\n");
+			continue;
+		}
+		if (errno != EINTR) {
+			pr_err("Failed to call mnlg_socket_recv_run\n");
+			err = -errno;
+			break;
+		}
+	}
+	if (g_stop)
+		err = 0;
+
+out:
+	/* Leave the name alone if it was handed to another daemon. */
+	if (daemon_shm_pid(daemon.shm_name) == getpid())
+		shm_unlink(daemon.shm_name);
+	munmap(daemon.shm, sizeof(*daemon.shm));
+	return err;
+}
+
+#define SERVER_LINE_MAX 4096
+#define SERVER_ARGS_MAX 64
+#define SERVER_ACCEPT_RETRY_MS 100
+
+/*
+ * Protocol of "dl server": a client writes one command per line, exactly
+ * as it would be passed to dl on the command line. The server streams
+ * back whatever the command prints, both stdout and stderr, followed by
+ * a trailer made of a NUL byte, the errno value and a newline.
+ *
+ * Commands print into a memfd which is then queued on the client, whose
+ * socket is non-blocking. A client that does not read stalls only itself:
+ * its next commands are not read until its queued output is written.
+ */
+
+struct server_client {
+	struct list_item list;
+	int fd;
+	size_t len;
+	char buf[SERVER_LINE_MAX];
+	char *out;		/* not yet written to fd */
+	size_t out_len;
+	size_t out_off;
+	bool closing;		/* close once out is written */
+};
+
+struct dl_server {
+	struct dl *dl;
+	struct mnlg_socket *notify_nlg;
+	int listen_fd;
+	int out_fd;		/* memfd the commands print to */
+	bool accept_paused;	/* out of fds or memory, retry later */
+	struct list_item client_list;
+	unsigned int client_count;
+};
+
+static int dl_cmd(struct dl *dl);
+
+/* Splits line in place into whitespace separated, optionally quoted words. */
+static int makeargs(char *line, char **argv, int maxargs)
+{
+	int argc = 0;
+	char *dst;
+	char quote;
+
+	while (*line) {
+		while (*line == ' ' || *line == '\t')
+			line++;
+		if (!*line)
+			break;
+		if (argc == maxargs)
+			return -E2BIG;
+		argv[argc++] = dst = line;
+		quote = 0;
+		while (*line) {
+			if (quote && *line == quote) {
+				quote = 0;
+			} else if (!quote && (*line == '"' || *line == '\'')) {
+				quote = *line;
+			} else if (!quote && (*line == ' ' || *line == '\t')) {
+				line++;
+				break;
+			} else {
+				*dst++ = *line;
+			}
+			line++;
+		}
+		if (quote)
+			return -EINVAL;
+		*dst = '\0';
+	}
+	return argc;
+}
+
+static int server_notify_cb(const struct nlmsghdr *nlh, void *data)
+{
+	struct dl *dl = data;
+	struct nlattr *tb[DEVLINK_ATTR_MAX + 1] = {};
+	struct genlmsghdr *genl = mnl_nlmsg_get_payload(nlh);
+
+	switch (genl->cmd) {
+	case DEVLINK_CMD_SET: /* fall through */
+	case DEVLINK_CMD_NEW: /* fall through */
+	case DEVLINK_CMD_DEL:
+		mnl_attr_parse(nlh, sizeof(*genl), devlink_attr_cb, tb);
+		if (!tb[DEVLINK_ATTR_INDEX] || !tb[DEVLINK_ATTR_NAME])
+			return MNL_CB_ERROR;
+		if (index_map_update(dl, genl->cmd,
+				     mnl_attr_get_u32(tb[DEVLINK_ATTR_INDEX]),
+				     mnl_attr_get_str(tb[DEVLINK_ATTR_NAME])))
+			return MNL_CB_ERROR;
+		break;
+	case DEVLINK_CMD_PORT_SET: /* fall through */
+	case DEVLINK_CMD_PORT_NEW: /* fall through */
+	case DEVLINK_CMD_PORT_DEL:
+		break;
+	default:
+		return MNL_CB_OK;
+	}
+	if (dl->port_tbl && devlink_table_update(dl->port_tbl, nlh))
+		return MNL_CB_ERROR;
+	return MNL_CB_OK;
+}
+
+/* Keeps the device map warm from notifications instead of re-dumping. */
+static int server_notify_process(struct dl_server *server)
+{
+	struct dl *dl = server->dl;
+	int err;
+
+	err = mnlg_socket_recv_run(server->notify_nlg, server_notify_cb, dl);
+	if (err >= 0 || errno == EAGAIN)
+		return 0;
+	if (errno != ENOBUFS) {
+		pr_err("Failed to call mnlg_socket_recv_run\n");
+		return -errno;
+	}
+	pr_err("Notifications were lost, reloading device map\n");
+	port_tbl_fini(dl);
+	index_map_fini(dl);
+	return index_map_init(dl);
+}
+
+static void server_client_close(struct dl_server *server,
+				struct server_client *client)
+{
+	list_del(&client->list);
+	close(client->fd);
+	free(client->out);
+	free(client);
+	server->client_count--;
+}
+
+static int server_accept(struct dl_server *server)
+{
+	struct server_client *client;
+	int fd;
+
+	fd = accept4(server->listen_fd, NULL, NULL,
+		     SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (fd < 0) {
+		switch (errno) {
+		case EINTR: /* fall through */
+		case EAGAIN: /* fall through */
+		case ECONNABORTED:
+			return 0;
+		case EBADF: /* fall through */
+		case EINVAL: /* fall through */
+		case ENOTSOCK: /* fall through */
+		case EOPNOTSUPP:
+			/* The listening socket itself is broken. */
+			return -errno;
+		}
+		goto err_pause;
+	}
+	client = myzalloc(sizeof(*client));
+	if (!client) {
+		close(fd);
+		errno = ENOMEM;
+		goto err_pause;
+	}
+	client->fd = fd;
+	list_add_tail(&server->client_list, &client->list);
+	server->client_count++;
+	return 0;
+
+err_pause:
+	/* Out of fds or memory. Keep serving the clients we have and stop
+	 * polling the listener for a while instead of spinning on it.
+	 */
+	pr_err("Failed to accept a client (%s)\n", strerror(errno));
+	server->accept_paused = true;
+	return 0;
+}
+
+static int server_client_out(struct server_client *client,
+			     const char *buf, size_t len)
+{
+	char *out;
+
+	out = realloc(client->out, client->out_len + len);
+	if (!out)
+		return -ENOMEM;
+	memcpy(out + client->out_len, buf, len);
+	client->out = out;
+	client->out_len += len;
+	return 0;
+}
+
+/* Moves what the last command printed from the memfd to the client. */
+static int server_cmd_out(struct dl_server *server,
+			  struct server_client *client)
+{
+	size_t done = 0;
+	ssize_t len;
+	off_t size;
+	char *out;
+	int err = 0;
+
+	size = lseek(server->out_fd, 0, SEEK_CUR);
+	if (size <= 0)
+		return size < 0 ? -errno : 0;
+	out = realloc(client->out, client->out_len + size);
+	if (!out) {
+		err = -ENOMEM;
+		goto out;
+	}
+	client->out = out;
+	while (done < (size_t) size) {
+		len = pread(server->out_fd, out + client->out_len + done,
+			    size - done, done);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0) {
+			err = len < 0 ? -errno : -EIO;
+			break;
+		}
+		done += len;
+	}
+	client->out_len += done;
+out:
+	if (ftruncate(server->out_fd, 0) < 0 && !err)
+		err = -errno;
+	lseek(server->out_fd, 0, SEEK_SET);
+	return err;
+}
+
+/* Returns false if the output could not be queued. */
+static bool server_cmd_run(struct dl_server *server,
+			   struct server_client *client, char *line)
+{
+	struct dl *dl = server->dl;
+	int verbosity = g_verbosity;
+	char *argv[SERVER_ARGS_MAX];
+	char trailer[16];
+	int stdout_fd;
+	int stderr_fd;
+	char *arg;
+	int argc;
+	int err;
+
+	out_flush();
+	fflush(stderr);
+	stdout_fd = dup(STDOUT_FILENO);
+	stderr_fd = dup(STDERR_FILENO);
+	dup2(server->out_fd, STDOUT_FILENO);
+	dup2(server->out_fd, STDERR_FILENO);
+
+	argc = makeargs(line, argv, ARRAY_SIZE(argv));
+	if (argc < 0) {
+		pr_err("Failed to parse command line\n");
+		err = argc;
+		goto out;
+	}
+	dl->argc = argc;
+	dl->argv = argv;
+
+	/* Leading "-v" words raise verbosity for this command only. */
+	while ((arg = dl_argv(dl)) && arg[0] == '-' && arg[1] == 'v') {
+		for (arg++; *arg == 'v'; arg++)
+			g_verbosity++;
+		dl_arg_inc(dl);
+	}
+
+	err = dl_cmd(dl);
+	if (err)
+		pr_err("Command call failed (%s)\n", strerror(-err));
+
+out:
+	g_verbosity = verbosity;
+	out_flush();
+	fflush(stderr);
+	dup2(stdout_fd, STDOUT_FILENO);
+	dup2(stderr_fd, STDERR_FILENO);
+	close(stdout_fd);
+	close(stderr_fd);
+
+	if (server_cmd_out(server, client))
+		return false;
+	return !server_client_out(client, trailer,
+				  snprintf(trailer, sizeof(trailer), "%c%d\n",
+					   '\0', -err));
+}
+
+/* Returns false once the client is gone. */
+static bool server_client_process(struct dl_server *server,
+				  struct server_client *client)
+{
+	char msg[64];
+	char *line;
+	char *nl;
+	ssize_t len;
+
+	len = read(client->fd, client->buf + client->len,
+		   sizeof(client->buf) - client->len - 1);
+	if (len < 0 && (errno == EINTR || errno == EAGAIN))
+		return true;
+	if (len <= 0)
+		return false;
+	client->len += len;
+	client->buf[client->len] = '\0';
+
+	line = client->buf;
+	while ((nl = strchr(line, '\n'))) {
+		*nl = '\0';
+		if (!server_cmd_run(server, client, line))
+			return false;
+		line = nl + 1;
+	}
+	client->len -= line - client->buf;
+	if (client->len == sizeof(client->buf) - 1) {
+		client->closing = true;
+		return !server_client_out(client, msg,
+					  snprintf(msg, sizeof(msg),
+						   "Command line too long\n%c%d\n",
+						   '\0', E2BIG));
+	}
+	memmove(client->buf, line, client->len);
+	return true;
+}
+
+/* Writes as much queued output as the socket takes, returns false once
+ * the client is gone or done.
+ */
+static bool server_client_flush(struct server_client *client)
+{
+	ssize_t len;
+
+	while (client->out_off < client->out_len) {
+		len = write(client->fd, client->out + client->out_off,
+			    client->out_len - client->out_off);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN;
+		}
+		client->out_off += len;
+	}
+	free(client->out);
+	client->out = NULL;
+	client->out_len = client->out_off = 0;
+	return !client->closing;
+}
+
+static bool server_client_ready(struct dl_server *server,
+				struct server_client *client)
+{
+	if (!client->out_len && !server_client_process(server, client))
+		return false;
+	return server_client_flush(client);
+}
+
+static int server_listen(const char *path)
+{
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX,
+	};
+	struct stat st;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	/* Only a socket nobody answers on is stale, a live one is left to
+	 * its server and anything else makes bind() fail.
+	 */
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+		close(fd);
+		errno = EADDRINUSE;
+		return -1;
+	}
+	if (errno == ECONNREFUSED && !lstat(path, &st) && S_ISSOCK(st.st_mode))
+		unlink(path);
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+	    listen(fd, SOMAXCONN) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int server_loop(struct dl_server *server)
+{
+	struct server_client *client, *tmp;
+	struct pollfd *pfds = NULL;
+	unsigned int pfds_size = 0;
+	unsigned int i;
+	int err;
+
+	while (!g_stop) {
+		if (pfds_size < server->client_count + 2) {
+			pfds_size = server->client_count + 16;
+			free(pfds);
+			pfds = malloc(pfds_size * sizeof(*pfds));
+			if (!pfds)
+				return -ENOMEM;
+		}
+		pfds[0].fd = server->accept_paused ? -1 : server->listen_fd;
+		pfds[0].events = POLLIN;
+		pfds[1].fd = mnlg_socket_get_fd(server->notify_nlg);
+		pfds[1].events = POLLIN;
+		i = 2;
+		list_for_each_node_entry(client, &server->client_list, list) {
+			pfds[i].fd = client->fd;
+			/* Nothing new is read until the last output is out. */
+			pfds[i++].events = client->out_len ? POLLOUT : POLLIN;
+		}
+
+		if (poll(pfds, i, server->accept_paused ?
+				  SERVER_ACCEPT_RETRY_MS : -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			err = -errno;
+			goto out;
+		}
+		server->accept_paused = false;
+
+		/* Map updates go first so that queued commands see them. */
+		if (pfds[1].revents) {
+			err = server_notify_process(server);
+			if (err)
+				goto out;
+		}
+		i = 2;
+		list_for_each_node_entry_safe(client, tmp,
+					      &server->client_list, list) {
+			if (pfds[i++].revents &&
+			    !server_client_ready(server, client))
+				server_client_close(server, client);
+		}
+		if (pfds[0].revents) {
+			err = server_accept(server);
+			if (err)
+				goto out;
+		}
+	}
+	err = 0;
+out:
+	free(pfds);
+	return err;
+}
+
+static void cmd_server_help() {
+	pr_out("Usage: dl server --socket PATH\n");
+}
+
+static int cmd_server(struct dl *dl)
+{
+	struct dl_server server = {
+		.dl = dl,
+	};
+	const char *path = dl->socket_path;
+	struct server_client *client, *tmp;
+	struct sigaction sa = {
+		.sa_handler = stop_sig_handler,
+	};
+	int err;
+
+	if (dl_server_refuse(dl))
+		return -EOPNOTSUPP;
+	/* "dl --socket PATH server" still works, the global option is
+	 * mostly there for the client side.
+	 */
+	while (dl_argc(dl)) {
+		if (dl_argv_match(dl, "help")) {
+			cmd_server_help();
+			return 0;
+		} else if (dl_argv_match(dl, "--socket")) {
+			dl_arg_inc(dl);
+			path = dl_argv_next(dl);
+			if (!path) {
+				pr_err("Socket path expected\n");
+				return -EINVAL;
+			}
+		} else {
+			pr_err("Unknown option \"%s\"\n", dl_argv(dl));
+			return -EINVAL;
+		}
+	}
+	if (!path) {
+		cmd_server_help();
+		return -EINVAL;
+	}
+	list_init(&server.client_list);
+
+	server.notify_nlg = mnlg_socket_open(DEVLINK_GENL_NAME,
+					     DEVLINK_GENL_VERSION);
+	if (!server.notify_nlg) {
+		pr_err("Failed to connect to devlink Netlink\n");
+		return -errno;
+	}
+	err = _mnlg_socket_group_add(server.notify_nlg,
+				     DEVLINK_GENL_MCGRP_CONFIG_NAME);
+	if (err)
+		goto err_group_add;
+	fcntl(mnlg_socket_get_fd(server.notify_nlg), F_SETFL, O_NONBLOCK);
+
+	/* Pick up changes which happened before we joined the group. */
+	index_map_fini(dl);
+	err = index_map_init(dl);
+	if (err)
+		goto err_index_map_init;
+
+	server.out_fd = memfd_create("dl-server", MFD_CLOEXEC);
+	if (server.out_fd < 0) {
+		pr_err("Failed to create output buffer\n");
+		err = -errno;
+		goto err_out_fd;
+	}
+
+	server.listen_fd = server_listen(path);
+	if (server.listen_fd < 0) {
+		pr_err("Failed to listen on \"%s\"\n", path);
+		err = -errno;
+		goto err_listen;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	dl->server = true;
+	err = server_loop(&server);
+	dl->server = false;
+
+	list_for_each_node_entry_safe(client, tmp, &server.client_list, list)
+		server_client_close(&server, client);
+	close(server.listen_fd);
+	unlink(path);
+err_listen:
+	close(server.out_fd);
+err_out_fd:
+err_index_map_init:
+err_group_add:
+	mnlg_socket_close(server.notify_nlg);
+	return err;
+}
+
+#define EXPORTER_DIR_MAX 2
+#define EXPORTER_REQ_MAX 2048
+#define EXPORTER_TIMEOUT_MS 1000
+#define EXPORTER_BUF_SIZE (64 * 1024 + DLCACHE_DEV_MAX * 2048 + \
+			   DLCACHE_PORT_MAX * 256)
+
+/*
+ * "dl exporter" runs two threads. The netlink one owns dl->nlg and is the
+ * only writer of both the device cache, the same one "dl daemon" keeps
+ * under its sequence counter, and the hwmsg counters. The serving one
+ * only reads them. Counter slots are claimed once and never reused, so
+ * neither thread ever waits for the other.
+ */
+
+struct exporter_counters {
+	uint32_t index;
+	uint32_t used;		/* set once index is valid */
+	uint64_t msgs[HWMSG_TYPE_STATS][EXPORTER_DIR_MAX];
+	uint64_t bytes[HWMSG_TYPE_STATS][EXPORTER_DIR_MAX];
+};
+
+struct dl_exporter {
+	struct dl_daemon daemon;	/* first, the callbacks get it */
+	struct dl *dl;
+	int listen_fd;
+	int stop_fd[2];
+	int err;			/* of the netlink thread */
+	struct exporter_counters *last;
+	uint64_t dropped;
+	uint64_t resyncs;
+	struct exporter_counters counters[DLCACHE_DEV_MAX];
+	/* Serving thread only, all allocated up front. */
+	struct dlcache_dev devs[DLCACHE_DEV_MAX];
+	struct dlcache_port ports[DLCACHE_PORT_MAX];
+	char req[EXPORTER_REQ_MAX];
+	char *buf;
+	size_t len;
+	bool overflow;
+};
+
+static struct exporter_counters *
+exporter_counters_get(struct dl_exporter *exp, uint32_t index)
+{
+	struct exporter_counters *slot;
+	unsigned int i;
+
+	if (exp->last && exp->last->index == index)
+		return exp->last;
+	for (i = 0; i < ARRAY_SIZE(exp->counters); i++) {
+		slot = &exp->counters[i];
+		if (!slot->used) {
+			slot->index = index;
+			__atomic_store_n(&slot->used, 1, __ATOMIC_RELEASE);
+		}
+		if (slot->index == index) {
+			exp->last = slot;
+			return slot;
+		}
+	}
+	return NULL;
+}
+
+static void exporter_hwmsg(struct dl_exporter *exp,
+			   const struct nlmsghdr *nlh)
+{
+	struct nlattr *tb[DEVLINK_ATTR_MAX + 1] = {};
+	struct genlmsghdr *genl = mnl_nlmsg_get_payload(nlh);
+	struct exporter_counters *slot;
+	uint32_t type;
+	uint8_t dir;
+
+	mnl_attr_parse(nlh, sizeof(*genl), devlink_attr_cb, tb);
+	if (!check_cmd_hwmsg_fields(tb))
+		goto drop;
+	dir = mnl_attr_get_u8(tb[DEVLINK_ATTR_HWMSG_DIR]);
+	type = hwmsg_type_stat(mnl_attr_get_u32(tb[DEVLINK_ATTR_HWMSG_TYPE]));
+	slot = exporter_counters_get(exp,
+				     mnl_attr_get_u32(tb[DEVLINK_ATTR_INDEX]));
+	if (!slot)
+		goto drop;
+	__atomic_fetch_add(&slot->msgs[type][dir], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&slot->bytes[type][dir],
+			   mnl_attr_get_payload_len(tb[DEVLINK_ATTR_HWMSG_PAYLOAD]),
+			   __ATOMIC_RELAXED);
+	return;
+
+drop:
+	__atomic_fetch_add(&exp->dropped, 1, __ATOMIC_RELAXED);
+}
+
+static int exporter_cb(const struct nlmsghdr *nlh, void *data)
+{
+	struct genlmsghdr *genl = mnl_nlmsg_get_payload(nlh);
+
+	if (genl->cmd == DEVLINK_CMD_HWMSG_NEW) {
+		exporter_hwmsg(data, nlh);
+		return MNL_CB_OK;
+	}
+	return cmd_daemon_cb(nlh, data);
+}
+
+static void exporter_stop(struct dl_exporter *exp)
+{
+	/* Never read, it keeps both threads' poll() woken up. */
+	while (write(exp->stop_fd[1], "", 1) < 0 && errno == EINTR)
+		;
+}
+
+/* Dumps are read blocking, notifications are not. */
+static int exporter_seed(struct dl_exporter *exp)
+{
+	int fd = mnlg_socket_get_fd(exp->dl->nlg);
+	int flags = fcntl(fd, F_GETFL) & ~O_NONBLOCK;
+	int err;
+
+	fcntl(fd, F_SETFL, flags);
+	do {
+		err = daemon_seed(exp->dl, &exp->daemon);
+	} while (err == -ENOBUFS);
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+	return err;
+}
+
+static void *exporter_worker(void *data)
+{
+	struct dl_exporter *exp = data;
+	struct dl *dl = exp->dl;
+	struct pollfd pfds[2] = {
+		{ .fd = mnlg_socket_get_fd(dl->nlg), .events = POLLIN },
+		{ .fd = exp->stop_fd[0], .events = POLLIN },
+	};
+	int err = 0;
+
+	while (true) {
+		if (poll(pfds, ARRAY_SIZE(pfds), -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			err = -errno;
+			break;
+		}
+		if (pfds[1].revents)
+			break;
+		err = mnlg_socket_recv_run(dl->nlg, exporter_cb, exp);
+		if (err >= 0 || errno == EAGAIN || errno == EINTR) {
+			err = 0;
+			continue;
+		}
+		if (errno != ENOBUFS) {
+			pr_err("Failed to call mnlg_socket_recv_run\n");
+			err = -errno;
+			break;
+		}
+		/* Hwmsgs lost with the overrun stay uncounted. */
+		__atomic_fetch_add(&exp->resyncs, 1, __ATOMIC_RELAXED);
+		err = exporter_seed(exp);
+		if (err)
+			break;
+	}
+	exp->err = err;
+	exporter_stop(exp);
+	return NULL;
+}
+
+static void exporter_printf(struct dl_exporter *exp, const char *fmt, ...)
+{
+	size_t room = EXPORTER_BUF_SIZE - exp->len;
+	va_list ap;
+	int len;
+
+	if (exp->overflow)
+		return;
+	va_start(ap, fmt);
+	len = vsnprintf(exp->buf + exp->len, room, fmt, ap);
+	va_end(ap);
+	if (len < 0 || len >= room) {
+		exp->overflow = true;
+		return;
+	}
+	exp->len += len;
+}
+
+/* Label values have backslash, double quote and newline escaped. */
+static const char *exporter_label(char *buf, size_t size, const char *str)
+{
+	size_t i = 0;
+
+	for (; *str && i + 2 < size; str++) {
+		if (*str == '\\' || *str == '"' || *str == '\n') {
+			buf[i++] = '\\';
+			buf[i++] = *str == '\n' ? 'n' : *str;
+		} else {
+			buf[i++] = *str;
+		}
+	}
+	buf[i] = '\0';
+	return buf;
+}
+
+static void exporter_render_counters(struct dl_exporter *exp,
+				     const char *metric, bool bytes)
+{
+	struct exporter_counters *slot;
+	unsigned int i, type, dir;
+	uint64_t val;
+
+	exporter_printf(exp, "# TYPE devlink_hwmsg_%s counter\n", metric);
+	for (i = 0; i < ARRAY_SIZE(exp->counters); i++) {
+		slot = &exp->counters[i];
+		if (!__atomic_load_n(&slot->used, __ATOMIC_ACQUIRE))
+			break;
+		for (type = 0; type < HWMSG_TYPE_STATS; type++) {
+			for (dir = 0; dir < EXPORTER_DIR_MAX; dir++) {
+				val = __atomic_load_n(bytes ?
+						      &slot->bytes[type][dir] :
+						      &slot->msgs[type][dir],
+						      __ATOMIC_RELAXED);
+				if (!val)
+					continue;
+				exporter_printf(exp, "devlink_hwmsg_%s_total{index=\"%u\",type=\"%s\",dir=\"%s\"} %" PRIu64 "\n",
+						metric, slot->index,
+						hwmsg_type_stat_name(type),
+						hwmsg_dir_name(dir), val);
+			}
+		}
+	}
+}
+
+static void exporter_render(struct dl_exporter *exp)
+{
+	const struct dlcache_shm *cache = exp->daemon.shm;
+	char name[DLCACHE_NAME_LEN * 2];
+	char bus[DLCACHE_NAME_LEN * 2];
+	char dev[DLCACHE_NAME_LEN * 4];
+	struct dlcache_port *port;
+	int dev_count;
+	int port_count;
+	int i;
+
+	/* A cache stuck in an update renders as empty. */
+	dev_count = dlcache_devs_get(cache, exp->devs, ARRAY_SIZE(exp->devs));
+	if (dev_count < 0)
+		dev_count = 0;
+	port_count = dlcache_ports_get(cache, exp->ports,
+				       ARRAY_SIZE(exp->ports));
+	if (port_count < 0)
+		port_count = 0;
+	exp->len = 0;
+	exp->overflow = false;
+
+	exporter_printf(exp, "# TYPE devlink_devices gauge\n"
+			     "devlink_devices %d\n", dev_count);
+	exporter_printf(exp, "# TYPE devlink_dev info\n");
+	for (i = 0; i < dev_count; i++)
+		exporter_printf(exp, "devlink_dev_info{index=\"%u\",dev=\"%s\",bus=\"%s\",bus_dev=\"%s\"} 1\n",
+				exp->devs[i].index,
+				exporter_label(name, sizeof(name),
+					       exp->devs[i].name),
+				exporter_label(bus, sizeof(bus),
+					       exp->devs[i].bus_name),
+				exporter_label(dev, sizeof(dev),
+					       exp->devs[i].dev_name));
+
+	exporter_printf(exp, "# TYPE devlink_ports gauge\n"
+			     "devlink_ports %d\n", port_count);
+	exporter_printf(exp, "# TYPE devlink_port info\n");
+	for (i = 0; i < port_count; i++) {
+		port = &exp->ports[i];
+		exporter_printf(exp, "devlink_port_info{index=\"%u\",port=\"%u\"",
+				port->index, port->port_index);
+		if (port->flags & DLCACHE_PORT_F_TYPE)
+			exporter_printf(exp, ",type=\"%s\"",
+					devlink_port_type_name(port->type));
+		if (port->netdev_name[0])
+			exporter_printf(exp, ",netdev=\"%s\"",
+					exporter_label(name, sizeof(name),
+						       port->netdev_name));
+		if (port->ibdev_name[0])
+			exporter_printf(exp, ",ibdev=\"%s\"",
+					exporter_label(dev, sizeof(dev),
+						       port->ibdev_name));
+		exporter_printf(exp, "} 1\n");
+	}
+
+	exporter_render_counters(exp, "messages", false);
+	exporter_render_counters(exp, "bytes", true);
+	exporter_printf(exp, "# TYPE devlink_hwmsg_dropped counter\n"
+			     "devlink_hwmsg_dropped_total %" PRIu64 "\n",
+			__atomic_load_n(&exp->dropped, __ATOMIC_RELAXED));
+	exporter_printf(exp, "# TYPE devlink_exporter_resyncs counter\n"
+			     "devlink_exporter_resyncs_total %" PRIu64 "\n",
+			__atomic_load_n(&exp->resyncs, __ATOMIC_RELAXED));
+	exporter_printf(exp, "# EOF\n");
+}
+
+static void exporter_send(int fd, const char *head, size_t head_len,
+			  const char *body, size_t body_len)
+{
+	struct iovec iov[2] = {
+		{ .iov_base = (void *) head, .iov_len = head_len },
+		{ .iov_base = (void *) body, .iov_len = body_len },
+	};
+	struct iovec *vec = iov;
+	int count = ARRAY_SIZE(iov);
+	ssize_t len;
+
+	while (count) {
+		len = writev(fd, vec, count);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0)
+			return;
+		while (count && len >= vec->iov_len) {
+			len -= vec->iov_len;
+			vec++;
+			count--;
+		}
+		if (count) {
+			vec->iov_base = (char *) vec->iov_base + len;
+			vec->iov_len -= len;
+		}
+	}
+}
+
+static void exporter_client(struct dl_exporter *exp, int fd)
+{
+	static const char not_found[] =
+		"HTTP/1.1 404 Not Found\r\n"
+		"Content-Length: 0\r\n"
+		"Connection: close\r\n\r\n";
+	static const char unavailable[] =
+		"HTTP/1.1 503 Service Unavailable\r\n"
+		"Content-Length: 0\r\n"
+		"Connection: close\r\n\r\n";
+	struct timeval tv = {
+		.tv_sec = EXPORTER_TIMEOUT_MS / 1000,
+		.tv_usec = EXPORTER_TIMEOUT_MS % 1000 * 1000,
+	};
+	char head[256];
+	size_t len = 0;
+	ssize_t ret;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	while (len < sizeof(exp->req) - 1) {
+		ret = read(fd, exp->req + len, sizeof(exp->req) - 1 - len);
+		if (ret <= 0)
+			return;
+		len += ret;
+		exp->req[len] = '\0';
+		if (strstr(exp->req, "\r\n\r\n"))
+			break;
+	}
+
+	if (strncmp(exp->req, "GET /metrics ", 13) &&
+	    strncmp(exp->req, "GET / ", 6)) {
+		exporter_send(fd, not_found, sizeof(not_found) - 1, NULL, 0);
+		return;
+	}
+	exporter_render(exp);
+	if (exp->overflow) {
+		pr_err("Metrics do not fit the buffer\n");
+		exporter_send(fd, unavailable, sizeof(unavailable) - 1,
+			      NULL, 0);
+		return;
+	}
+	len = snprintf(head, sizeof(head),
+		       "HTTP/1.1 200 OK\r\n"
+		       "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+		       "Content-Length: %zu\r\n"
+		       "Connection: close\r\n\r\n", exp->len);
+	exporter_send(fd, head, len, exp->buf, exp->len);
+}
+
+static int exporter_listen(const char *addr)
+{
+	struct sockaddr_in sin = {
+		.sin_family = AF_INET,
+	};
+	char host[INET_ADDRSTRLEN];
+	const char *colon;
+	unsigned long port;
+	char *end;
+	int one = 1;
+	int fd;
+
+	if (strncmp(addr, "unix:", 5) == 0)
+		return server_listen(addr + 5);
+
+	colon = strrchr(addr, ':');
+	if (!colon || colon - addr >= sizeof(host))
+		goto err_inval;
+	memcpy(host, addr, colon - addr);
+	host[colon - addr] = '\0';
+	port = strtoul(colon + 1, &end, 10);
+	if (!colon[1] || *end || port > 65535 ||
+	    inet_pton(AF_INET, host, &sin.sin_addr) != 1)
+		goto err_inval;
+	/* Metrics are for local scrapers only. */
+	if (ntohl(sin.sin_addr.s_addr) >> 24 != IN_LOOPBACKNET) {
+		pr_err("Address %s is not a loopback address\n", host);
+		goto err_inval;
+	}
+	sin.sin_port = htons(port);
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(fd, (struct sockaddr *) &sin, sizeof(sin)) < 0 ||
+	    listen(fd, SOMAXCONN) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+
+err_inval:
+	errno = EINVAL;
+	return -1;
+}
+
+/* Scrapes are served one by one, each takes a single render. */
+static int exporter_loop(struct dl_exporter *exp)
+{
+	struct pollfd pfds[2] = {
+		{ .fd = exp->listen_fd, .events = POLLIN },
+		{ .fd = exp->stop_fd[0], .events = POLLIN },
+	};
+	int fd;
+
+	while (!g_stop) {
+		if (poll(pfds, ARRAY_SIZE(pfds), -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (pfds[1].revents)
+			break;
+		fd = accept4(exp->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR || errno == EAGAIN ||
+			    errno == ECONNABORTED)
+				continue;
+			return -errno;
+		}
+		exporter_client(exp, fd);
+		close(fd);
+	}
+	return 0;
+}
+
+static void cmd_exporter_help() {
+	pr_out("Usage: dl exporter --listen { unix:PATH | ADDR:PORT }\n"
+	       "where  ADDR := IPv4 address in 127.0.0.0/8\n");
+}
+
+static int cmd_exporter(struct dl *dl)
+{
+	struct dl_exporter *exp;
+	const char *addr = NULL;
+	struct sigaction sa = {
+		.sa_handler = stop_sig_handler,
+	};
+	pthread_t thread;
+	sigset_t mask;
+	sigset_t old;
+	int err;
+
+	if (dl_server_refuse(dl))
+		return -EOPNOTSUPP;
+
+	while (dl_argc(dl)) {
+		if (dl_argv_match(dl, "help")) {
+			cmd_exporter_help();
+			return 0;
+		} else if (dl_argv_match(dl, "--listen")) {
+			dl_arg_inc(dl);
+			addr = dl_argv_next(dl);
+			if (!addr) {
+				pr_err("Listen address expected\n");
+				return -EINVAL;
+			}
+		} else {
+			pr_err("Unknown option \"%s\"\n", dl_argv(dl));
+			return -EINVAL;
+		}
+	}
+	if (!addr) {
+		cmd_exporter_help();
+		return -EINVAL;
+	}
+	/* The netlink thread polls the socket fd, see mnlg.h. */
+	if (dl->uring) {
+		pr_err("exporter does not work with --uring\n");
+		return -EINVAL;
+	}
+
+	exp = myzalloc(sizeof(*exp));
+	if (!exp)
+		return -ENOMEM;
+	exp->dl = dl;
+	exp->daemon.cb = exporter_cb;
+	exp->daemon.shm = myzalloc(sizeof(*exp->daemon.shm));
+	exp->daemon.target = exp->daemon.shm;
+	exp->buf = malloc(EXPORTER_BUF_SIZE);
+	if (!exp->daemon.shm || !exp->buf) {
+		err = -ENOMEM;
+		goto err_alloc;
+	}
+	/* Fault the buffer in now rather than on the first scrape. */
+	memset(exp->buf, 0, EXPORTER_BUF_SIZE);
+	if (pipe2(exp->stop_fd, O_CLOEXEC)) {
+		err = -errno;
+		goto err_alloc;
+	}
+
+	/* Join before the dump so that no change is missed in between. */
+	err = _mnlg_socket_group_add(dl->nlg, DEVLINK_GENL_MCGRP_CONFIG_NAME);
+	if (err)
+		goto err_seed;
+	err = _mnlg_socket_group_add(dl->nlg, DEVLINK_GENL_MCGRP_HWMSG_NAME);
+	if (err)
+		goto err_seed;
+	err = exporter_seed(exp);
+	if (err)
+		goto err_seed;
+
+	exp->listen_fd = exporter_listen(addr);
+	if (exp->listen_fd < 0) {
+		pr_err("Failed to listen on \"%s\"\n", addr);
+		err = -errno;
+		goto err_seed;
+	}
+	fcntl(exp->listen_fd, F_SETFL, O_NONBLOCK);
+
+	signal(SIGPIPE, SIG_IGN);
+	/* No SA_RESTART, a signal has to interrupt the serving poll(). */
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	/* Keep the signals away from the netlink thread. */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &mask, &old);
+	err = -pthread_create(&thread, NULL, exporter_worker, exp);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err)
+		goto err_thread;
+
+	err = exporter_loop(exp);
+	exporter_stop(exp);
+	pthread_join(thread, NULL);
+	if (!err)
+		err = exp->err;
+
+err_thread:
+	close(exp->listen_fd);
+	if (strncmp(addr, "unix:", 5) == 0)
+		unlink(addr + 5);
+err_seed:
+	close(exp->stop_fd[0]);
+	close(exp->stop_fd[1]);
+err_alloc:
+	free(exp->buf);
+	free(exp->daemon.shm);
+	free(exp);
+	return err;
+}
+
+/* Runs the command on a "dl server" instead of talking to netlink. */
+static int dl_client(const char *path, int argc, char **argv)
+{
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX,
+	};
+	char line[SERVER_LINE_MAX];
+	char buf[SERVER_LINE_MAX];
+	char status[16];
+	size_t status_len = 0;
+	bool in_trailer = false;
+	size_t pos = 0;
+	ssize_t len;
+	char *trailer;
+	int fd;
+	int i;
+
+	if (g_verbosity > DEFAULT_VERB) {
+		line[pos++] = '-';
+		for (i = DEFAULT_VERB; i < g_verbosity && i < VERB4; i++)
+			line[pos++] = 'v';
+		line[pos++] = ' ';
+	}
+	for (i = 0; i < argc; i++) {
+		len = snprintf(line + pos, sizeof(line) - pos, "'%s' ",
+			       argv[i]);
+		if (len >= sizeof(line) - pos || strchr(argv[i], '\'')) {
+			pr_err("Command line cannot be passed to server\n");
+			return -EINVAL;
+		}
+		pos += len;
+	}
+	line[pos ? pos - 1 : pos++] = '\n';
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		pr_err("Socket path too long\n");
+		return -ENAMETOOLONG;
+	}
+	strcpy(addr.sun_path, path);
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		pr_err("Failed to connect to server \"%s\"\n", path);
+		goto err_close;
+	}
+	if (write(fd, line, pos) != pos) {
+		pr_err("Failed to send command to server\n");
+		goto err_close;
+	}
+
+	while ((len = read(fd, buf, sizeof(buf))) > 0) {
+		trailer = in_trailer ? buf : memchr(buf, '\0', len);
+		if (!trailer) {
+			fwrite(buf, 1, len, stdout);
+			continue;
+		}
+		if (!in_trailer) {
+			fwrite(buf, 1, trailer - buf, stdout);
+			in_trailer = true;
+			trailer++;
+		}
+		while (trailer < buf + len && *trailer != '\n' &&
+		       status_len < sizeof(status) - 1)
+			status[status_len++] = *trailer++;
+		if (trailer == buf + len)
+			continue;
+		status[status_len] = '\0';
+		close(fd);
+		/* The server already printed why the command failed. */
+		return atoi(status) ? -ECANCELED : 0;
+	}
+	pr_err("Server closed connection unexpectedly\n");
+	errno = ECONNRESET;
+err_close:
+	close(fd);
+	return -errno;
+}
+
+static int cmd_complete(struct dl *dl);
+
+static const struct dl_cmd dl_cmds[] = {
+	DL_CMD("help", NULL, DL_CMD_DEFAULT, NULL),
+	DL_CMD_SUB("dev", &dev_table),
+	DL_CMD_SUB("port", &port_table),
+	DL_CMD("monitor", cmd_monitor, DL_CMD_NO_NETNS, NULL),
+	DL_CMD("log", cmd_log, 0, NULL),
+	DL_CMD("analyze", cmd_analyze, 0, NULL),
+	DL_CMD("daemon", cmd_daemon, DL_CMD_NO_NETNS, NULL),
+	DL_CMD("server", cmd_server, DL_CMD_NO_NETNS, NULL),
+	DL_CMD("exporter", cmd_exporter, DL_CMD_NO_NETNS, NULL),
+	DL_CMD("show", cmd_show, DL_CMD_NO_INDEX_MAP, NULL),
+	DL_CMD_SUB("snapshot", &snapshot_table),
+	DL_CMD("complete", cmd_complete, DL_CMD_HIDDEN, NULL),
+};
+
+static void help();
+
+static const struct dl_cmd_table dl_table = {
+	.prefix = "dl",
+	.what = "Object",
+	.cmds = dl_cmds,
+	.count = ARRAY_SIZE(dl_cmds),
+	.help = help,
+};
+
+static void help() {
+	const struct dl_cmd *cmd;
+	bool first = true;
+	unsigned int i;
+	size_t col = 18;
+
+	out_str("Usage: dl [ OPTIONS ] OBJECT { COMMAND | help }\n"
+		"where  OBJECT := {");
+	for (i = 0; i < dl_table.count; i++) {
+		cmd = &dl_table.cmds[i];
+		if ((!cmd->fn && !cmd->sub) || cmd->flags & DL_CMD_HIDDEN)
+			continue;
+		if (!first) {
+			out_mem(" |", 2);
+			col += 2;
+		}
+		if (col + 1 + cmd->len > 70) {
+			out_mem("\n                 ", 18);
+			col = 17;
+		}
+		out_char(' ');
+		out_str(cmd->name);
+		col += 1 + cmd->len;
+		first = false;
+	}
+	out_str(" }\n"
+		"       OPTIONS := { -v/--verbose | -c/--cached[=SHM] |\n"
+		"                    -s/--socket PATH | -t/--timestamp |\n"
+		"                    --stats | --uring | -n/--netns NAME |\n"
+		"                    --all-netns }\n");
+}
 
-	return 0;
+static int cmd_complete(struct dl *dl)
+{
+	return dl_complete(&dl_table, dl_argc(dl), dl->argv);
 }
 
-static void cmd_port_help() {
-	pr_out("Usage: dl port show [DEV/PORT_INDEX]\n");
-	pr_out("Usage: dl port set DEV/PORT_INDEX [ type { eth | ib | auto} ]\n");
-	pr_out("Usage: dl port split DEV/PORT_INDEX count\n");
-	pr_out("Usage: dl port unsplit DEV/PORT_INDEX\n");
+static int dl_cmd(struct dl *dl)
+{
+	return dl_cmd_run(dl, &dl_table);
 }
 
-static int cmd_port(struct dl *dl)
+static int dl_cmd_cached(struct dl *dl)
 {
-	if (dl_argv_match(dl, "help")) {
-		cmd_port_help();
+	if (dl_argv_match(dl, "help") || dl_no_arg(dl)) {
+		help();
 		return 0;
-	} else if (dl_argv_match(dl, "show") || dl_no_arg(dl)) {
-		dl_arg_inc(dl);
-		return cmd_port_show(dl);
-	} else if (dl_argv_match(dl, "set")) {
-		dl_arg_inc(dl);
-		return cmd_port_set(dl);
-	} else if (dl_argv_match(dl, "split")) {
+	} else if (dl_argv_match(dl, "dev")) {
 		dl_arg_inc(dl);
-		return cmd_port_split(dl);
-	} else if (dl_argv_match(dl, "unsplit")) {
+		if (dl_argv_match(dl, "show") || dl_no_arg(dl)) {
+			dl_arg_inc(dl);
+			return cmd_dev_show_cached(dl);
+		}
+	} else if (dl_argv_match(dl, "port")) {
 		dl_arg_inc(dl);
-		return cmd_port_unsplit(dl);
-	} else {
-		pr_err("Command \"%s\" not found\n", dl_argv(dl));
-		return -ENOENT;
+		if (dl_argv_match(dl, "show") || dl_no_arg(dl)) {
+			dl_arg_inc(dl);
+			return cmd_port_show_cached(dl);
+		}
 	}
-	return 0;
+	pr_err("Only \"dev show\" and \"port show\" can be served from cache\n");
+	return -EOPNOTSUPP;
 }
 
-static const char *cmd_name(uint8_t cmd)
-{
-	switch (cmd) {
-	case DEVLINK_CMD_UNSPEC: return "unspec";
-	case DEVLINK_CMD_GET: return "dev get";
-	case DEVLINK_CMD_SET: return "dev set";
-	case DEVLINK_CMD_NEW: return "dev new";
-	case DEVLINK_CMD_DEL: return "dev del";
-	case DEVLINK_CMD_HWMSG_NEW: return "hwmsg";
-	case DEVLINK_CMD_PORT_GET: return "port get";
-	case DEVLINK_CMD_PORT_SET: return "port set";
-	case DEVLINK_CMD_PORT_NEW: return "port net";
-	case DEVLINK_CMD_PORT_DEL: return "port del";
-	default: return "<unknown cmd>";
-	}
-}
+static const char *dl_phase_name[DL_PHASE_MAX] = {
+	[DL_PHASE_OPEN] = "open",
+	[DL_PHASE_INDEX_MAP] = "index map",
+	[DL_PHASE_COMMAND] = "command",
+	[DL_PHASE_OUTPUT] = "output",
+};
 
-static void pr_out_mon_header(uint8_t cmd)
+static void mnlg_stats_add(struct mnlg_stats *sum, const struct mnlg_stats *a,
+			   const struct mnlg_stats *b, int sign)
 {
-	pr_out("[%s] ", cmd_name(cmd));
+	sum->send_calls += a->send_calls + sign * b->send_calls;
+	sum->send_bytes += a->send_bytes + sign * b->send_bytes;
+	sum->recv_calls += a->recv_calls + sign * b->recv_calls;
+	sum->recv_bytes += a->recv_bytes + sign * b->recv_bytes;
+	sum->recv_msgs += a->recv_msgs + sign * b->recv_msgs;
+	sum->recv_wait_ns += a->recv_wait_ns + sign * b->recv_wait_ns;
+	sum->cb_ns += a->cb_ns + sign * b->cb_ns;
+	sum->other_calls += a->other_calls + sign * b->other_calls;
 }
 
-static const char *hwmsg_type_name(uint32_t type)
+/* Accounts everything since the previous call to the given phase. */
+static void dl_phase_end(struct dl *dl, enum dl_phase phase)
 {
-	switch (type) {
-	case DEVLINK_HWMSG_TYPE_MLX_EMAD: return "mlx_emad";
-	case DEVLINK_HWMSG_TYPE_MLX_CMD_REG: return "mlx_cmd_reg";
-	default: return "<unknown type>";
-	}
+	struct dl_phase_stats *ps = &dl->stats.phases[phase];
+	struct mnlg_stats nl;
+	uint64_t now;
+
+	if (!dl->show_stats)
+		return;
+	now = now_ns();
+	ps->wall_ns += now - dl->stats.mark_ns;
+	dl->stats.mark_ns = now;
+	if (!dl->nlg)
+		return;
+	mnlg_socket_stats_get(dl->nlg, &nl);
+	mnlg_stats_add(&ps->nl, &nl, &dl->stats.nl_mark, -1);
+	dl->stats.nl_mark = nl;
 }
 
-static const char *hwmsg_dir_name(uint8_t dir)
+static void pr_err_phase_stats(const char *name,
+			       const struct dl_phase_stats *ps)
 {
-	switch (dir) {
-	case DEVLINK_HWMSG_DIR_TO_HW: return "to_hw";
-	case DEVLINK_HWMSG_DIR_FROM_HW: return "from_hw";
-	default: return "<unknown dir>";
-	}
+	const struct mnlg_stats *nl = &ps->nl;
+
+	pr_err("%-10s %9" PRIu64 " %8" PRIu64 " %9" PRIu64 " %9" PRIu64
+	       " %6" PRIu64 " %9" PRIu64 " %9" PRIu64 "\n", name,
+	       ps->wall_ns / 1000,
+	       nl->send_calls + nl->recv_calls + nl->other_calls,
+	       nl->send_bytes, nl->recv_bytes, nl->recv_msgs,
+	       nl->recv_wait_ns / 1000, nl->cb_ns / 1000);
 }
 
-static void pr_out_hwmsg(struct nlattr **tb)
+static void dl_stats_print(struct dl *dl)
 {
-	uint32_t index = mnl_attr_get_u32(tb[DEVLINK_ATTR_INDEX]);
-	uint32_t type = mnl_attr_get_u32(tb[DEVLINK_ATTR_HWMSG_TYPE]);
-	uint8_t dir = mnl_attr_get_u8(tb[DEVLINK_ATTR_HWMSG_DIR]);
-	uint16_t payload_len = mnl_attr_get_payload_len(tb[DEVLINK_ATTR_HWMSG_PAYLOAD]);
-	unsigned char *payload = mnl_attr_get_payload(tb[DEVLINK_ATTR_HWMSG_PAYLOAD]);
+	struct dl_phase_stats total = {};
+	struct mnlg_stats zero = {};
 	int i;
 
-	pr_out("%d: %s %s %d bytes\n", index, hwmsg_type_name(type),
-	       hwmsg_dir_name(dir), payload_len);
-	for (i = 0; i < payload_len; i++) {
-		if (i) {
-			if (i % 8 == 0) {
-				pr_out2("\n");
-			} else {
-				pr_out2(" ");
-			}
-		}
-		if (i % 8 == 0)
-			pr_out2("  0x%04x:  ", i);
-		pr_out2("%02x", payload[i]);
+	pr_err("%-10s %9s %8s %9s %9s %6s %9s %9s\n", "phase", "wall_us",
+	       "syscalls", "sent_B", "recv_B", "msgs", "recv_us", "cb_us");
+	for (i = 0; i < DL_PHASE_MAX; i++) {
+		pr_err_phase_stats(dl_phase_name[i], &dl->stats.phases[i]);
+		total.wall_ns += dl->stats.phases[i].wall_ns;
+		mnlg_stats_add(&total.nl, &dl->stats.phases[i].nl, &zero, 1);
 	}
-	if (i != 0)
-		pr_out2("\n");
+	pr_err_phase_stats("total", &total);
+	pr_err("stdout: %" PRIu64 " writes, %" PRIu64 " bytes, %" PRIu64
+	       " us\n", g_out.write_calls, g_out.write_bytes,
+	       g_out.write_ns / 1000);
 }
 
-static bool check_cmd_hwmsg(struct nlattr **tb)
+/* Flags of the commands argv resolves to, looked up as dl_cmd_run() does. */
+static unsigned int dl_cmd_flags(int argc, char **argv)
 {
-	uint32_t type;
-	uint8_t dir;
+	const struct dl_cmd_table *table = &dl_table;
+	const struct dl_cmd *cmd;
+	unsigned int flags = 0;
+	int i;
 
-	if (!tb[DEVLINK_ATTR_INDEX] ||
-	    !tb[DEVLINK_ATTR_HWMSG_PAYLOAD] ||
-	    !tb[DEVLINK_ATTR_HWMSG_TYPE] ||
-	    !tb[DEVLINK_ATTR_HWMSG_DIR])
-		return false;
-	type = mnl_attr_get_u32(tb[DEVLINK_ATTR_HWMSG_TYPE]);
-	if (type != DEVLINK_HWMSG_TYPE_MLX_EMAD)
-		return false;
-	dir = mnl_attr_get_u8(tb[DEVLINK_ATTR_HWMSG_DIR]);
-	if (dir != DEVLINK_HWMSG_DIR_TO_HW && dir != DEVLINK_HWMSG_DIR_FROM_HW)
-		return false;
-	return true;
+	for (i = 0; i < argc; i++) {
+		cmd = dl_cmd_lookup(table, argv[i]);
+		if (!cmd)
+			break;
+		flags |= cmd->flags;
+		if (!cmd->sub)
+			break;
+		table = cmd->sub;
+	}
+	return flags;
 }
 
-static int cmd_mon_show_cb(const struct nlmsghdr *nlh, void *data)
+static bool dl_no_index_map(int argc, char **argv)
 {
-	struct dl *dl = data;
-	struct nlattr *tb[DEVLINK_ATTR_MAX + 1] = {};
-	struct genlmsghdr *genl = mnl_nlmsg_get_payload(nlh);
-	uint8_t cmd = genl->cmd;
-
-	switch (cmd) {
-	case DEVLINK_CMD_GET: /* fall through */
-	case DEVLINK_CMD_SET: /* fall through */
-	case DEVLINK_CMD_NEW: /* fall through */
-	case DEVLINK_CMD_DEL:
-		mnl_attr_parse(nlh, sizeof(*genl), attr_cb, tb);
-		if (!tb[DEVLINK_ATTR_INDEX] || !tb[DEVLINK_ATTR_NAME])
-			return MNL_CB_ERROR;
-		pr_out_mon_header(genl->cmd);
-		pr_out_dev(tb);
-		break;
-	case DEVLINK_CMD_HWMSG_NEW:
-		mnl_attr_parse(nlh, sizeof(*genl), attr_cb, tb);
-		if (!check_cmd_hwmsg(tb))
-			return MNL_CB_ERROR;
-		pr_out_mon_header(genl->cmd);
-		pr_out_hwmsg(tb);
-		break;
-	case DEVLINK_CMD_PORT_GET: /* fall through */
-	case DEVLINK_CMD_PORT_SET: /* fall through */
-	case DEVLINK_CMD_PORT_NEW: /* fall through */
-	case DEVLINK_CMD_PORT_DEL:
-		mnl_attr_parse(nlh, sizeof(*genl), attr_cb, tb);
-		if (!tb[DEVLINK_ATTR_INDEX] || !tb[DEVLINK_ATTR_PORT_INDEX])
-			return MNL_CB_ERROR;
-		pr_out_mon_header(genl->cmd);
-		pr_out_port(dl, tb);
-		break;
-	}
-	return MNL_CB_OK;
+	return dl_cmd_flags(argc, argv) & DL_CMD_NO_INDEX_MAP;
 }
 
-static int cmd_monitor(struct dl *dl)
+static int dl_init(struct dl *dl, int argc, char **argv)
 {
 	int err;
 
-	err = _mnlg_socket_group_add(dl->nlg, DEVLINK_GENL_MCGRP_CONFIG_NAME);
-	if (err)
-		return err;
-	err = _mnlg_socket_group_add(dl->nlg, DEVLINK_GENL_MCGRP_HWMSG_NAME);
-	if (err)
-		return err;
-	err = _mnlg_socket_recv_run(dl->nlg, cmd_mon_show_cb, dl);
-	if (err)
-		return err;
-	return 0;
-}
-
-static void help() {
-	pr_out("Usage: dl [ OPTIONS ] OBJECT { COMMAND | help }\n"
-	       "where  OBJECT := { dev | port | monitor }\n"
-	       "       OPTIONS := { -v/--verbose }\n");
-}
+	dl->argc = argc;
+	dl->argv = argv;
 
-static int dl_cmd(struct dl *dl)
-{
-	if (dl_argv_match(dl, "help") || dl_no_arg(dl)) {
-		help();
+	dl->nlg = mnlg_socket_open(DEVLINK_GENL_NAME, DEVLINK_GENL_VERSION);
+	if (!dl->nlg) {
+		pr_err("Failed to connect to devlink Netlink\n");
+		return -errno;
+	}
+	/* Without io_uring the plain syscalls do just as well. */
+	if (dl->uring && mnlg_socket_uring_enable(dl->nlg) && g_verbosity)
+		pr_err("io_uring not available (%s)\n", strerror(errno));
+	dl_phase_end(dl, DL_PHASE_OPEN);
+
+	/* "dl show" learns the devices from its own dump. */
+	if (dl_no_index_map(argc, argv)) {
+		list_init(&dl->index_map_list);
 		return 0;
-	} else if (dl_argv_match(dl, "dev")) {
-		dl_arg_inc(dl);
-		return cmd_dev(dl);
-	} else if (dl_argv_match(dl, "port")) {
-		dl_arg_inc(dl);
-		return cmd_port(dl);
-	} else if (dl_argv_match(dl, "monitor")) {
-		dl_arg_inc(dl);
-		return cmd_monitor(dl);
-	} else {
-		pr_err("Object \"%s\" not found\n", dl_argv(dl));
-		return -ENOENT;
 	}
+	err = index_map_init(dl);
+	if (err) {
+		pr_err("Failed to create index map\n");
+		goto err_index_map_create;
+	}
+	dl_phase_end(dl, DL_PHASE_INDEX_MAP);
 	return 0;
+
+err_index_map_create:
+	mnlg_socket_close(dl->nlg);
+	return err;
 }
 
-static int dl_init(struct dl *dl, int argc, char **argv)
+static int dl_init_cached(struct dl *dl, int argc, char **argv,
+			  const char *cache_name)
 {
 	int err;
 
 	dl->argc = argc;
 	dl->argv = argv;
 
-	dl->nlg = mnlg_socket_open(DEVLINK_GENL_NAME, DEVLINK_GENL_VERSION);
-	if (!dl->nlg) {
-		pr_err("Failed to connect to devlink Netlink\n");
+	dl->cache = dlcache_map(cache_name);
+	if (!dl->cache) {
+		pr_err("Failed to map devlink cache, is \"dl daemon\" running?\n");
 		return -errno;
 	}
+	if (!dlcache_alive(dl->cache))
+		pr_err("Warning: devlink cache is stale, daemon is gone\n");
+	dl_phase_end(dl, DL_PHASE_OPEN);
 
-	err = index_map_init(dl);
+	err = index_map_init_cached(dl);
 	if (err) {
-		pr_err("Failed to create index map\n");
+		/* A stuck cache is not fatal, main() asks the kernel. */
+		if (err != -EBUSY)
+			pr_err("Failed to create index map\n");
 		goto err_index_map_create;
 	}
+	dl_phase_end(dl, DL_PHASE_INDEX_MAP);
 	return 0;
 
 err_index_map_create:
-	mnlg_socket_close(dl->nlg);
+	dlcache_unmap(dl->cache);
+	dl->cache = NULL;
 	return err;
 }
 
+/* Objects which only work on files and need no devlink socket. */
+static bool dl_offline(int argc, char **argv)
+{
+	return argc && (strcmpx(argv[0], "log") == 0 ||
+			strcmpx(argv[0], "analyze") == 0 ||
+			strcmpx(argv[0], "complete") == 0);
+}
+
+static int dl_init_offline(struct dl *dl, int argc, char **argv)
+{
+	dl->argc = argc;
+	dl->argv = argv;
+	list_init(&dl->index_map_list);
+	return 0;
+}
+
 static void dl_fini(struct dl *dl)
 {
+	port_tbl_fini(dl);
 	index_map_fini(dl);
-	mnlg_socket_close(dl->nlg);
+	if (dl->cache)
+		dlcache_unmap(dl->cache);
+	else if (dl->nlg)
+		mnlg_socket_close(dl->nlg);
 }
 
 static struct dl *dl_alloc()
@@ -956,27 +7044,260 @@ static void dl_free(struct dl *dl)
 	free(dl);
 }
 
+#define NETNS_RUN_DIR "/var/run/netns"
+
+/* NAME is looked up the way "ip netns" names them, a path is taken as is. */
+static int netns_switch(const char *name)
+{
+	char path[PATH_MAX];
+	int err = 0;
+	int fd;
+
+	if (strchr(name, '/'))
+		snprintf(path, sizeof(path), "%s", name);
+	else
+		snprintf(path, sizeof(path), "%s/%s", NETNS_RUN_DIR, name);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	if (setns(fd, CLONE_NEWNET) < 0)
+		err = -errno;
+	close(fd);
+	return err;
+}
+
+struct netns_job {
+	pthread_t thread;
+	char *name;
+	int argc;
+	char **argv;
+	bool timestamp;
+	bool uring;
+	int err;
+	char *out;
+	size_t out_len;
+};
+
+static void argv_free(char **argv)
+{
+	char **arg;
+
+	for (arg = argv; *arg; arg++)
+		free(*arg);
+	free(argv);
+}
+
+static char **argv_dup(int argc, char **argv)
+{
+	char **dup;
+	int i;
+
+	dup = calloc(argc + 1, sizeof(*dup));
+	if (!dup)
+		return NULL;
+	for (i = 0; i < argc; i++) {
+		dup[i] = strdup(argv[i]);
+		if (!dup[i]) {
+			argv_free(dup);
+			return NULL;
+		}
+	}
+	return dup;
+}
+
+/* A daemon which died halfway through an update leaves the cache stuck,
+ * the same answers are a netlink query away.
+ */
+static int dl_cache_fallback(struct dl *dl, int argc, char **argv)
+{
+	pr_err("Devlink cache is stuck in an update, querying the kernel\n");
+	dl_fini(dl);
+	dl->cache = NULL;
+	return dl_init(dl, argc, argv);
+}
+
+/* setns() only moves the calling thread, each runs in its own. */
+static void *netns_worker(void *data)
+{
+	struct netns_job *job = data;
+	struct dl *dl;
+	char **argv;
+
+	out_capture_start();
+	job->err = netns_switch(job->name);
+	if (job->err)
+		goto out;
+	/* Parsing may split arguments in place. */
+	argv = argv_dup(job->argc, job->argv);
+	if (!argv) {
+		job->err = -ENOMEM;
+		goto out;
+	}
+	dl = dl_alloc();
+	if (!dl) {
+		job->err = -ENOMEM;
+		goto err_dl_alloc;
+	}
+	dl->uring = job->uring;
+	dl->all_netns = true;
+	job->err = dl_init(dl, job->argc, argv);
+	if (!job->err) {
+		dl->timestamp = job->timestamp;
+		job->err = dl_cmd(dl);
+		dl_fini(dl);
+	}
+	dl_free(dl);
+err_dl_alloc:
+	argv_free(argv);
+out:
+	job->out = out_capture_end(&job->out_len);
+	return NULL;
+}
+
+static int netns_filter(const struct dirent *dirent)
+{
+	return dirent->d_name[0] != '.';
+}
+
+/* Commands which never finish, or which must not run more than once.
+ * Options which make a command run forever are refused by the command
+ * itself, see dl_all_netns_cmd_refuse().
+ */
+static bool dl_all_netns_refuse(int argc, char **argv)
+{
+	return dl_cmd_flags(argc, argv) & DL_CMD_NO_NETNS;
+}
+
+/* Runs the command in every named namespace at once, their output is
+ * printed one namespace after another, each under its name.
+ */
+static int dl_all_netns(int argc, char **argv, bool timestamp, bool uring)
+{
+	struct dirent **names;
+	struct netns_job *jobs;
+	unsigned int started;
+	int failed = 0;
+	int count;
+	int i;
+
+	if (dl_all_netns_refuse(argc, argv) || dl_offline(argc, argv)) {
+		pr_err("Command can not be run in all namespaces\n");
+		return -EINVAL;
+	}
+	count = scandir(NETNS_RUN_DIR, &names, netns_filter, alphasort);
+	if (count < 0) {
+		if (errno == ENOENT)
+			return 0;
+		pr_err("Failed to list %s\n", NETNS_RUN_DIR);
+		return -errno;
+	}
+	jobs = calloc(count ? count : 1, sizeof(*jobs));
+	if (!jobs) {
+		failed = -ENOMEM;
+		goto err_jobs_alloc;
+	}
+
+	for (started = 0; started < count; started++) {
+		jobs[started].name = names[started]->d_name;
+		jobs[started].argc = argc;
+		jobs[started].argv = argv;
+		jobs[started].timestamp = timestamp;
+		jobs[started].uring = uring;
+		if (pthread_create(&jobs[started].thread, NULL, netns_worker,
+				   &jobs[started]))
+			break;
+	}
+	/* Namespaces which did not get a thread of their own go here. */
+	for (i = started; i < count; i++)
+		netns_worker(&jobs[i]);
+
+	for (i = 0; i < count; i++) {
+		if (i < started)
+			pthread_join(jobs[i].thread, NULL);
+		out_str("\nnetns: ");
+		out_str(jobs[i].name);
+		out_char('\n');
+		if (jobs[i].out)
+			out_mem(jobs[i].out, jobs[i].out_len);
+		free(jobs[i].out);
+		if (jobs[i].err) {
+			out_flush();
+			pr_err("netns %s: Command call failed (%s)\n",
+			       jobs[i].name, strerror(-jobs[i].err));
+			failed = jobs[i].err;
+		}
+	}
+	free(jobs);
+
+err_jobs_alloc:
+	for (i = 0; i < count; i++)
+		free(names[i]);
+	free(names);
+	return failed;
+}
+
 int main(int argc, char **argv)
 {
 	static const struct option long_options[] = {
 		{ "verbose",		no_argument,		NULL, 'v' },
+		{ "cached",		optional_argument,	NULL, 'c' },
+		{ "socket",		required_argument,	NULL, 's' },
+		{ "timestamp",		no_argument,		NULL, 't' },
+		{ "stats",		no_argument,		NULL, 'S' },
+		{ "uring",		no_argument,		NULL, 'U' },
+		{ "netns",		required_argument,	NULL, 'n' },
+		{ "all-netns",		no_argument,		NULL, 'A' },
 		{ NULL, 0, NULL, 0 }
 	};
+	const char *socket_path = NULL;
+	const char *cache_name = NULL;
+	char **cached_argv = NULL;
+	bool show_stats = false;
+	bool timestamp = false;
+	bool uring = false;
+	bool all_netns = false;
+	const char *netns = NULL;
+	bool cached = false;
 	struct dl *dl;
 	int opt;
 	int err;
 	int ret;
 
-	while ((opt = getopt_long(argc, argv, "v",
+	out_init();
+
+	while ((opt = getopt_long(argc, argv, "+vc::s:tn:",
 				  long_options, NULL)) >= 0) {
 
 		switch(opt) {
 		case 'v':
 			g_verbosity++;
 			break;
+		case 'c':
+			cached = true;
+			cache_name = optarg;
+			break;
+		case 's':
+			socket_path = optarg;
+			break;
+		case 't':
+			timestamp = true;
+			break;
+		case 'S':
+			show_stats = true;
+			break;
+		case 'U':
+			uring = true;
+			break;
+		case 'n':
+			netns = optarg;
+			break;
+		case 'A':
+			all_netns = true;
+			break;
 		default:
 			pr_err("Unknown option.\n");
 			help();
+			out_flush();
 			return EXIT_FAILURE;
 		}
 	}
@@ -984,19 +7305,70 @@ int main(int argc, char **argv)
 	argc -= optind;
 	argv += optind;
 
+	/* With a socket, everything but "server" itself is forwarded. */
+	if (socket_path && !(argc && strcmpx(argv[0], "server") == 0))
+		return dl_client(socket_path, argc, argv) ?
+		       EXIT_FAILURE : EXIT_SUCCESS;
+
+	if (all_netns) {
+		err = dl_all_netns(argc, argv, timestamp, uring);
+		out_flush();
+		return err ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+	if (netns) {
+		err = netns_switch(netns);
+		if (err) {
+			pr_err("Failed to enter network namespace \"%s\" (%s)\n",
+			       netns, strerror(-err));
+			return EXIT_FAILURE;
+		}
+	}
+
 	dl = dl_alloc();
 	if (!dl) {
 		pr_err("Failed to allocate memory for devlink\n");
 		return EXIT_FAILURE;
 	}
-
-	err = dl_init(dl, argc, argv);
+	dl->show_stats = show_stats;
+	dl->uring = uring;
+	dl->stats.mark_ns = now_ns();
+
+	if (cached) {
+		/* Parsing splits arguments in place, the fallback needs them
+		 * as given.
+		 */
+		cached_argv = argv_dup(argc, argv);
+		if (!cached_argv) {
+			pr_err("Failed to allocate memory for arguments\n");
+			ret = EXIT_FAILURE;
+			goto dl_free;
+		}
+		err = dl_init_cached(dl, argc, cached_argv, cache_name);
+		if (err == -EBUSY) {
+			cached = false;
+			err = dl_cache_fallback(dl, argc, argv);
+		}
+	} else if (dl_offline(argc, argv))
+		err = dl_init_offline(dl, argc, argv);
+	else
+		err = dl_init(dl, argc, argv);
 	if (err) {
 		ret = EXIT_FAILURE;
 		goto dl_free;
 	}
-
-	err = dl_cmd(dl);
+	dl->socket_path = socket_path;
+	dl->timestamp = timestamp;
+
+	err = cached ? dl_cmd_cached(dl) : dl_cmd(dl);
+	if (cached && err == -EBUSY) {
+		err = dl_cache_fallback(dl, argc, argv);
+		if (err) {
+			ret = EXIT_FAILURE;
+			goto dl_free;
+		}
+		err = dl_cmd(dl);
+	}
+	dl_phase_end(dl, DL_PHASE_COMMAND);
 	if (err) {
 		pr_err("Command call failed (%s)\n", strerror(-err));
 		ret = EXIT_FAILURE;
@@ -1006,9 +7378,16 @@ int main(int argc, char **argv)
 	ret = EXIT_SUCCESS;
 
 dl_fini:
+	out_flush();
+	dl_phase_end(dl, DL_PHASE_OUTPUT);
+	if (dl->show_stats)
+		dl_stats_print(dl);
 	dl_fini(dl);
 dl_free:
 	dl_free(dl);
+	if (cached_argv)
+		argv_free(cached_argv);
+	out_flush();
 
 	return ret;
 }